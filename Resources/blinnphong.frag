@@ -1,22 +1,132 @@
 #version 330
-uniform sampler2D colorMap;
-uniform sampler2D shadowMap;
 
-uniform bool hasTexCoords;
+// Feature keys, see ShaderVariants.h and blinnphong.vert:
+//   TEXTURED      colors come from colorMap
+//   SHADOWED      the main light is shadowed by the cascades
+//   POINT_LIGHTS  adds the clustered point lights
+
+#ifdef TEXTURED
+uniform sampler2DArray colorMap;
+#endif
+
+#ifdef SHADOWED
+uniform sampler2DArrayShadow shadowMap;
+#endif
+
+#ifdef POINT_LIGHTS
+// Point lights sorted into clusters, see ClusteredLights.h
+uniform usamplerBuffer clusterGrid;
+uniform usamplerBuffer lightIndices;
+uniform samplerBuffer lightData;
+#endif
+
+layout(std140) uniform FrameData {
+    mat4 projMatrix;
+    mat4 viewMatrix;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 lightColor;
+};
+
+// See MaterialData in UniformBuffer.h. The texture layer and the atlas
+// region it occupies are part of the material.
+struct Material {
+    vec4 ka;
+    vec4 kd;
+    vec4 uvTransform;
+    float ks;
+    float textureLayer;
+};
+
+layout(std140) uniform MaterialData {
+    Material materials[256];
+};
+
+// Comes per instance, see blinnphong.vert
+flat in int passMaterialIndex;
 
 in vec3 passPosition;
 in vec3 passNormal;
+#ifdef TEXTURED
 in vec2 passTexCoord;
-in vec4 passShadowCoord;
-in vec3 passLightColor;
-in vec3 lightPos;
-in vec3 passkd;
-in vec3 passka;
-in float passks;
+#endif
 
 out vec4 finalColor;
 
+#ifdef SHADOWED
+// See ShadowData in UniformBuffer.h. Cascade i covers view depths up to
+// cascadeSplits[i].
+layout(std140) uniform ShadowData {
+    mat4 cascadeMatrices[4];
+    vec4 cascadeSplits;
+};
+
+// How much of the light reaches a world position, 4 filtered taps in the
+// nearest cascade that covers it
+float shadowFactor(vec3 position) {
+    float depth = -(viewMatrix * vec4(position, 1)).z;
+    if (depth > cascadeSplits[3])
+        return 1.0;
+
+    int cascade = 0;
+    for (int i = 0; i < 3; i++) {
+        if (depth > cascadeSplits[i])
+            cascade = i + 1;
+    }
+
+    vec4 coord = cascadeMatrices[cascade] * vec4(position, 1);
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    lit += texture(shadowMap, vec4(coord.xy + vec2(-0.5, -0.5) * texel, cascade, coord.z));
+    lit += texture(shadowMap, vec4(coord.xy + vec2(0.5, -0.5) * texel, cascade, coord.z));
+    lit += texture(shadowMap, vec4(coord.xy + vec2(-0.5, 0.5) * texel, cascade, coord.z));
+    lit += texture(shadowMap, vec4(coord.xy + vec2(0.5, 0.5) * texel, cascade, coord.z));
+    return lit * 0.25;
+}
+#endif
+
+#ifdef POINT_LIGHTS
+// See LightGridData in UniformBuffer.h
+layout(std140) uniform LightGridData {
+    vec4 gridSize;
+    vec4 gridScale;
+};
+
+// Blinn-Phong from the point lights of the fragment's cluster, which fade
+// out smoothly at their radius
+vec3 clusteredLights(vec3 position, vec3 normal, vec3 albedo, float shininess) {
+    float depth = -(viewMatrix * vec4(position, 1)).z;
+    ivec3 cell = ivec3(vec3(gl_FragCoord.xy * gridScale.xy, log(max(depth, 0.0001)) * gridScale.z + gridScale.w));
+    cell = clamp(cell, ivec3(0), ivec3(gridSize.xyz) - 1);
+    int cluster = (cell.z * int(gridSize.y) + cell.y) * int(gridSize.x) + cell.x;
+    uvec2 range = texelFetch(clusterGrid, cluster).xy;
+
+    vec3 viewDir = normalize(cameraPosition.xyz - position);
+    vec3 result = vec3(0);
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(lightIndices, int(range.x + i)).x);
+        vec4 positionRadius = texelFetch(lightData, light * 2);
+        vec3 color = texelFetch(lightData, light * 2 + 1).rgb;
+
+        vec3 toLight = positionRadius.xyz - position;
+        float distance = max(length(toLight), 0.0001);
+        vec3 lightDir = toLight / distance;
+        float falloff = clamp(1.0 - pow(distance / positionRadius.w, 4.0), 0.0, 1.0);
+        float attenuation = falloff * falloff / (distance * distance + 1.0);
+
+        float diffuse = max(dot(normal, lightDir), 0.0);
+        float specular = pow(max(dot(normal, normalize(lightDir + viewDir)), 0.0), shininess);
+        result += color * attenuation * (albedo * diffuse + specular);
+    }
+    return result;
+}
+#endif
+
 void main() {
+    Material material = materials[passMaterialIndex];
+    vec3 lightPos = lightPosition.xyz;
+    vec3 passLightColor = lightColor.rgb;
+
     vec3 normal = normalize(passNormal);	
 	//lightPos = vec3(sin(time), 1.0, cos(time));
     vec3 lightDir   = normalize(lightPos - passPosition.xyz);
@@ -24,21 +134,30 @@ void main() {
 	vec3 halfwayDir = normalize(lightDir + viewDir);
 
 		
+#ifdef TEXTURED
+    vec3 color = texture(colorMap, vec3(passTexCoord * material.uvTransform.xy + material.uvTransform.zw, material.textureLayer)).rgb;
+#else
     vec3 color = vec3(1, 1, 1);
-    if (hasTexCoords) {
-        color = texture(colorMap, passTexCoord).rgb;
-	}
+#endif
 
 	//Ambient
-	vec4 ambient = vec4(passka, 1);
+	vec4 ambient = vec4(material.ka.rgb, 1);
 
 	//Diffuse
-	vec4 diffuse = vec4(passkd, 1) * max(dot(lightDir, normal), 0.0) * vec4(passLightColor,1);
+	vec4 diffuse = vec4(material.kd.rgb * color, 1) * max(dot(lightDir, normal), 0.0) * vec4(passLightColor,1);
 
 	//Specular
-	float spec = pow(max(dot(normal, halfwayDir), 0.0), passks);
+	float spec = pow(max(dot(normal, halfwayDir), 0.0), material.ks);
 	vec4 specular = vec4((passLightColor * spec),1);
 	
-    finalColor = specular + ambient + diffuse;
+#ifdef SHADOWED
+    float shadow = shadowFactor(passPosition);
+#else
+    float shadow = 1.0;
+#endif
+    finalColor = ambient + shadow * (specular + diffuse);
+#ifdef POINT_LIGHTS
+    finalColor.rgb += clusteredLights(passPosition, normal, material.kd.rgb * color, material.ks);
+#endif
 }
 
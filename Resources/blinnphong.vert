@@ -1,40 +1,65 @@
 #version 330
 
-uniform mat4 projMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 modelMatrix;
-uniform vec3 lightColor;
-uniform vec3 lightPosition;
-uniform vec3 kd;
-uniform vec3 ka;
-uniform float ks;
-uniform float time;
+// Feature keys, see ShaderVariants.h:
+//   INSTANCED  model matrix and material per instance, see InstanceSet.h
+//   INDIRECT   the same from a buffer texture, see MultiDrawBatch.h
+//   TEXTURED   passes the texture coordinates on
+// Every draw is one or the other of INSTANCED and INDIRECT.
+
+// Shared by all programs, see FrameData in UniformBuffer.h
+layout(std140) uniform FrameData {
+    mat4 projMatrix;
+    mat4 viewMatrix;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 lightColor;
+};
 
 in vec4 position;
 in vec3 normal;
-in vec2 texCoord;
+
+#if defined(INSTANCED)
+in mat4 instanceMatrix;
+in int instanceMaterial;
+#elif defined(INDIRECT)
+// Five texels per instance
+uniform samplerBuffer instanceData;
+in int instanceIndex;
+#else
+#error Needs INSTANCED or INDIRECT
+#endif
 
 out vec3 passPosition;
 out vec3 passNormal;
+
+flat out int passMaterialIndex;
+
+#ifdef TEXTURED
+in vec2 texCoord;
 out vec2 passTexCoord;
-out vec4 passShadowCoord;
-out vec3 lightPos;
-out vec3 passLightColor;
-out vec3 passkd;
-out vec3 passka;
-out float passks;
+#endif
+
+// The depth pre-pass computes the same, see depth_instanced.vert
+invariant gl_Position;
 
 void main() {
+#if defined(INSTANCED)
+    mat4 modelMatrix = instanceMatrix;
+    passMaterialIndex = instanceMaterial;
+#elif defined(INDIRECT)
+    int base = instanceIndex * 5;
+    mat4 modelMatrix = mat4(texelFetch(instanceData, base),
+                            texelFetch(instanceData, base + 1),
+                            texelFetch(instanceData, base + 2),
+                            texelFetch(instanceData, base + 3));
+    passMaterialIndex = int(texelFetch(instanceData, base + 4).x);
+#endif
+
     gl_Position = projMatrix * viewMatrix * modelMatrix * position;
-    
-	// Pass to the fragment shader.
+
     passPosition = (modelMatrix * position).xyz;
     passNormal = (modelMatrix * vec4(normal, 0)).xyz; // Same as normal, z and w are 0.
+#ifdef TEXTURED
     passTexCoord = texCoord;
-	passLightColor = lightColor;
-	passkd = kd;
-	passks = ks;
-	passka = ka;
-	lightPos = lightPosition;
+#endif
 }
-	
\ No newline at end of file
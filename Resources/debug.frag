@@ -0,0 +1,9 @@
+#version 330
+
+in vec4 passColor;
+
+out vec4 fragColor;
+
+void main() {
+    fragColor = passColor;
+}
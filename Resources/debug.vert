@@ -0,0 +1,21 @@
+#version 330
+
+// Shared by all programs, see FrameData in UniformBuffer.h
+layout(std140) uniform FrameData {
+    mat4 projMatrix;
+    mat4 viewMatrix;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 lightColor;
+};
+
+// World space, see DebugDraw.h
+in vec4 position;
+in vec4 color;
+
+out vec4 passColor;
+
+void main() {
+    gl_Position = projMatrix * viewMatrix * position;
+    passColor = color;
+}
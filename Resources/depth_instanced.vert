@@ -0,0 +1,23 @@
+#version 330
+
+// Shared by all programs, see FrameData in UniformBuffer.h
+layout(std140) uniform FrameData {
+    mat4 projMatrix;
+    mat4 viewMatrix;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 lightColor;
+};
+
+in vec4 position;
+
+// Per instance, see InstanceData in InstanceSet.h
+in mat4 instanceMatrix;
+
+// The opaque pass tests GL_EQUAL against this depth, so the position has
+// to come out exactly as in blinnphong.vert with INSTANCED
+invariant gl_Position;
+
+void main() {
+    gl_Position = projMatrix * viewMatrix * instanceMatrix * position;
+}
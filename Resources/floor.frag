@@ -0,0 +1,11 @@
+#version 330
+
+uniform sampler2D colorMap;
+
+in vec2 passTexCoord;
+
+out vec4 fragColor;
+
+void main() {
+    fragColor = vec4(texture(colorMap, passTexCoord).rgb, 1);
+}
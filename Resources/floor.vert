@@ -0,0 +1,21 @@
+#version 330
+
+// Shared by all programs, see FrameData in UniformBuffer.h
+layout(std140) uniform FrameData {
+    mat4 projMatrix;
+    mat4 viewMatrix;
+    vec4 cameraPosition;
+    vec4 lightPosition;
+    vec4 lightColor;
+};
+
+// World space, see Application::createFloor
+in vec3 position;
+in vec2 texCoord;
+
+out vec2 passTexCoord;
+
+void main() {
+    gl_Position = projMatrix * viewMatrix * vec4(position, 1);
+    passTexCoord = texCoord;
+}
@@ -1,20 +1,14 @@
 #version 330
 
-uniform mat4 projMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 modelMatrix;
+// Light space of the cascade being drawn, see ShadowCascades
+uniform mat4 shadowMatrix;
 
+// Drawn from the position-only streams, see Model.h, one instance per
+// caster of the same model
 in vec4 position;
-in vec3 normal;
-in vec2 texCoord;
-
-out vec3 passNormal;
-out vec2 passTexCoord;
+in mat4 instanceMatrix;
 
 void main()
 {
-    gl_Position = projMatrix * viewMatrix * modelMatrix * position;
-    
-    passNormal = (modelMatrix * vec4(normal, 0)).xyz;
-    passTexCoord = texCoord;
+    gl_Position = shadowMatrix * instanceMatrix * position;
 }
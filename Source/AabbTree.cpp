@@ -0,0 +1,488 @@
+#include "AabbTree.h"
+
+#include <algorithm>
+
+namespace
+{
+    const int NULL_NODE = -1;
+
+    // Deeper than any balanced tree could get with an int for the node count
+    const int MAX_STACK = 256;
+
+    enum Overlap
+    {
+        OVERLAP_NONE,
+        OVERLAP_PARTIAL,
+        OVERLAP_CONTAINS
+    };
+
+    Aabb combine(const Aabb& a, const Aabb& b)
+    {
+        Aabb result;
+        for (int c = 0; c < 3; c++) {
+            result.min[c] = std::min(a.min[c], b.min[c]);
+            result.max[c] = std::max(a.max[c], b.max[c]);
+        }
+        return result;
+    }
+
+    bool contains(const Aabb& outer, const Aabb& inner)
+    {
+        for (int c = 0; c < 3; c++) {
+            if (inner.min[c] < outer.min[c] || inner.max[c] > outer.max[c])
+                return false;
+        }
+        return true;
+    }
+
+    bool overlaps(const Aabb& a, const Aabb& b)
+    {
+        for (int c = 0; c < 3; c++) {
+            if (a.max[c] < b.min[c] || a.min[c] > b.max[c])
+                return false;
+        }
+        return true;
+    }
+
+    // Cost of a node in the insertion heuristic
+    float area(const Aabb& box)
+    {
+        float x = box.max[0] - box.min[0];
+        float y = box.max[1] - box.min[1];
+        float z = box.max[2] - box.min[2];
+        return 2 * (x * y + y * z + z * x);
+    }
+
+    class FrustumTest
+    {
+    public:
+        const Frustum* frustum;
+
+        int operator()(const Aabb& box) const
+        {
+            int result = OVERLAP_CONTAINS;
+            for (int p = 0; p < 6; p++) {
+                const float* plane = frustum->planes[p];
+
+                // Corners furthest along and against the normal
+                float furthest = plane[3], nearest = plane[3];
+                for (int c = 0; c < 3; c++) {
+                    furthest += plane[c] * (plane[c] >= 0 ? box.max[c] : box.min[c]);
+                    nearest += plane[c] * (plane[c] >= 0 ? box.min[c] : box.max[c]);
+                }
+                if (furthest < 0)
+                    return OVERLAP_NONE;
+                if (nearest < 0)
+                    result = OVERLAP_PARTIAL;
+            }
+            return result;
+        }
+    };
+
+    // An axis parallel ray gives infinities that compare fine
+    bool slabs(const Aabb& box, const float* origin, const float* inverse, float maxDistance, float& enter)
+    {
+        enter = 0;
+        float exit = maxDistance;
+        for (int c = 0; c < 3; c++) {
+            float t0 = (box.min[c] - origin[c]) * inverse[c];
+            float t1 = (box.max[c] - origin[c]) * inverse[c];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            enter = std::max(enter, t0);
+            exit = std::min(exit, t1);
+        }
+        return enter <= exit;
+    }
+
+    class RayTest
+    {
+    public:
+        float origin[3];
+        float inverse[3];
+        float maxDistance;
+
+        int operator()(const Aabb& box) const
+        {
+            float enter;
+            return slabs(box, origin, inverse, maxDistance, enter) ? OVERLAP_PARTIAL : OVERLAP_NONE;
+        }
+    };
+
+    class SphereTest
+    {
+    public:
+        float center[3];
+        float radius;
+
+        int operator()(const Aabb& box) const
+        {
+            float distance = 0, furthest = 0;
+            for (int c = 0; c < 3; c++) {
+                float closest = std::max(box.min[c], std::min(center[c], box.max[c]));
+                float d = center[c] - closest;
+                distance += d * d;
+                float f = std::max(center[c] - box.min[c], box.max[c] - center[c]);
+                furthest += f * f;
+            }
+            if (distance > radius * radius)
+                return OVERLAP_NONE;
+            return furthest <= radius * radius ? OVERLAP_CONTAINS : OVERLAP_PARTIAL;
+        }
+    };
+
+    class BoxTest
+    {
+    public:
+        Aabb box;
+
+        int operator()(const Aabb& other) const
+        {
+            if (!overlaps(box, other))
+                return OVERLAP_NONE;
+            return contains(box, other) ? OVERLAP_CONTAINS : OVERLAP_PARTIAL;
+        }
+    };
+}
+
+AabbTree::AabbTree(float margin) :
+    _root(NULL_NODE),
+    _freeList(NULL_NODE),
+    _leafCount(0),
+    _margin(margin)
+{
+}
+
+int AabbTree::allocateNode()
+{
+    if (_freeList == NULL_NODE) {
+        Node node;
+        node.parent = NULL_NODE;
+        node.height = -1;
+        _nodes.push_back(node);
+        _freeList = (int) _nodes.size() - 1;
+    }
+
+    int index = _freeList;
+    Node& node = _nodes[index];
+    _freeList = node.parent;
+    node.parent = NULL_NODE;
+    node.child[0] = node.child[1] = NULL_NODE;
+    node.height = 0;
+    node.userData = 0;
+    return index;
+}
+
+void AabbTree::freeNode(int index)
+{
+    _nodes[index].parent = _freeList;
+    _nodes[index].height = -1;
+    _freeList = index;
+}
+
+int AabbTree::insert(const Aabb& box, int userData)
+{
+    int leaf = allocateNode();
+    Node& node = _nodes[leaf];
+    for (int c = 0; c < 3; c++) {
+        node.box.min[c] = box.min[c] - _margin;
+        node.box.max[c] = box.max[c] + _margin;
+    }
+    node.userData = userData;
+
+    insertLeaf(leaf);
+    _leafCount++;
+    return leaf;
+}
+
+void AabbTree::remove(int proxy)
+{
+    removeLeaf(proxy);
+    freeNode(proxy);
+    _leafCount--;
+}
+
+bool AabbTree::move(int proxy, const Aabb& box)
+{
+    Node& leaf = _nodes[proxy];
+    if (contains(leaf.box, box))
+        return false;
+
+    Aabb fat;
+    for (int c = 0; c < 3; c++) {
+        fat.min[c] = box.min[c] - _margin;
+        fat.max[c] = box.max[c] + _margin;
+    }
+
+    // Small moves keep the leaf where it is and grow or shrink its
+    // ancestors. Jumps would leave it in a far away subtree and bloat
+    // every box on the way, those find a new place instead.
+    bool jumped = !overlaps(leaf.box, fat);
+    leaf.box = fat;
+    if (jumped) {
+        removeLeaf(proxy);
+        insertLeaf(proxy);
+    }
+    else
+        refit(_nodes[proxy].parent);
+    return true;
+}
+
+void AabbTree::clear()
+{
+    _nodes.clear();
+    _root = NULL_NODE;
+    _freeList = NULL_NODE;
+    _leafCount = 0;
+}
+
+void AabbTree::insertLeaf(int leaf)
+{
+    if (_root == NULL_NODE) {
+        _root = leaf;
+        _nodes[leaf].parent = NULL_NODE;
+        return;
+    }
+
+    // Walk down to the sibling that adds the least surface area, counting
+    // the growth of every ancestor on the way
+    Aabb box = _nodes[leaf].box;
+    int index = _root;
+    while (!_nodes[index].isLeaf()) {
+        const Node& node = _nodes[index];
+        float nodeArea = area(node.box);
+        float combinedArea = area(combine(node.box, box));
+
+        // Making a new parent for this node and the leaf
+        float cost = 2 * combinedArea;
+        // Pushing the leaf further down grows this node's box
+        float inheritance = 2 * (combinedArea - nodeArea);
+
+        float childCost[2];
+        for (int i = 0; i < 2; i++) {
+            const Node& child = _nodes[node.child[i]];
+            float grown = area(combine(box, child.box));
+            childCost[i] = (child.isLeaf() ? grown : grown - area(child.box)) + inheritance;
+        }
+
+        if (cost < childCost[0] && cost < childCost[1])
+            break;
+        index = childCost[0] < childCost[1] ? node.child[0] : node.child[1];
+    }
+
+    int sibling = index;
+    int oldParent = _nodes[sibling].parent;
+    int newParent = allocateNode();
+    Node& parent = _nodes[newParent];
+    parent.parent = oldParent;
+    parent.box = combine(box, _nodes[sibling].box);
+    parent.height = _nodes[sibling].height + 1;
+    parent.child[0] = sibling;
+    parent.child[1] = leaf;
+    parent.userData = 0;
+    _nodes[sibling].parent = newParent;
+    _nodes[leaf].parent = newParent;
+
+    if (oldParent == NULL_NODE)
+        _root = newParent;
+    else {
+        Node& grandParent = _nodes[oldParent];
+        grandParent.child[grandParent.child[0] == sibling ? 0 : 1] = newParent;
+    }
+
+    refit(oldParent);
+}
+
+void AabbTree::removeLeaf(int leaf)
+{
+    if (leaf == _root) {
+        _root = NULL_NODE;
+        return;
+    }
+
+    // The sibling takes the parent's place
+    int parent = _nodes[leaf].parent;
+    int grandParent = _nodes[parent].parent;
+    int sibling = _nodes[parent].child[0] == leaf ? _nodes[parent].child[1] : _nodes[parent].child[0];
+
+    if (grandParent == NULL_NODE) {
+        _root = sibling;
+        _nodes[sibling].parent = NULL_NODE;
+        freeNode(parent);
+        return;
+    }
+
+    Node& grand = _nodes[grandParent];
+    grand.child[grand.child[0] == parent ? 0 : 1] = sibling;
+    _nodes[sibling].parent = grandParent;
+    freeNode(parent);
+
+    refit(grandParent);
+}
+
+void AabbTree::refit(int index)
+{
+    while (index != NULL_NODE) {
+        index = balance(index);
+
+        Node& node = _nodes[index];
+        const Node& a = _nodes[node.child[0]];
+        const Node& b = _nodes[node.child[1]];
+        node.box = combine(a.box, b.box);
+        node.height = 1 + std::max(a.height, b.height);
+
+        index = node.parent;
+    }
+}
+
+int AabbTree::balance(int iA)
+{
+    Node& a = _nodes[iA];
+    if (a.isLeaf() || a.height < 2)
+        return iA;
+
+    int iB = a.child[0];
+    int iC = a.child[1];
+    int difference = _nodes[iC].height - _nodes[iB].height;
+    if (difference >= -1 && difference <= 1)
+        return iA;
+
+    // Rotate the taller child up into A's place. Of its children, the
+    // taller one stays with it and the other one moves down under A.
+    int up = difference > 1 ? iC : iB;
+    int down = difference > 1 ? iB : iC;
+    Node& u = _nodes[up];
+    int iF = u.child[0];
+    int iG = u.child[1];
+
+    u.child[0] = iA;
+    u.parent = a.parent;
+    a.parent = up;
+    if (u.parent == NULL_NODE)
+        _root = up;
+    else {
+        Node& parent = _nodes[u.parent];
+        parent.child[parent.child[0] == iA ? 0 : 1] = up;
+    }
+
+    int keep = _nodes[iF].height > _nodes[iG].height ? iF : iG;
+    int move = keep == iF ? iG : iF;
+    u.child[1] = keep;
+    a.child[0] = down;
+    a.child[1] = move;
+    _nodes[move].parent = iA;
+
+    const Node& d = _nodes[down];
+    const Node& m = _nodes[move];
+    a.box = combine(d.box, m.box);
+    a.height = 1 + std::max(d.height, m.height);
+
+    const Node& k = _nodes[keep];
+    u.box = combine(a.box, k.box);
+    u.height = 1 + std::max(a.height, k.height);
+    return up;
+}
+
+template <typename Test>
+void AabbTree::query(Test test, std::vector<int>& out) const
+{
+    out.clear();
+    if (_root == NULL_NODE)
+        return;
+
+    // Nodes with a flag for subtrees known to pass entirely
+    int stack[MAX_STACK];
+    bool inside[MAX_STACK];
+    int count = 0;
+    stack[count] = _root;
+    inside[count++] = false;
+
+    while (count > 0) {
+        count--;
+        const Node& node = _nodes[stack[count]];
+        bool contained = inside[count];
+        if (!contained) {
+            int result = test(node.box);
+            if (result == OVERLAP_NONE)
+                continue;
+            contained = result == OVERLAP_CONTAINS;
+        }
+
+        if (node.isLeaf())
+            out.push_back(node.userData);
+        else {
+            stack[count] = node.child[0];
+            inside[count++] = contained;
+            stack[count] = node.child[1];
+            inside[count++] = contained;
+        }
+    }
+}
+
+void AabbTree::queryFrustum(const Frustum& frustum, std::vector<int>& out) const
+{
+    FrustumTest test;
+    test.frustum = &frustum;
+    query(test, out);
+}
+
+bool intersectRay(const Aabb& box, const float* origin, const float* direction, float maxDistance, float& enter)
+{
+    float inverse[3];
+    for (int c = 0; c < 3; c++)
+        inverse[c] = 1.0f / direction[c];
+    return slabs(box, origin, inverse, maxDistance, enter);
+}
+
+void AabbTree::queryRay(const float* origin, const float* direction, float maxDistance, std::vector<int>& out) const
+{
+    RayTest test;
+    for (int c = 0; c < 3; c++) {
+        test.origin[c] = origin[c];
+        test.inverse[c] = 1.0f / direction[c];
+    }
+    test.maxDistance = maxDistance;
+    query(test, out);
+}
+
+void AabbTree::querySphere(const float* center, float radius, std::vector<int>& out) const
+{
+    SphereTest test;
+    for (int c = 0; c < 3; c++)
+        test.center[c] = center[c];
+    test.radius = radius;
+    query(test, out);
+}
+
+void AabbTree::queryBox(const Aabb& box, std::vector<int>& out) const
+{
+    BoxTest test;
+    test.box = box;
+    query(test, out);
+}
+
+bool AabbTree::validate() const
+{
+    if (_root == NULL_NODE)
+        return _leafCount == 0;
+    if (_nodes[_root].parent != NULL_NODE)
+        return false;
+    return validate(_root, NULL_NODE);
+}
+
+bool AabbTree::validate(int index, int parent) const
+{
+    const Node& node = _nodes[index];
+    if (node.parent != parent)
+        return false;
+    if (node.isLeaf())
+        return node.height == 0 && node.child[1] == NULL_NODE;
+
+    const Node& a = _nodes[node.child[0]];
+    const Node& b = _nodes[node.child[1]];
+    if (node.height != 1 + std::max(a.height, b.height))
+        return false;
+    if (!contains(node.box, a.box) || !contains(node.box, b.box))
+        return false;
+    return validate(node.child[0], index) && validate(node.child[1], index);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "FrustumCulling.h"
+
+#include <vector>
+
+class Aabb
+{
+public:
+    float min[3];
+    float max[3];
+};
+
+// Exact slab test of the ray origin + t * direction against a box. On a
+// hit, enter is the smallest t in [0, maxDistance] inside the box.
+bool intersectRay(const Aabb& box, const float* origin, const float* direction, float maxDistance, float& enter);
+
+// Incremental bounding volume hierarchy over axis aligned boxes, for
+// culling, picking and proximity queries that would otherwise scan every
+// object. Leaves store a box enlarged by a margin, so objects that move a
+// little don't touch the tree at all; ones that move further refit the
+// boxes on their path to the root, with tree rotations to keep it balanced.
+//
+// Nodes live in one array and refer to each other by index, freed nodes
+// are reused. Handles returned by insert() stay valid until removed.
+class AabbTree
+{
+public:
+    explicit AabbTree(float margin = 0.1f);
+
+    int insert(const Aabb& box, int userData);
+    void remove(int proxy);
+
+    // Updates the box of an object. Returns whether the tree changed,
+    // which it doesn't while the box stays inside the enlarged one.
+    bool move(int proxy, const Aabb& box);
+
+    int userData(int proxy) const { return _nodes[proxy].userData; }
+    const Aabb& fatBox(int proxy) const { return _nodes[proxy].box; }
+
+    void clear();
+    size_t size() const { return _leafCount; }
+    int height() const { return _root < 0 ? 0 : _nodes[_root].height; }
+
+    // These replace the contents of out with the user data of every
+    // object whose enlarged box passes the test, in no particular order.
+    // The ray is origin + t * direction for t in [0, maxDistance].
+    void queryFrustum(const Frustum& frustum, std::vector<int>& out) const;
+    void queryRay(const float* origin, const float* direction, float maxDistance, std::vector<int>& out) const;
+    void querySphere(const float* center, float radius, std::vector<int>& out) const;
+    void queryBox(const Aabb& box, std::vector<int>& out) const;
+
+    // Checks the links, boxes and heights of the whole tree, for debugging
+    bool validate() const;
+
+private:
+    class Node
+    {
+    public:
+        Aabb box;
+        int parent;  // next free node while on the free list
+        int child[2];
+        int height;  // 0 for leaves, -1 for free nodes
+        int userData;
+
+        bool isLeaf() const { return child[0] < 0; }
+    };
+
+    int allocateNode();
+    void freeNode(int node);
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+
+    // Refits the boxes and heights from node up to the root
+    void refit(int node);
+    int balance(int node);
+
+    template <typename Test>
+    void query(Test test, std::vector<int>& out) const;
+
+    bool validate(int node, int parent) const;
+
+    std::vector<Node> _nodes;
+    int _root;
+    int _freeList;
+    size_t _leafCount;
+    float _margin;
+};
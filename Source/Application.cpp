@@ -1,5 +1,25 @@
 #include "Model.h"
 #include "Image.h"
+#include "Program.h"
+#include "ProgramCache.h"
+#include "UniformBuffer.h"
+#include "InstanceSet.h"
+#include "RenderQueue.h"
+#include "MultiDrawBatch.h"
+#include "FrustumCulling.h"
+#include "AabbTree.h"
+#include "OcclusionBuffer.h"
+#include "ShadowCascades.h"
+#include "ClusteredLights.h"
+#include "ShaderVariants.h"
+#include "DebugDraw.h"
+#include "StreamBuffer.h"
+#include "DeletionQueue.h"
+#include "TexturePacker.h"
+#include "TextureUploader.h"
+#include "TextureStreamer.h"
+#include "WorkerPool.h"
+#include "GLState.h"
 
 #include <GDT/Window.h>
 #include <GDT/Input.h>
@@ -27,24 +47,14 @@
 #include <ctime>
 
 
-// Rudimentary function for drawing models, feel free to replace or change it with your own logic
-// Just make sure you let the shader know whether the model has texture coordinates
-void drawModel(ShaderProgram& shader, const Model& model, Vector3f position, Vector3f lightPosition, Vector3f lightColor, Vector3f rotation = Vector3f(0), float scale = 1)
-{
-    Matrix4f modelMatrix;
-    modelMatrix.translate(position);
-    modelMatrix.rotate(rotation);
-    modelMatrix.scale(scale);
-    shader.uniformMatrix4f("modelMatrix", modelMatrix);
-	shader.uniform3f("lightPosition", lightPosition);
-	shader.uniform3f("lightColor", lightColor);
-    shader.uniform1i("hasTexCoords", model.texCoords.size() > 0);
-	shader.uniform1f("ks", model.ks);
-	shader.uniform3f("ka", model.ka);
-	shader.uniform3f("kd", model.kd);
-
-    glBindVertexArray(model.vao);
-    glDrawArrays(GL_TRIANGLES, 0, model.vertices.size());
+// Texture units of the Blinn-Phong variants, set once when a variant is built
+void setupBlinnPhong(Program& program) {
+	program.set(program.uniform<int>("colorMap"), 0);
+	program.set(program.uniform<int>("shadowMap"), 1);
+	program.set(program.uniform<int>("instanceData"), MultiDrawBatch::INSTANCE_DATA_UNIT);
+	program.set(program.uniform<int>("clusterGrid"), ClusteredLights::CLUSTER_GRID_UNIT);
+	program.set(program.uniform<int>("lightIndices"), ClusteredLights::LIGHT_INDEX_UNIT);
+	program.set(program.uniform<int>("lightData"), ClusteredLights::LIGHT_DATA_UNIT);
 }
 
 // Produces a look-at matrix from the position of the camera (camera) facing the target position (target)
@@ -70,19 +80,6 @@ bool FileExists(const std::string & Filename) {
 	return access(Filename.c_str(), 0) == 0;
 }
 
-//function to draw coordinate axes.
-void drawCoordSystem(ShaderProgram& shader, Vector3f position, unsigned int vao) {
-	
-	Matrix4f modelMatrix;
-	modelMatrix.translate(position);
-	
-	shader.uniformMatrix4f("modelMatrix", modelMatrix);
-
-	glBindVertexArray(vao);
-	glDrawElements(GL_LINES,6, GL_UNSIGNED_INT,0);
-	glBindVertexArray(0);
-}
-
 class Application : KeyListener, MouseMoveListener, MouseClickListener {
 public:
 
@@ -98,24 +95,48 @@ public:
 		lightPosition = Vector3f(0, 0, 1); //position it at  1 1 1
 		lightColor = Vector3f(1, 1, 1); //White
 		
-		//Coordsystem if you want
-		setupCoordSystem();
+		// Programs linked on an earlier run load from here instead of
+		// compiling
+		programCache().create("C:/users/Emiel/Develop/FinalProject3DGame/Build/ShaderCache");
 
 		try {
-            defaultShader.create();
-            defaultShader.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/shader.vert");
-            defaultShader.addShader(FRAGMENT, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/shader.frag");
-            defaultShader.build();
-
-			blinnPhong.create();
-			blinnPhong.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/blinnphong.vert");
-			blinnPhong.addShader(FRAGMENT, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/blinnphong.frag");
-			blinnPhong.build();
+            // Lines from debugDraw(), the coordinate system among them
+            debugShader.create();
+            debugShader.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/debug.vert");
+            debugShader.addShader(FRAGMENT, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/debug.frag");
+            debugShader.build();
+
+			// One source for all lighting, specialized per feature set. The
+			// variants the scene draws with are all submitted before any is
+			// waited on, so the driver compiles them side by side and a
+			// frame never waits for a compile.
+			blinnPhong.create("C:/users/Emiel/Develop/FinalProject3DGame/Resources/blinnphong.vert",
+			                  "C:/users/Emiel/Develop/FinalProject3DGame/Resources/blinnphong.frag", setupBlinnPhong);
+			for (int lights = 0; lights < 2; lights++) {
+				unsigned int features = FEATURE_SHADOWED | (lights ? FEATURE_POINT_LIGHTS : 0);
+				blinnPhong.warm(features | FEATURE_INSTANCED);
+				blinnPhong.warm(features | FEATURE_INSTANCED | FEATURE_TEXTURED);
+				blinnPhong.warm(features | FEATURE_INDIRECT);
+			}
+			blinnPhong.finishAll();
 
             shadowShader.create();
             shadowShader.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/shadow.vert");
             shadowShader.build();
 
+            // Depth only, for the render queue's depth pre-pass
+            depthPrepass.create();
+            depthPrepass.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/depth_instanced.vert");
+            depthPrepass.build();
+
+            // The textured floor under the crowd
+            floorShader.create();
+            floorShader.addShader(VERTEX, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/floor.vert");
+            floorShader.addShader(FRAGMENT, "C:/users/Emiel/Develop/FinalProject3DGame/Resources/floor.frag");
+            floorShader.build();
+            floorShader.bind();
+            floorShader.set(floorShader.uniform<int>("colorMap"), 0);
+
             // Any new shaders can be added below in similar fashion
             // ....
         }
@@ -123,6 +144,9 @@ public:
         {
             std::cerr << e.what() << std::endl;
         }
+		const ProgramCacheStats& cacheStats = programCache().stats();
+		std::cout << cacheStats.hits << " programs from the binary cache, " << cacheStats.misses << " compiled, "
+		          << cacheStats.rejected << " rejected by the driver" << std::endl;
 		std::cout << "test" << std::endl;
 		// Orthographic
 		float znear = nn;
@@ -145,28 +169,106 @@ public:
 		projMatrix[11] = -((zfar + znear) / (zfar - znear));
 		projMatrix[15] = 1.0f;
 
-		defaultShader.bind();
-		defaultShader.uniform1i("colorMap", 0);
-		defaultShader.uniform1i("shadowMap", 1);
-		defaultShader.uniformMatrix4f("projMatrix", projMatrix);
-
-        // Correspond the OpenGL texture units 0 and 1 with the
-        // colorMap and shadowMap uniforms in the shader
-		blinnPhong.bind();
-		blinnPhong.uniform1i("colorMap", 0);
-		blinnPhong.uniform1i("shadowMap", 1);		
-
-        // Upload the projection matrix once, if it doesn't change
-        // during the game we don't need to reupload it
-		blinnPhong.uniformMatrix4f("projMatrix", projMatrix);
-        glEnable(GL_DEPTH_TEST);
+		// Camera and light data is shared by every program through the
+		// FrameData block, it's uploaded once per frame in update()
+		frameBuffer.create(FRAME_BLOCK, sizeof(FrameData));
+		materials.create();
+
+		// 4 MiB a frame, three frames in flight
+		stream.create(12 << 20, 3);
+		debugDraw().create(debugShader, stream);
+
+        enable(GL_DEPTH_TEST);
         glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
 
+		// Color maps baked by TextureBaker, packed into as few array
+		// textures as they fit in. Models without texture coordinates
+		// draw untextured either way.
+		const char* colorMaps[] = { "dragon", "crowd" };
+		bool packed[2] = { false, false };
+		for (int i = 0; i < 2; i++) {
+			std::string path = std::string("C:/users/Emiel/Develop/FinalProject3DGame/Resources/Textures/") + colorMaps[i] + ".ktx2";
+			TextureFile texture;
+			if (FileExists(path) && readTextureFile(path, texture)) {
+				textures.add(colorMaps[i], texture);
+				packed[i] = true;
+			}
+		}
+		textures.build();
+
 		//Init models
 		tmp = loadModel("C:/users/Emiel/Develop/FinalProject3DGame/dragon.obj");
-		tmp.ka = Vector3f(0.1, 0, 0);
-		tmp.kd = Vector3f(0.5, 0, 0);
-		tmp.ks = 8.0f;
+		tmp.material.ka = Vector3f(0.1, 0, 0);
+		tmp.material.kd = Vector3f(0.5, 0, 0);
+		tmp.material.ks = 8.0f;
+		if (packed[0])
+			tmp.material.colorMap = textures.get(colorMaps[0]);
+		materials.add(tmp.material);
+
+		// The ring dragons have a copy of their own, which U unloads and
+		// loads again while the game runs
+		ring = loadModel("C:/users/Emiel/Develop/FinalProject3DGame/dragon.obj");
+
+		// A field of small dragons in one draw call, toggled with I
+		crowdMaterial.ka = Vector3f(0, 0.1f, 0);
+		crowdMaterial.kd = Vector3f(0, 0.5f, 0);
+		crowdMaterial.ks = 8.0f;
+		if (packed[1])
+			crowdMaterial.colorMap = textures.get(colorMaps[1]);
+		materials.add(crowdMaterial);
+		queue.create(stream);
+		crowd.create(tmp, 64 * 64);
+		for (int x = 0; x < 64; x++) {
+			for (int z = 0; z < 64; z++) {
+				Matrix4f modelMatrix;
+				modelMatrix.translate(Vector3f(x - 32.0f, -1, z - 64.0f));
+				modelMatrix.scale(0.2f);
+				crowd.add(modelMatrix, (x + z) % 2 ? crowdMaterial.index : tmp.material.index);
+				crowdMatrices.push_back(modelMatrix);
+				crowdMaterials.push_back((x + z) % 2 ? crowdMaterial.index : tmp.material.index);
+				Bounds bounds = worldBounds(tmp, modelMatrix);
+				crowdBounds.add(bounds);
+
+				Aabb box;
+				for (int c = 0; c < 3; c++) {
+					box.min[c] = bounds.min[c];
+					box.max[c] = bounds.max[c];
+				}
+				crowdTree.insert(box, (int) crowdMatrices.size() - 1);
+			}
+		}
+
+		// A baked floor texture streams its detailed levels in as the
+		// camera gets closer. A plain image loads on the uploader's
+		// threads instead, the floor shows up once it's in.
+		createFloor(worldBounds(tmp, crowdMatrices[0]).min[1]);
+		uploader = new TextureUploader();
+		streamer = new TextureStreamer(64 << 20);
+		std::string floorPath = "C:/users/Emiel/Develop/FinalProject3DGame/Resources/Textures/floor";
+		if (FileExists(floorPath + ".ktx2"))
+			floorTexture = streamer->load(floorPath + ".ktx2");
+		else if (FileExists(floorPath + ".png"))
+			floorImage = uploader->load(floorPath + ".png");
+
+		// The same field through the multi-draw path, switched to with M
+		batch.create(stream);
+		batchDragon = batch.addMesh(tmp);
+
+		// Directional shadows from the light, in cascades over the view
+		shadows.create(shadowShader, stream);
+		addStaticCasters();
+
+		// 256 coloured point lights over the crowd field, toggled with L
+		pointLights.create(stream);
+		for (int x = 0; x < 16; x++) {
+			for (int z = 0; z < 16; z++) {
+				PointLight light;
+				light.position = Vector3f(x * 4 - 30.0f, -0.5f, z * 4 - 62.0f);
+				light.color = Vector3f((float) (x % 3 == 0), (float) (z % 3 == 0), (float) ((x + z) % 2)) * 4.0f;
+				light.radius = 4;
+				lightField.push_back(light);
+			}
+		}
     }
 
     void update() {
@@ -175,19 +277,94 @@ public:
         while (!window.shouldClose()) {
             // Clear the screen
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			resetGLStateStats();
+			uploader->update();
+			requestFloor();
+			streamer->update();
 			viewMatrix.translate(Vector3f(side, 0, forward));
 
+			// One upload per frame for all programs, streamed so it never
+			// waits for the frame the GPU is still drawing
+			Vector4f camera = inverse(viewMatrix) * Vector4f(0, 0, 0, 1);
+			frameData.projMatrix = projMatrix;
+			frameData.viewMatrix = viewMatrix;
+			frameData.cameraPosition = camera;
+			frameData.lightPosition = Vector4f(lightPosition, 1);
+			frameData.lightColor = Vector4f(lightColor, 1);
+			stream.beginFrame();
+			blinnPhong.nextFrame();
+			frameBuffer.write(stream, &frameData, sizeof(FrameData));
+			materials.upload();
+
+			// The big dragon hides what's behind it, draw it into the
+			// occlusion buffer before anything is submitted
+			Matrix4f viewProjection = projMatrix * viewMatrix;
+			if (useOcclusion) {
+				Matrix4f occluderMatrix;
+				occlusion.begin(viewProjection.toArray());
+				occlusion.addOccluder(&tmp.vertices[0].x, tmp.vertices.size(), tmp.indices.data(), tmp.indices.size(), occluderMatrix.toArray());
+				occlusion.rasterize(&workers);
+			}
+
+			// The ring dragons are drawn into the shadow maps every frame,
+			// the rest only when a cached cascade moves
+			for (int i = 0; i < 16; i++) {
+				Matrix4f modelMatrix;
+				modelMatrix.translate(ringPosition(i));
+				modelMatrix.scale(0.3f);
+				shadows.addDynamicCaster(ring, modelMatrix);
+			}
+			shadows.update(viewMatrix, projMatrix, nn, ff, normalize(-lightPosition));
+			shadows.render(&workers);
+			shadows.bind(1);
+
+			// The point lights circle around their spot
+			if (showLights) {
+				float time = (float) glfwGetTime();
+				for (size_t i = 0; i < lightField.size(); i++) {
+					PointLight light = lightField[i];
+					light.position += Vector3f(std::cos(time + i), 0, std::sin(time + i));
+					pointLights.add(light);
+				}
+			}
+			pointLights.update(viewMatrix, projMatrix, nn, ff, window.getWidth(), window.getHeight(), &workers);
+			pointLights.bind();
+
             // ...
-			blinnPhong.bind();
-			blinnPhong.uniformMatrix4f("viewMatrix", viewMatrix);
-			blinnPhong.uniform1f("time", glfwGetTime());
-			drawModel(blinnPhong, tmp, Vector3f(0, 0, 0), lightPosition, lightColor);			
+			// Draws go through the queue, which sorts them by state and
+			// merges repeated models into instanced draws
+			Vector3f cameraPosition(camera.x, camera.y, camera.z);
+			submitModel(tmp, tmp.material, Vector3f(0, 0, 0), cameraPosition);
+			for (int i = 0; i < 16; i++)
+				submitModel(ring, i % 2 ? crowdMaterial : tmp.material, ringPosition(i), cameraPosition, 0.3f);
+			queue.flush();
+			drawFloor();
+
+			if (showCrowd && useBatch) {
+				// Only the dragons inside the view frustum go into the batch
+				Frustum frustum = extractFrustum(viewProjection.toArray());
+				cullFrustum(crowdBounds, frustum, visibleCrowd, &workers);
+				if (useOcclusion)
+					occlusion.cullOccluded(crowdBounds, visibleCrowd, &workers);
+				for (size_t i = 0; i < visibleCrowd.size(); i++)
+					batch.add(batchDragon, crowdMatrices[visibleCrowd[i]], crowdMaterials[visibleCrowd[i]]);
+				blinnPhong.get(litFeatures() | FEATURE_INDIRECT).bind();
+				batch.draw();
+			}
+			else if (showCrowd) {
+				blinnPhong.get(litFeatures() | FEATURE_INSTANCED).bind();
+				crowd.draw();
+			}
 			
-			if (showCoord) {
-				defaultShader.bind();
-				defaultShader.uniformMatrix4f("viewMatrix", viewMatrix);
-				drawCoordSystem(defaultShader, Vector3f(0, 0, 0), coordVAO);
+			if (showCoord)
+				debugDraw().axes(Matrix4f());
+			if (showBounds && showCrowd) {
+				for (size_t i = 0; i < crowdBounds.size(); i++)
+					debugDraw().box(crowdBounds.get(i), Vector3f(1, 1, 0));
 			}
+			debugDraw().flush();
+			stream.endFrame();
+			deletionQueue().endFrame();
 			
 
             // Processes input and swaps the window buffer
@@ -195,35 +372,127 @@ public:
         }
     }
 
-	// Setup a coordinate system
-	void setupCoordSystem() {
-		//Coordsystem lines.
-		Vector3f coords[] = {
-			Vector3f(0,0,0),
-			Vector3f(1,0,0),
-			Vector3f(0,1,0),
-			Vector3f(0,0,1)
-		};
-		unsigned int indices[] = {
-			0, 1, // x
-			0, 2, // y
-			0, 3  // z
+	// Frees everything while the context is still there. What went through
+	// the deletion queue is deleted last, without waiting for fences.
+	void destroy() {
+		if (floorImage.handle != 0)
+			uploader->cancel(floorImage);
+		delete uploader;
+		delete streamer;
+		uploader = 0;
+		streamer = 0;
+		deleteTextures(1, &floorImage.handle);
+		deleteVertexArrays(1, &floorVao);
+		glDeleteBuffers(1, &floorVbo);
+
+		queue.destroy();
+		crowd.destroy();
+		batch.destroy();
+		shadows.destroy();
+		pointLights.destroy();
+		debugDraw().destroy();
+		textures.destroy();
+		unloadModel(tmp);
+		unloadModel(ring);
+
+		blinnPhong.destroy();
+		debugShader.destroy();
+		shadowShader.destroy();
+		depthPrepass.destroy();
+		floorShader.destroy();
+		frameBuffer.destroy();
+		materials.destroy();
+		stream.destroy();
+
+		deletionQueue().flush();
+	}
+
+	// Shadow casters that don't move, the crowd only while it's shown
+	void addStaticCasters() {
+		shadows.clearStaticCasters();
+		shadows.addStaticCaster(tmp, Matrix4f());
+		if (showCrowd) {
+			for (size_t i = 0; i < crowdMatrices.size(); i++)
+				shadows.addStaticCaster(tmp, crowdMatrices[i]);
+		}
+	}
+
+	// A quad under the crowd field at height y, its texture repeating
+	// every two units
+	void createFloor(float y) {
+		const float vertices[] = {
+			-33, y, -65, 0, 0,
+			 33, y, -65, 33, 0,
+			-33, y, 1, 0, 33,
+			 33, y, 1, 33, 33
 		};
+		glGenVertexArrays(1, &floorVao);
+		bindVertexArray(floorVao);
+		glGenBuffers(1, &floorVbo);
+		glBindBuffer(GL_ARRAY_BUFFER, floorVbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), 0);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*) (3 * sizeof(float)));
+		glEnableVertexAttribArray(2);
+		bindVertexArray(0);
+	}
+
+	// Streamed textures want the level matching the size of one repeat
+	// on screen
+	void requestFloor() {
+		if (!showCrowd || !floorTexture)
+			return;
+		float screenSize = projectedScreenSize(projMatrix, viewMatrix, Vector3f(0, 0, -32), 47, window.getHeight());
+		streamer->request(floorTexture, screenSize / 33);
+	}
 
-		unsigned int EBO;
-		glGenBuffers(1, &EBO);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+	// An uploaded texture isn't loaded while it's pending or if the file
+	// failed to decode, its contents are undefined then
+	void drawFloor() {
+		GLuint texture = floorTexture ? floorTexture->glHandle() : floorImage.handle;
+		if (!showCrowd || texture == 0 || (!floorTexture && !uploader->isLoaded(floorImage)))
+			return;
+		floorShader.bind();
+		activeTexture(0);
+		bindTexture(GL_TEXTURE_2D, texture);
+		bindVertexArray(floorVao);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		bindVertexArray(0);
+	}
 
-		glGenVertexArrays(1, &coordVAO);
-		glGenBuffers(1, &coordVBO);
+	// Swaps the ring's model for a fresh copy from disk. The old buffers
+	// and vertex arrays go through the deletion queue, so the frames still
+	// drawing them aren't waited for.
+	void reloadRing() {
+		queue.forget(ring);
+		shadows.forget(ring);
+		unloadModel(ring);
+		ring = loadModel("C:/users/Emiel/Develop/FinalProject3DGame/dragon.obj");
+	}
 
-		glBindVertexArray(coordVAO);
-		glBindBuffer(GL_ARRAY_BUFFER, coordVBO);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(coords) * sizeof(Vector3f), coords, GL_STATIC_DRAW);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-		glEnableVertexAttribArray(0);
+	Vector3f ringPosition(int i) const {
+		float angle = i * 2 * 3.14159265f / 16;
+		return Vector3f(3 * std::cos(angle), 0, 3 * std::sin(angle));
+	}
+
+	void submitModel(const Model& model, const Material& material, Vector3f position, Vector3f cameraPosition, float scale = 1) {
+		Matrix4f modelMatrix;
+		modelMatrix.translate(position);
+		modelMatrix.scale(scale);
+		if (useOcclusion && !occlusion.isVisible(worldBounds(model, modelMatrix)))
+			return;
+		unsigned int features = litFeatures() | FEATURE_INSTANCED;
+		if (model.texCoords.size() > 0 && material.colorMap.array != 0)
+			features |= FEATURE_TEXTURED;
+		// Untextured while the textured variant is still compiling
+		const Program& program = blinnPhong.get(features, features & ~FEATURE_TEXTURED);
+		queue.submit(program, model, material, modelMatrix, (position - cameraPosition).length());
+	}
+
+	// Lighting features of the Blinn-Phong variants drawn this frame
+	unsigned int litFeatures() const {
+		return FEATURE_SHADOWED | (showLights ? FEATURE_POINT_LIGHTS : 0);
 	}
 
     // In here you can handle key presses
@@ -259,6 +528,81 @@ public:
 		case GLFW_KEY_C:
 				showCoord = !showCoord;
 				break;
+		case GLFW_KEY_B:
+			showBounds = !showBounds;
+			break;
+		case GLFW_KEY_I:
+			showCrowd = !showCrowd;
+			addStaticCasters();
+			break;
+		case GLFW_KEY_M:
+			useBatch = !useBatch;
+			std::cout << (useBatch ? (batch.usesMultiDrawIndirect() ? "Multi-draw indirect" : "Multi-draw fallback") : "Instanced") << " crowd" << std::endl;
+			break;
+		case GLFW_KEY_O:
+			useOcclusion = !useOcclusion;
+			break;
+		case GLFW_KEY_L:
+			showLights = !showLights;
+			break;
+		case GLFW_KEY_Z:
+			// Compare the shaded samples on P with and without it
+			queue.setDepthPrepass(queue.depthPrepass() ? 0 : &depthPrepass);
+			std::cout << "Depth pre-pass " << (queue.depthPrepass() ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_U:
+			reloadRing();
+			break;
+		case GLFW_KEY_P: {
+			const RenderStats& stats = queue.stats();
+			std::cout << stats.packets << " packets in " << stats.draws << " draws, "
+			          << stats.programChanges << " program, " << stats.textureChanges << " texture and "
+			          << stats.meshChanges << " mesh changes" << std::endl;
+			std::cout << stats.shadedSamples << " samples shaded by the queue"
+			          << (queue.depthPrepass() ? " after the depth pre-pass" : " without a depth pre-pass") << std::endl;
+
+			// Calls the state cache skipped last frame
+			const GLStateStats& state = glStateStats();
+			std::cout << "Elided " << state.programs.elided << "/" << state.programs.issued + state.programs.elided << " program, "
+			          << state.vertexArrays.elided << "/" << state.vertexArrays.issued + state.vertexArrays.elided << " vertex array, "
+			          << state.textures.elided << "/" << state.textures.issued + state.textures.elided << " texture and "
+			          << state.uniforms.elided << "/" << state.uniforms.issued + state.uniforms.elided << " uniform calls" << std::endl;
+
+			const MultiDrawStats& batchStats = batch.stats();
+			std::cout << batchStats.instances << " batched instances in " << batchStats.commands << " commands, "
+			          << batchStats.calls << " draw calls" << std::endl;
+			std::cout << visibleCrowd.size() << " of " << crowdBounds.size() << " crowd dragons visible" << std::endl;
+			const InstanceUploadStats& crowdUpload = crowd.uploadStats();
+			std::cout << "Last crowd upload: " << crowdUpload.instances << " instances in " << crowdUpload.ranges << " ranges, "
+			          << crowdUpload.bytes << " bytes" << std::endl;
+
+			const OcclusionStats& occlusionStats = occlusion.stats();
+			std::cout << "Occlusion rejected " << occlusionStats.rejected << " of " << occlusionStats.tested << " batched objects, "
+			          << occlusionStats.rasterizedTriangles << " of " << occlusionStats.occluderTriangles << " occluder triangles drawn" << std::endl;
+
+			const ShadowStats& shadowStats = shadows.stats();
+			std::cout << shadowStats.staticDraws << " static and " << shadowStats.dynamicDraws << " dynamic shadow casters in "
+			          << shadowStats.calls << " draws, " << shadowStats.cachedCascades << " cascades from cache" << std::endl;
+
+			const DebugDrawStats& debugStats = debugDraw().stats();
+			std::cout << debugStats.lines << " debug lines in " << debugStats.draws << " draws, " << debugStats.dropped << " dropped" << std::endl;
+
+			const StreamStats& streamStats = stream.stats();
+			std::cout << streamStats.bytes << " bytes streamed in " << streamStats.allocations << " allocations"
+			          << (stream.persistent() ? " to a persistent mapping, " : " through unsynchronized maps, ")
+			          << streamStats.failed << " failed, " << streamStats.waits << " waits for the GPU" << std::endl;
+
+			const DeletionStats& deletionStats = deletionQueue().stats();
+			std::cout << deletionStats.pending << " GL objects waiting for deletion, " << deletionStats.deleted
+			          << " deleted last frame in " << deletionStats.calls << " calls" << std::endl;
+
+			std::cout << blinnPhong.variantCount() << " Blinn-Phong variants, " << blinnPhong.pendingCount() << " still compiling" << std::endl;
+
+			const LightGridStats& lightStats = pointLights.stats();
+			std::cout << lightStats.lights << " point lights in " << lightStats.assignments << " cluster entries, at most "
+			          << lightStats.maxPerCluster << " per cluster, " << lightStats.dropped << " dropped" << std::endl;
+			break;
+		}
 		case GLFW_KEY_1:
 			//lookAtMatrix();
 			break;
@@ -291,6 +635,8 @@ public:
     // If the mouse is moved this function will be called with the x, y screen-coordinates of the mouse
     void onMouseMove(float x, float y) {
        // std::cout << "Mouse at position: " << x << " " << y << std::endl;
+		mouseX = x;
+		mouseY = y;
     }
 
     // If one of the mouse buttons is pressed this function will be called
@@ -298,8 +644,50 @@ public:
     // mods - Any modifier buttons pressed
     void onMouseClicked(int button, int mods) {
         std::cout << "Pressed button: " << button << std::endl;
+		if (showCrowd)
+			pickCrowd();
     }
 
+	// Finds the crowd dragon under the cursor through the crowd's tree
+	void pickCrowd() {
+		float x = 2 * mouseX / window.getWidth() - 1;
+		float y = 1 - 2 * mouseY / window.getHeight();
+
+		// Cursor ray from the near to the far plane
+		Matrix4f inverseViewProjection = inverse(projMatrix * viewMatrix);
+		Vector4f nearPoint = inverseViewProjection * Vector4f(x, y, -1, 1);
+		Vector4f farPoint = inverseViewProjection * Vector4f(x, y, 1, 1);
+		Vector3f origin(nearPoint.x / nearPoint.w, nearPoint.y / nearPoint.w, nearPoint.z / nearPoint.w);
+		Vector3f direction = Vector3f(farPoint.x / farPoint.w, farPoint.y / farPoint.w, farPoint.z / farPoint.w) - origin;
+		float length = direction.length();
+		direction = direction / length;
+
+		float rayOrigin[3] = { origin.x, origin.y, origin.z };
+		float rayDirection[3] = { direction.x, direction.y, direction.z };
+		std::vector<int> hits;
+		crowdTree.queryRay(rayOrigin, rayDirection, length, hits);
+
+		// The tree tests the enlarged boxes, so these are only candidates.
+		// Test the tight boxes and take the one the ray enters first.
+		int picked = -1;
+		float closest = length;
+		for (size_t i = 0; i < hits.size(); i++) {
+			Bounds bounds = crowdBounds.get(hits[i]);
+			Aabb box;
+			for (int c = 0; c < 3; c++) {
+				box.min[c] = bounds.min[c];
+				box.max[c] = bounds.max[c];
+			}
+			float enter;
+			if (intersectRay(box, rayOrigin, rayDirection, length, enter) && (picked < 0 || enter < closest)) {
+				picked = hits[i];
+				closest = enter;
+			}
+		}
+		if (picked >= 0)
+			std::cout << "Picked crowd dragon " << picked << " of " << hits.size() << " candidates under the cursor" << std::endl;
+	}
+
     // If one of the mouse buttons is released this function will be called
     // button - Integer that corresponds to numbers in https://www.glfw.org/docs/latest/group__buttons.html
     // mods - Any modifier buttons pressed
@@ -310,10 +698,17 @@ public:
 private:
     Window window;
 
-    // Shader for default rendering and for depth rendering
-    ShaderProgram defaultShader;
-    ShaderProgram shadowShader;
-    ShaderProgram blinnPhong;
+    // Shaders for debug lines and for depth rendering
+    Program debugShader;
+    Program shadowShader;
+    Program depthPrepass;
+    Program floorShader;
+    ShaderVariants blinnPhong;
+
+    // Per-frame and per-material uniform blocks
+    FrameData frameData;
+    UniformBuffer frameBuffer;
+    MaterialTable materials;
 
     // Projection and view matrices for you to fill in and use
     Matrix4f projMatrix;
@@ -322,10 +717,15 @@ private:
 	Vector3f lightPosition;
 	Vector3f lightColor;
 
-	unsigned int coordVAO;
-	unsigned int coordVBO;
-
 	bool showCoord = 0;
+	bool showBounds = 0;
+	bool showCrowd = 0;
+	bool useBatch = 0;
+	bool useOcclusion = 0;
+	bool showLights = 1;
+
+	float mouseX = 0;
+	float mouseY = 0;
 
 	float forward = 0;
 	float side = 0;
@@ -338,6 +738,39 @@ private:
 	float step = 0.01f;
 
 	Model tmp;
+	Model ring;
+	TexturePacker textures;
+
+	// Created once there's a GL context, the uploader's constructor makes
+	// its buffers
+	TextureUploader* uploader = 0;
+	TextureStreamer* streamer = 0;
+	StreamedTexture* floorTexture = 0;
+	Image floorImage = Image();
+	GLuint floorVao = 0;
+	GLuint floorVbo = 0;
+
+	RenderQueue queue;
+	InstanceSet crowd;
+	Material crowdMaterial;
+	MultiDrawBatch batch;
+	int batchDragon;
+
+	// Crowd placement and bounds, for culling the batched crowd
+	std::vector<Matrix4f> crowdMatrices;
+	std::vector<int> crowdMaterials;
+	BoundsTable crowdBounds;
+	AabbTree crowdTree;
+	std::vector<uint32_t> visibleCrowd;
+	WorkerPool workers;
+	OcclusionBuffer occlusion;
+	ShadowCascades shadows;
+	ClusteredLights pointLights;
+	std::vector<PointLight> lightField;
+
+	// Data written every frame: uniform blocks, instance data, indirect
+	// commands and debug lines
+	StreamBuffer stream;
 };
 
 
@@ -346,6 +779,7 @@ int main()
     Application app;
     app.init();
     app.update();
+    app.destroy();
 
     return 0;
 }
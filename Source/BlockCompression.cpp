@@ -0,0 +1,489 @@
+#include "BlockCompression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+namespace
+{
+    const int BC7_WEIGHTS[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    // Copies the 4x4 block at (bx, by) into out, clamping at the image edges
+    void fetchBlock(const unsigned char* rgba, int width, int height, int bx, int by, unsigned char out[64])
+    {
+        for (int y = 0; y < 4; y++) {
+            int sy = std::min(by * 4 + y, height - 1);
+            for (int x = 0; x < 4; x++) {
+                int sx = std::min(bx * 4 + x, width - 1);
+                memcpy(out + (y * 4 + x) * 4, rgba + ((size_t) sy * width + sx) * 4, 4);
+            }
+        }
+    }
+
+    void storeBlock(const unsigned char block[64], int width, int height, int bx, int by, unsigned char* rgba)
+    {
+        for (int y = 0; y < 4 && by * 4 + y < height; y++) {
+            for (int x = 0; x < 4 && bx * 4 + x < width; x++) {
+                memcpy(rgba + ((size_t) (by * 4 + y) * width + bx * 4 + x) * 4, block + (y * 4 + x) * 4, 4);
+            }
+        }
+    }
+
+    // Finds the principal axis of the first `channels` components of the
+    // selected pixels, and the two points on it that bound all of them.
+    void fitEndpoints(const unsigned char block[64], int channels, const bool* mask, float e0[4], float e1[4])
+    {
+        float mean[4] = { 0, 0, 0, 0 };
+        int count = 0;
+        for (int i = 0; i < 16; i++) {
+            if (mask && !mask[i])
+                continue;
+            for (int c = 0; c < channels; c++)
+                mean[c] += block[i * 4 + c];
+            count++;
+        }
+        if (count == 0) {
+            for (int c = 0; c < 4; c++)
+                e0[c] = e1[c] = 0;
+            return;
+        }
+        for (int c = 0; c < channels; c++)
+            mean[c] /= count;
+
+        float cov[4][4] = { { 0 } };
+        for (int i = 0; i < 16; i++) {
+            if (mask && !mask[i])
+                continue;
+            float d[4];
+            for (int c = 0; c < channels; c++)
+                d[c] = block[i * 4 + c] - mean[c];
+            for (int r = 0; r < channels; r++)
+                for (int c = 0; c < channels; c++)
+                    cov[r][c] += d[r] * d[c];
+        }
+
+        // Power iteration converges quickly enough for a 4x4 block
+        float axis[4] = { 1, 1, 1, 1 };
+        for (int it = 0; it < 8; it++) {
+            float next[4] = { 0, 0, 0, 0 };
+            for (int r = 0; r < channels; r++)
+                for (int c = 0; c < channels; c++)
+                    next[r] += cov[r][c] * axis[c];
+            float len = 0;
+            for (int c = 0; c < channels; c++)
+                len += next[c] * next[c];
+            if (len < 1e-8f)
+                break;
+            len = std::sqrt(len);
+            for (int c = 0; c < channels; c++)
+                axis[c] = next[c] / len;
+        }
+
+        float tMin = 1e30f, tMax = -1e30f;
+        for (int i = 0; i < 16; i++) {
+            if (mask && !mask[i])
+                continue;
+            float t = 0;
+            for (int c = 0; c < channels; c++)
+                t += (block[i * 4 + c] - mean[c]) * axis[c];
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+
+        for (int c = 0; c < 4; c++) {
+            e0[c] = c < channels ? std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * tMax)) : 255;
+            e1[c] = c < channels ? std::min(255.0f, std::max(0.0f, mean[c] + axis[c] * tMin)) : 255;
+        }
+    }
+
+    int distance(const unsigned char* a, const int* b, int channels)
+    {
+        int d = 0;
+        for (int c = 0; c < channels; c++)
+            d += (a[c] - b[c]) * (a[c] - b[c]);
+        return d;
+    }
+
+    uint16_t packRgb565(const float c[4])
+    {
+        int r = (int) (c[0] * 31 / 255 + 0.5f);
+        int g = (int) (c[1] * 63 / 255 + 0.5f);
+        int b = (int) (c[2] * 31 / 255 + 0.5f);
+        return (uint16_t) ((r << 11) | (g << 5) | b);
+    }
+
+    void unpackRgb565(uint16_t v, int out[4])
+    {
+        int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+        out[0] = (r << 3) | (r >> 2);
+        out[1] = (g << 2) | (g >> 4);
+        out[2] = (b << 3) | (b >> 2);
+        out[3] = 255;
+    }
+
+    void colorPalette(uint16_t c0, uint16_t c1, bool fourColor, int palette[4][4])
+    {
+        unpackRgb565(c0, palette[0]);
+        unpackRgb565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            if (fourColor) {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            else {
+                palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+                palette[3][c] = 0;
+            }
+        }
+        palette[2][3] = 255;
+        palette[3][3] = fourColor ? 255 : 0;
+    }
+
+    // Encodes the colour part of a BC1/BC3 block. BC3 blocks are always
+    // decoded in four colour mode, so punch-through alpha is only used for BC1.
+    void encodeColorBlock(const unsigned char block[64], bool allowTransparent, unsigned char* out)
+    {
+        bool opaque[16];
+        bool hasTransparent = false;
+        for (int i = 0; i < 16; i++) {
+            opaque[i] = !allowTransparent || block[i * 4 + 3] >= 128;
+            hasTransparent |= !opaque[i];
+        }
+
+        float e0[4], e1[4];
+        fitEndpoints(block, 3, opaque, e0, e1);
+        uint16_t c0 = packRgb565(e0);
+        uint16_t c1 = packRgb565(e1);
+
+        // c0 > c1 selects four colour mode, c0 <= c1 three colours + transparent
+        bool fourColor = !hasTransparent;
+        if ((fourColor && c0 < c1) || (!fourColor && c0 > c1))
+            std::swap(c0, c1);
+        if (fourColor && c0 == c1)
+            fourColor = false;
+
+        int palette[4][4];
+        colorPalette(c0, c1, fourColor, palette);
+
+        uint32_t indices = 0;
+        for (int i = 0; i < 16; i++) {
+            int best = 3;
+            if (opaque[i]) {
+                int bestDistance = 1 << 30;
+                for (int p = 0; p < (fourColor ? 4 : 3); p++) {
+                    int d = distance(block + i * 4, palette[p], 3);
+                    if (d < bestDistance) {
+                        bestDistance = d;
+                        best = p;
+                    }
+                }
+            }
+            indices |= (uint32_t) best << (2 * i);
+        }
+
+        out[0] = c0 & 0xFF; out[1] = c0 >> 8;
+        out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+        for (int i = 0; i < 4; i++)
+            out[4 + i] = (unsigned char) (indices >> (8 * i));
+    }
+
+    void decodeColorBlock(const unsigned char* in, bool alwaysFourColor, unsigned char block[64])
+    {
+        uint16_t c0 = in[0] | (in[1] << 8);
+        uint16_t c1 = in[2] | (in[3] << 8);
+        uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t) in[7] << 24);
+
+        int palette[4][4];
+        colorPalette(c0, c1, alwaysFourColor || c0 > c1, palette);
+
+        for (int i = 0; i < 16; i++) {
+            const int* color = palette[(indices >> (2 * i)) & 3];
+            for (int c = 0; c < 4; c++)
+                block[i * 4 + c] = (unsigned char) color[c];
+        }
+    }
+
+    void channelPalette(int a0, int a1, int palette[8])
+    {
+        palette[0] = a0;
+        palette[1] = a1;
+        for (int i = 2; i < 8; i++) {
+            palette[i] = a0 > a1 ? ((8 - i) * a0 + (i - 1) * a1) / 7
+                       : i < 6 ? ((6 - i) * a0 + (i - 1) * a1) / 5
+                       : i == 6 ? 0 : 255;
+        }
+    }
+
+    // Single channel block as used by BC3 alpha and both halves of BC5
+    void encodeChannelBlock(const unsigned char block[64], int channel, unsigned char* out)
+    {
+        int lo = 255, hi = 0;
+        for (int i = 0; i < 16; i++) {
+            lo = std::min(lo, (int) block[i * 4 + channel]);
+            hi = std::max(hi, (int) block[i * 4 + channel]);
+        }
+
+        // a0 > a1 selects the eight value interpolation mode
+        int palette[8];
+        channelPalette(hi, lo, palette);
+
+        uint64_t indices = 0;
+        for (int i = 0; i < 16; i++) {
+            int value = block[i * 4 + channel];
+            int best = 0, bestDistance = 256;
+            for (int p = 0; p < 8; p++) {
+                int d = std::abs(value - palette[p]);
+                if (d < bestDistance) {
+                    bestDistance = d;
+                    best = p;
+                }
+            }
+            indices |= (uint64_t) best << (3 * i);
+        }
+
+        out[0] = (unsigned char) hi;
+        out[1] = (unsigned char) lo;
+        for (int i = 0; i < 6; i++)
+            out[2 + i] = (unsigned char) (indices >> (8 * i));
+    }
+
+    void decodeChannelBlock(const unsigned char* in, int channel, unsigned char block[64])
+    {
+        int palette[8];
+        channelPalette(in[0], in[1], palette);
+
+        uint64_t indices = 0;
+        for (int i = 0; i < 6; i++)
+            indices |= (uint64_t) in[2 + i] << (8 * i);
+
+        for (int i = 0; i < 16; i++)
+            block[i * 4 + channel] = (unsigned char) palette[(indices >> (3 * i)) & 7];
+    }
+
+    class BitWriter
+    {
+    public:
+        BitWriter(unsigned char* out) : out(out), position(0) { memset(out, 0, 16); }
+
+        void write(uint32_t value, int bits)
+        {
+            for (int i = 0; i < bits; i++, position++)
+                out[position >> 3] |= ((value >> i) & 1) << (position & 7);
+        }
+
+    private:
+        unsigned char* out;
+        int position;
+    };
+
+    class BitReader
+    {
+    public:
+        BitReader(const unsigned char* in) : in(in), position(0) { }
+
+        uint32_t read(int bits)
+        {
+            uint32_t value = 0;
+            for (int i = 0; i < bits; i++, position++)
+                value |= ((in[position >> 3] >> (position & 7)) & 1) << i;
+            return value;
+        }
+
+    private:
+        const unsigned char* in;
+        int position;
+    };
+
+    // Quantizes an endpoint to 7 bits per channel plus a shared p-bit,
+    // choosing the p-bit that reconstructs the endpoint most closely
+    void quantizeBc7Endpoint(const float e[4], int q[4], int& pbit)
+    {
+        float bestError = 1e30f;
+        for (int p = 0; p < 2; p++) {
+            int candidate[4];
+            float error = 0;
+            for (int c = 0; c < 4; c++) {
+                candidate[c] = std::min(127, std::max(0, (int) ((e[c] - p) / 2 + 0.5f)));
+                float d = e[c] - ((candidate[c] << 1) | p);
+                error += d * d;
+            }
+            if (error < bestError) {
+                bestError = error;
+                pbit = p;
+                memcpy(q, candidate, sizeof(candidate));
+            }
+        }
+    }
+
+    void bc7Palette(const int q0[4], int p0, const int q1[4], int p1, int palette[16][4])
+    {
+        for (int c = 0; c < 4; c++) {
+            int a = (q0[c] << 1) | p0;
+            int b = (q1[c] << 1) | p1;
+            for (int i = 0; i < 16; i++)
+                palette[i][c] = ((64 - BC7_WEIGHTS[i]) * a + BC7_WEIGHTS[i] * b + 32) >> 6;
+        }
+    }
+
+    void encodeBc7Block(const unsigned char block[64], unsigned char* out)
+    {
+        float e0[4], e1[4];
+        fitEndpoints(block, 4, 0, e0, e1);
+
+        int q0[4], q1[4], p0 = 0, p1 = 0;
+        quantizeBc7Endpoint(e0, q0, p0);
+        quantizeBc7Endpoint(e1, q1, p1);
+
+        int palette[16][4];
+        bc7Palette(q0, p0, q1, p1, palette);
+
+        int indices[16];
+        for (int i = 0; i < 16; i++) {
+            int bestDistance = 1 << 30;
+            for (int p = 0; p < 16; p++) {
+                int d = distance(block + i * 4, palette[p], 4);
+                if (d < bestDistance) {
+                    bestDistance = d;
+                    indices[i] = p;
+                }
+            }
+        }
+
+        // The anchor index is stored with its top bit implied zero
+        if (indices[0] & 8) {
+            for (int c = 0; c < 4; c++)
+                std::swap(q0[c], q1[c]);
+            std::swap(p0, p1);
+            for (int i = 0; i < 16; i++)
+                indices[i] = 15 - indices[i];
+        }
+
+        BitWriter writer(out);
+        writer.write(1 << 6, 7);
+        for (int c = 0; c < 4; c++) {
+            writer.write(q0[c], 7);
+            writer.write(q1[c], 7);
+        }
+        writer.write(p0, 1);
+        writer.write(p1, 1);
+        writer.write(indices[0], 3);
+        for (int i = 1; i < 16; i++)
+            writer.write(indices[i], 4);
+    }
+
+    void decodeBc7Block(const unsigned char* in, unsigned char block[64])
+    {
+        BitReader reader(in);
+        if (reader.read(7) != (1 << 6)) {
+            // Not a mode 6 block, mark it clearly instead of guessing
+            for (int i = 0; i < 16; i++) {
+                block[i * 4 + 0] = 255; block[i * 4 + 1] = 0;
+                block[i * 4 + 2] = 255; block[i * 4 + 3] = 255;
+            }
+            return;
+        }
+
+        int q0[4], q1[4];
+        for (int c = 0; c < 4; c++) {
+            q0[c] = reader.read(7);
+            q1[c] = reader.read(7);
+        }
+        int p0 = reader.read(1);
+        int p1 = reader.read(1);
+
+        int palette[16][4];
+        bc7Palette(q0, p0, q1, p1, palette);
+
+        for (int i = 0; i < 16; i++) {
+            int index = reader.read(i == 0 ? 3 : 4);
+            for (int c = 0; c < 4; c++)
+                block[i * 4 + c] = (unsigned char) palette[index][c];
+        }
+    }
+}
+
+std::vector<unsigned char> compressImage(TextureFormat format, const unsigned char* rgba, int width, int height)
+{
+    std::vector<unsigned char> out(textureLevelSize(format, width, height));
+    size_t blockSize = textureLevelSize(format, 4, 4);
+    int blocksX = (width + 3) / 4;
+    int blocksY = (height + 3) / 4;
+
+    unsigned char block[64];
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            unsigned char* dst = out.data() + ((size_t) by * blocksX + bx) * blockSize;
+            fetchBlock(rgba, width, height, bx, by, block);
+
+            switch (format) {
+            case FORMAT_BC1:
+            case FORMAT_BC1_SRGB:
+                encodeColorBlock(block, true, dst);
+                break;
+            case FORMAT_BC3:
+            case FORMAT_BC3_SRGB:
+                encodeChannelBlock(block, 3, dst);
+                encodeColorBlock(block, false, dst + 8);
+                break;
+            case FORMAT_BC5:
+                encodeChannelBlock(block, 0, dst);
+                encodeChannelBlock(block, 1, dst + 8);
+                break;
+            case FORMAT_BC7:
+            case FORMAT_BC7_SRGB:
+                encodeBc7Block(block, dst);
+                break;
+            default:
+                return std::vector<unsigned char>();
+            }
+        }
+    }
+
+    return out;
+}
+
+std::vector<unsigned char> decompressImage(TextureFormat format, const unsigned char* blocks, int width, int height)
+{
+    std::vector<unsigned char> out((size_t) width * height * 4);
+    size_t blockSize = textureLevelSize(format, 4, 4);
+    int blocksX = (width + 3) / 4;
+    int blocksY = (height + 3) / 4;
+
+    unsigned char block[64];
+    for (int by = 0; by < blocksY; by++) {
+        for (int bx = 0; bx < blocksX; bx++) {
+            const unsigned char* src = blocks + ((size_t) by * blocksX + bx) * blockSize;
+
+            switch (format) {
+            case FORMAT_BC1:
+            case FORMAT_BC1_SRGB:
+                decodeColorBlock(src, false, block);
+                break;
+            case FORMAT_BC3:
+            case FORMAT_BC3_SRGB:
+                decodeColorBlock(src + 8, true, block);
+                decodeChannelBlock(src, 3, block);
+                break;
+            case FORMAT_BC5:
+                decodeChannelBlock(src, 0, block);
+                decodeChannelBlock(src + 8, 1, block);
+                for (int i = 0; i < 16; i++) {
+                    block[i * 4 + 2] = 0;
+                    block[i * 4 + 3] = 255;
+                }
+                break;
+            case FORMAT_BC7:
+            case FORMAT_BC7_SRGB:
+                decodeBc7Block(src, block);
+                break;
+            default:
+                return std::vector<unsigned char>();
+            }
+
+            storeBlock(block, width, height, bx, by, out.data());
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "TextureFile.h"
+
+#include <vector>
+
+// CPU encoders for the BCn block formats, used by the texture baker.
+// Input is always tightly packed 8-bit RGBA; images whose size is not a
+// multiple of four are padded by repeating the edge pixels.
+//
+//   BC1 - RGB with 1-bit alpha, 8 bytes per 4x4 block
+//   BC3 - RGB + interpolated alpha, 16 bytes per block
+//   BC5 - two independent channels (R and G), meant for tangent space normals
+//   BC7 - RGBA, encoded with mode 6 only (single subset, 7777.1 endpoints)
+std::vector<unsigned char> compressImage(TextureFormat format, const unsigned char* rgba, int width, int height);
+
+// Decodes a block compressed image back to RGBA8. The runtime uses this when
+// the driver does not expose the compressed format. The BC7 decoder only
+// understands mode 6 blocks, which is all compressImage produces.
+std::vector<unsigned char> decompressImage(TextureFormat format, const unsigned char* blocks, int width, int height);
@@ -0,0 +1,107 @@
+#include "ClusteredLights.h"
+#include "GLState.h"
+
+#include <cstring>
+
+ClusteredLights::ClusteredLights() :
+    _stream(0)
+{
+    memset(_buffers, 0, sizeof(_buffers));
+    memset(_textures, 0, sizeof(_textures));
+}
+
+void ClusteredLights::create(StreamBuffer& stream)
+{
+    _stream = &stream;
+    const GLenum formats[] = { GL_RG32UI, GL_R16UI, GL_RGBA32F };
+
+    glGenBuffers(3, _buffers);
+    glGenTextures(3, _textures);
+    for (int i = 0; i < 3; i++) {
+        upload(_buffers[i], 0, 0);
+        activeTexture(CLUSTER_GRID_UNIT + i);
+        bindTexture(GL_TEXTURE_BUFFER, _textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], _buffers[i]);
+    }
+
+    _block.create(LIGHT_GRID_BLOCK, sizeof(LightGridData));
+}
+
+void ClusteredLights::destroy()
+{
+    glDeleteBuffers(3, _buffers);
+    deleteTextures(3, _textures);
+    memset(_buffers, 0, sizeof(_buffers));
+    memset(_textures, 0, sizeof(_textures));
+    _block.destroy();
+    _lights.clear();
+}
+
+void ClusteredLights::add(const PointLight& light)
+{
+    _lights.push_back(light);
+}
+
+void ClusteredLights::update(const Matrix4f& viewMatrix, const Matrix4f& projMatrix, float zNear, float zFar, int width, int height, WorkerPool* pool)
+{
+    _grid.setProjection(inverse(projMatrix).toArray(), zNear, zFar);
+
+    // The grid works in view space, the shaders in world space
+    _spheres.resize(_lights.size() * 4);
+    _lightData.resize(_lights.size() * 8);
+    for (size_t i = 0; i < _lights.size(); i++) {
+        const PointLight& light = _lights[i];
+        Vector3f center = viewMatrix.transform(light.position, 1);
+        float* sphere = &_spheres[i * 4];
+        sphere[0] = center.x;
+        sphere[1] = center.y;
+        sphere[2] = center.z;
+        sphere[3] = light.radius;
+
+        float* data = &_lightData[i * 8];
+        data[0] = light.position.x;
+        data[1] = light.position.y;
+        data[2] = light.position.z;
+        data[3] = light.radius;
+        data[4] = light.color.x;
+        data[5] = light.color.y;
+        data[6] = light.color.z;
+        data[7] = 0;
+    }
+    _grid.assign(_spheres.data(), _lights.size(), pool);
+    _lights.clear();
+
+    const std::vector<uint32_t>& grid = _grid.grid();
+    const std::vector<uint16_t>& indices = _grid.indices();
+    upload(_buffers[0], grid.data(), grid.size() * sizeof(uint32_t));
+    upload(_buffers[1], indices.data(), indices.size() * sizeof(uint16_t));
+    upload(_buffers[2], _lightData.data(), _lightData.size() * sizeof(float));
+
+    _data.gridSize = Vector4f((float) _grid.tilesX(), (float) _grid.tilesY(), (float) _grid.slices(), (float) _grid.stats().lights);
+    _data.gridScale = Vector4f((float) _grid.tilesX() / width, (float) _grid.tilesY() / height, _grid.sliceScale(), _grid.sliceBias());
+    _block.write(*_stream, &_data, sizeof(LightGridData));
+}
+
+void ClusteredLights::upload(GLuint buffer, const void* data, size_t size)
+{
+    // Some drivers reject empty buffer textures, keep one texel around
+    static const float empty[4] = { 0, 0, 0, 0 };
+    if (size == 0) {
+        data = empty;
+        size = sizeof(empty);
+    }
+
+    // Orphaned rather than streamed: a buffer texture covers a whole
+    // buffer, and plain 3.3 has no glTexBufferRange to point it into the
+    // stream
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW);
+}
+
+void ClusteredLights::bind() const
+{
+    for (int i = 0; i < 3; i++) {
+        activeTexture(CLUSTER_GRID_UNIT + i);
+        bindTexture(GL_TEXTURE_BUFFER, _textures[i]);
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "LightGrid.h"
+#include "UniformBuffer.h"
+#include "StreamBuffer.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+#include <GDT/Vector3f.h>
+
+#include <vector>
+
+class WorkerPool;
+
+// A light that reaches radius units around its position, world space
+class PointLight
+{
+public:
+    Vector3f position;
+    Vector3f color;
+    float radius;
+};
+
+// Point lights for clustered forward shading. Every frame the lights are
+// sorted into the clusters of a LightGrid on the CPU, and the grid, the
+// per-cluster light lists and the lights themselves go to the shaders as
+// buffer textures, see clusteredLights() in blinnphong.frag.
+//
+// The grid is a pair of offset and count per cluster (RG32UI), the lists
+// are light indices (R16UI) and each light is two texels (RGBA32F): the
+// world position with the radius, then the color.
+class ClusteredLights
+{
+public:
+    ClusteredLights();
+
+    // The LightGridData block is written into the stream, so update() has
+    // to run between its beginFrame() and endFrame()
+    void create(StreamBuffer& stream);
+    void destroy();
+
+    // Lights are for one frame, update() clears them
+    void add(const PointLight& light);
+
+    // Assigns the lights to the clusters of the view and uploads the
+    // lists and the LightGridData block. width and height are the
+    // viewport's.
+    void update(const Matrix4f& viewMatrix, const Matrix4f& projMatrix, float zNear, float zFar, int width, int height, WorkerPool* pool = 0);
+
+    // Binds the buffer textures to their units
+    void bind() const;
+
+    const LightGridStats& stats() const { return _grid.stats(); }
+
+    static const unsigned int CLUSTER_GRID_UNIT = 3;
+    static const unsigned int LIGHT_INDEX_UNIT = 4;
+    static const unsigned int LIGHT_DATA_UNIT = 5;
+
+private:
+    void upload(GLuint buffer, const void* data, size_t size);
+
+    LightGrid _grid;
+    std::vector<PointLight> _lights;
+    std::vector<float> _spheres;
+    std::vector<float> _lightData;
+
+    GLuint _buffers[3];
+    GLuint _textures[3];
+
+    LightGridData _data;
+    UniformBuffer _block;
+    StreamBuffer* _stream;
+};
@@ -0,0 +1,175 @@
+#include "DebugDraw.h"
+#include "GLState.h"
+
+#include <GDT/Vector4f.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+namespace
+{
+    // Corner pairs of a box's edges, corners numbered by their x, y and z
+    // bits like in worldBounds()
+    const int boxEdges[12][2] = {
+        { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 },
+        { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+        { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+    };
+
+    void boxLines(DebugDraw& draw, const Vector3f* corners, const Vector3f& color)
+    {
+        for (int i = 0; i < 12; i++)
+            draw.line(corners[boxEdges[i][0]], corners[boxEdges[i][1]], color);
+    }
+
+    uint8_t unorm(float value)
+    {
+        return (uint8_t) (std::max(0.0f, std::min(value, 1.0f)) * 255 + 0.5f);
+    }
+
+    DebugDraw lines;
+}
+
+DebugDraw::DebugDraw() :
+    _program(0),
+    _stream(0),
+    _maxLines(0),
+    _dropped(0),
+    _vao(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void DebugDraw::create(const Program& program, StreamBuffer& stream, int maxLines)
+{
+    _program = &program;
+    _stream = &stream;
+    _maxLines = maxLines;
+    _vertices.reserve(maxLines * 2);
+
+    // Draws pick their vertices by the first vertex, the attributes point
+    // at the start of the stream
+    glBindBuffer(GL_ARRAY_BUFFER, stream.handle());
+    glGenVertexArrays(1, &_vao);
+    bindVertexArray(_vao);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) offsetof(Vertex, position));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*) offsetof(Vertex, color));
+    glEnableVertexAttribArray(1);
+    bindVertexArray(0);
+}
+
+void DebugDraw::destroy()
+{
+    deleteVertexArrays(1, &_vao);
+    _vao = 0;
+    _program = 0;
+    _stream = 0;
+    _vertices.clear();
+}
+
+void DebugDraw::line(const Vector3f& from, const Vector3f& to, const Vector3f& color)
+{
+    if ((int) _vertices.size() >= _maxLines * 2) {
+        _dropped++;
+        return;
+    }
+
+    Vertex vertex;
+    vertex.color[0] = unorm(color.x);
+    vertex.color[1] = unorm(color.y);
+    vertex.color[2] = unorm(color.z);
+    vertex.color[3] = 255;
+
+    vertex.position[0] = from.x;
+    vertex.position[1] = from.y;
+    vertex.position[2] = from.z;
+    _vertices.push_back(vertex);
+    vertex.position[0] = to.x;
+    vertex.position[1] = to.y;
+    vertex.position[2] = to.z;
+    _vertices.push_back(vertex);
+}
+
+void DebugDraw::box(const Vector3f& min, const Vector3f& max, const Vector3f& color)
+{
+    Vector3f corners[8];
+    for (int i = 0; i < 8; i++)
+        corners[i] = Vector3f(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+    boxLines(*this, corners, color);
+}
+
+void DebugDraw::box(const Bounds& bounds, const Vector3f& color)
+{
+    box(Vector3f(bounds.min[0], bounds.min[1], bounds.min[2]), Vector3f(bounds.max[0], bounds.max[1], bounds.max[2]), color);
+}
+
+void DebugDraw::sphere(const Vector3f& center, float radius, const Vector3f& color, int segments)
+{
+    for (int axis = 0; axis < 3; axis++) {
+        Vector3f previous;
+        for (int i = 0; i <= segments; i++) {
+            float angle = i * 2 * 3.14159265f / segments;
+            float a = radius * std::cos(angle), b = radius * std::sin(angle);
+            Vector3f offset = axis == 0 ? Vector3f(0, a, b) : axis == 1 ? Vector3f(a, 0, b) : Vector3f(a, b, 0);
+            Vector3f point(center.x + offset.x, center.y + offset.y, center.z + offset.z);
+            if (i > 0)
+                line(previous, point, color);
+            previous = point;
+        }
+    }
+}
+
+void DebugDraw::frustum(const Matrix4f& viewProjection, const Vector3f& color)
+{
+    // The corners of the clip cube back in world space
+    Matrix4f clipToWorld = inverse(viewProjection);
+    Vector3f corners[8];
+    for (int i = 0; i < 8; i++) {
+        Vector4f p = clipToWorld * Vector4f(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f, 1.0f);
+        corners[i] = Vector3f(p.x / p.w, p.y / p.w, p.z / p.w);
+    }
+    boxLines(*this, corners, color);
+}
+
+void DebugDraw::axes(const Matrix4f& transform, float size)
+{
+    Vector3f origin = transform.transform(Vector3f(0, 0, 0), 1);
+    line(origin, transform.transform(Vector3f(size, 0, 0), 1), Vector3f(1, 0, 0));
+    line(origin, transform.transform(Vector3f(0, size, 0), 1), Vector3f(0, 1, 0));
+    line(origin, transform.transform(Vector3f(0, 0, size), 1), Vector3f(0, 0, 1));
+}
+
+void DebugDraw::flush()
+{
+    _stats.lines = (int) _vertices.size() / 2;
+    _stats.dropped = _dropped;
+    _stats.draws = 0;
+    _dropped = 0;
+    if (_vertices.empty() || !_stream)
+        return;
+
+    // Aligned to whole vertices, so the offset is a first vertex
+    StreamAllocation allocation = _stream->write(_vertices.data(), _vertices.size() * sizeof(Vertex), sizeof(Vertex));
+    if (allocation.size == 0) {
+        _stats.dropped += _stats.lines;
+        _vertices.clear();
+        return;
+    }
+    GLint first = (GLint) (allocation.offset / sizeof(Vertex));
+
+    _program->bind();
+    bindVertexArray(_vao);
+    glDrawArrays(GL_LINES, first, (GLsizei) _vertices.size());
+    bindVertexArray(0);
+    _stats.draws = 1;
+
+    _vertices.clear();
+}
+
+DebugDraw& debugDraw()
+{
+    return lines;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Program.h"
+#include "FrustumCulling.h"
+#include "StreamBuffer.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+#include <GDT/Vector3f.h>
+
+#include <cstdint>
+#include <vector>
+
+class DebugDrawStats
+{
+public:
+    int lines;
+    int dropped;
+    int draws;
+};
+
+// Lines for debugging, added from anywhere during a frame and drawn
+// together by flush(). Every shape is broken into lines on the CPU, so a
+// frame's worth of boxes, spheres and frustums is one GL_LINES draw.
+//
+// The vertices are written into a StreamBuffer when they're drawn. Lines
+// past maxLines, or past the space left in the stream, are dropped.
+class DebugDraw
+{
+public:
+    DebugDraw();
+
+    // program draws with debug.vert and debug.frag
+    void create(const Program& program, StreamBuffer& stream, int maxLines = 65536);
+    void destroy();
+
+    void line(const Vector3f& from, const Vector3f& to, const Vector3f& color);
+    void box(const Vector3f& min, const Vector3f& max, const Vector3f& color);
+    void box(const Bounds& bounds, const Vector3f& color);
+    // A circle around each axis
+    void sphere(const Vector3f& center, float radius, const Vector3f& color, int segments = 16);
+    // The frustum of a projection * view matrix
+    void frustum(const Matrix4f& viewProjection, const Vector3f& color);
+    // The transform's x, y and z axes in red, green and blue
+    void axes(const Matrix4f& transform, float size = 1);
+
+    // Draws and clears the lines. Needs the FrameData block bound and
+    // the stream between beginFrame() and endFrame().
+    void flush();
+
+    // Of the last flush
+    const DebugDrawStats& stats() const { return _stats; }
+
+private:
+    class Vertex
+    {
+    public:
+        float position[3];
+        uint8_t color[4];
+    };
+
+    const Program* _program;
+    StreamBuffer* _stream;
+    int _maxLines;
+    std::vector<Vertex> _vertices;
+    int _dropped;
+
+    GLuint _vao;
+
+    DebugDrawStats _stats;
+};
+
+// The lines every part of the code can add to, drawn once per frame
+DebugDraw& debugDraw();
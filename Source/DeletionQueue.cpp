@@ -0,0 +1,120 @@
+#include "DeletionQueue.h"
+#include "GLState.h"
+
+#include <cstring>
+
+namespace
+{
+    DeletionQueue queue;
+}
+
+DeletionQueue::DeletionQueue()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void DeletionQueue::deleteBuffers(GLsizei count, const GLuint* buffers)
+{
+    add(BUFFERS, count, buffers);
+}
+
+void DeletionQueue::deleteTextures(GLsizei count, const GLuint* textures)
+{
+    add(TEXTURES, count, textures);
+}
+
+void DeletionQueue::deleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    add(VERTEX_ARRAYS, count, vertexArrays);
+}
+
+void DeletionQueue::deleteFramebuffers(GLsizei count, const GLuint* framebuffers)
+{
+    add(FRAMEBUFFERS, count, framebuffers);
+}
+
+void DeletionQueue::add(Kind kind, GLsizei count, const GLuint* handles)
+{
+    for (GLsizei i = 0; i < count; i++) {
+        // Like glDelete*, zero is ignored
+        if (handles[i] != 0) {
+            _pending[kind].push_back(handles[i]);
+            _stats.pending++;
+        }
+    }
+}
+
+void DeletionQueue::endFrame()
+{
+    _stats.deleted = 0;
+    _stats.calls = 0;
+
+    bool pending = false;
+    for (int kind = 0; kind < KIND_COUNT; kind++)
+        pending = pending || !_pending[kind].empty();
+    if (pending) {
+        _batches.push_back(Batch());
+        Batch& batch = _batches.back();
+        batch.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        for (int kind = 0; kind < KIND_COUNT; kind++)
+            batch.handles[kind].swap(_pending[kind]);
+    }
+
+    // Everything the passed fences held goes in one call per kind
+    std::vector<GLuint> ready[KIND_COUNT];
+    while (!_batches.empty()) {
+        Batch& batch = _batches.front();
+        GLenum status = glClientWaitSync(batch.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break;
+
+        glDeleteSync(batch.fence);
+        for (int kind = 0; kind < KIND_COUNT; kind++)
+            ready[kind].insert(ready[kind].end(), batch.handles[kind].begin(), batch.handles[kind].end());
+        _batches.pop_front();
+    }
+    release(ready);
+}
+
+void DeletionQueue::flush()
+{
+    std::vector<GLuint> ready[KIND_COUNT];
+    for (size_t i = 0; i < _batches.size(); i++) {
+        glDeleteSync(_batches[i].fence);
+        for (int kind = 0; kind < KIND_COUNT; kind++)
+            ready[kind].insert(ready[kind].end(), _batches[i].handles[kind].begin(), _batches[i].handles[kind].end());
+    }
+    _batches.clear();
+
+    for (int kind = 0; kind < KIND_COUNT; kind++) {
+        ready[kind].insert(ready[kind].end(), _pending[kind].begin(), _pending[kind].end());
+        _pending[kind].clear();
+    }
+    release(ready);
+}
+
+void DeletionQueue::release(std::vector<GLuint>* handles)
+{
+    for (int kind = 0; kind < KIND_COUNT; kind++) {
+        if (handles[kind].empty())
+            continue;
+
+        GLsizei count = (GLsizei) handles[kind].size();
+        switch (kind) {
+        case BUFFERS: glDeleteBuffers(count, handles[kind].data()); break;
+        // Through the state cache, which forgets the deleted bindings
+        case TEXTURES: ::deleteTextures(count, handles[kind].data()); break;
+        case VERTEX_ARRAYS: ::deleteVertexArrays(count, handles[kind].data()); break;
+        default: glDeleteFramebuffers(count, handles[kind].data()); break;
+        }
+
+        _stats.pending -= count;
+        _stats.deleted += count;
+        _stats.calls++;
+    }
+}
+
+DeletionQueue& deletionQueue()
+{
+    return queue;
+}
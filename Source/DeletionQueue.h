@@ -0,0 +1,73 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+
+#include <deque>
+#include <vector>
+
+class DeletionStats
+{
+public:
+    // Handles waiting for their frame to finish
+    int pending;
+    // Deleted by the last endFrame(), and the glDelete* calls it took
+    int deleted;
+    int calls;
+};
+
+// GL objects freed while frames that use them may still be in flight.
+// Deleting those right away can make the driver wait for the GPU, so the
+// handles are held until the fence of the frame they were freed in has
+// passed, then deleted together, one glDelete* call per kind of object.
+//
+// Objects freed during a frame can only have been used by that frame and
+// earlier ones, so its fence covers every use.
+class DeletionQueue
+{
+public:
+    DeletionQueue();
+
+    void deleteBuffers(GLsizei count, const GLuint* buffers);
+    void deleteTextures(GLsizei count, const GLuint* textures);
+    void deleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
+    void deleteFramebuffers(GLsizei count, const GLuint* framebuffers);
+
+    // Fences the handles freed this frame and deletes the ones whose
+    // fence has passed. Call once per frame, after the last draw.
+    void endFrame();
+
+    // Deletes everything now, for shutdown
+    void flush();
+
+    const DeletionStats& stats() const { return _stats; }
+
+private:
+    enum Kind
+    {
+        BUFFERS,
+        TEXTURES,
+        VERTEX_ARRAYS,
+        FRAMEBUFFERS,
+        KIND_COUNT
+    };
+
+    class Batch
+    {
+    public:
+        GLsync fence;
+        std::vector<GLuint> handles[KIND_COUNT];
+    };
+
+    void add(Kind kind, GLsizei count, const GLuint* handles);
+    void release(std::vector<GLuint>* handles);
+
+    std::vector<GLuint> _pending[KIND_COUNT];
+
+    // Oldest first, fences pass in that order
+    std::deque<Batch> _batches;
+
+    DeletionStats _stats;
+};
+
+// The queue everything that frees GL objects mid-game goes through
+DeletionQueue& deletionQueue();
@@ -0,0 +1,36 @@
+#include "Extensions.h"
+
+#include <GDT/OpenGL.h>
+#include <GLFW/glfw3.h>
+
+#include <set>
+#include <string>
+
+bool hasExtension(const char* name)
+{
+    static std::set<std::string> extensions;
+    static bool queried = false;
+
+    if (!queried) {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++)
+            extensions.insert((const char*) glGetStringi(GL_EXTENSIONS, i));
+        queried = true;
+    }
+
+    return extensions.count(name) > 0;
+}
+
+bool hasGLVersion(int major, int minor)
+{
+    GLint contextMajor = 0, contextMinor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &contextMajor);
+    glGetIntegerv(GL_MINOR_VERSION, &contextMinor);
+    return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
+
+void* getProcAddress(const char* name)
+{
+    return (void*) glfwGetProcAddress(name);
+}
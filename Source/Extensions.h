@@ -0,0 +1,13 @@
+#pragma once
+
+// Returns whether the current GL context advertises the given extension.
+// The extension list is read once per process, so this is cheap to call
+// from loading code. Requires a current context.
+bool hasExtension(const char* name);
+
+// Whether the context version is at least major.minor
+bool hasGLVersion(int major, int minor);
+
+// Looks up an entry point that the 3.3 loader doesn't cover. Returns null
+// if the driver doesn't export it.
+void* getProcAddress(const char* name);
@@ -0,0 +1,307 @@
+#include "FrustumCulling.h"
+#include "WorkerPool.h"
+#include "Simd.h"
+
+#include <cmath>
+#include <cstring>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Objects per parallel chunk, a multiple of 8 so chunks never share a
+    // group of lanes
+    const size_t CHUNK_SIZE = 4096;
+
+    // For each mask of visible lanes, the lane numbers of the set bits in
+    // order. The AVX2 table packs them into nibbles, the SSE one has four
+    // ready made lanes.
+    class CompactTable
+    {
+    public:
+        uint32_t nibbles[256];
+        uint32_t lanes[16][4];
+        unsigned char counts[256];
+
+        CompactTable()
+        {
+            for (int mask = 0; mask < 256; mask++) {
+                uint32_t packed = 0;
+                int count = 0;
+                for (int lane = 0; lane < 8; lane++) {
+                    if (mask & (1 << lane))
+                        packed |= lane << (4 * count++);
+                }
+                nibbles[mask] = packed;
+                counts[mask] = (unsigned char) count;
+            }
+            for (int mask = 0; mask < 16; mask++) {
+                int count = 0;
+                memset(lanes[mask], 0, sizeof(lanes[mask]));
+                for (int lane = 0; lane < 4; lane++) {
+                    if (mask & (1 << lane))
+                        lanes[mask][count++] = lane;
+                }
+            }
+        }
+    };
+
+    const CompactTable compactTable;
+
+    // All versions evaluate a * x + b * y + c * z + d with the same
+    // operations in the same order, without FMA, so they agree on objects
+    // that touch a plane
+
+    size_t cullScalar(const BoundsTable& t, const Frustum& frustum, size_t begin, size_t end, uint32_t* out)
+    {
+        size_t count = 0;
+        for (size_t i = begin; i < end; i++) {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++) {
+                const float* plane = frustum.planes[p];
+                float sphere = plane[0] * t.centerX[i] + plane[1] * t.centerY[i] + plane[2] * t.centerZ[i] + plane[3];
+
+                // Box corner furthest along the plane normal
+                float x = plane[0] >= 0 ? t.maxX[i] : t.minX[i];
+                float y = plane[1] >= 0 ? t.maxY[i] : t.minY[i];
+                float z = plane[2] >= 0 ? t.maxZ[i] : t.minZ[i];
+                float box = plane[0] * x + plane[1] * y + plane[2] * z + plane[3];
+
+                inside = !(sphere < -t.radius[i]) && !(box < 0);
+            }
+            if (inside)
+                out[count++] = (uint32_t) i;
+        }
+        return count;
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET_SSE41 size_t cullSse(const BoundsTable& t, const Frustum& frustum, size_t begin, size_t end, uint32_t* out)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        size_t count = 0;
+
+        for (size_t i = begin; i < end; i += 4) {
+            __m128 cx = _mm_loadu_ps(&t.centerX[i]);
+            __m128 cy = _mm_loadu_ps(&t.centerY[i]);
+            __m128 cz = _mm_loadu_ps(&t.centerZ[i]);
+            __m128 negRadius = _mm_xor_ps(_mm_loadu_ps(&t.radius[i]), sign);
+
+            __m128 outside = _mm_setzero_ps();
+            for (int p = 0; p < 6; p++) {
+                const float* plane = frustum.planes[p];
+                __m128 a = _mm_set1_ps(plane[0]);
+                __m128 b = _mm_set1_ps(plane[1]);
+                __m128 c = _mm_set1_ps(plane[2]);
+                __m128 d = _mm_set1_ps(plane[3]);
+
+                __m128 sphere = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, cx), _mm_mul_ps(b, cy)), _mm_mul_ps(c, cz)), d);
+
+                // The plane is the same for all lanes, so is the corner
+                __m128 x = _mm_loadu_ps(plane[0] >= 0 ? &t.maxX[i] : &t.minX[i]);
+                __m128 y = _mm_loadu_ps(plane[1] >= 0 ? &t.maxY[i] : &t.minY[i]);
+                __m128 z = _mm_loadu_ps(plane[2] >= 0 ? &t.maxZ[i] : &t.minZ[i]);
+                __m128 box = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y)), _mm_mul_ps(c, z)), d);
+
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(sphere, negRadius));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(box, _mm_setzero_ps()));
+                if (_mm_movemask_ps(outside) == 0xF)
+                    break;
+            }
+
+            int mask = ~_mm_movemask_ps(outside) & 0xF;
+            if (end - i < 4)
+                mask &= (1 << (end - i)) - 1;
+
+            __m128i lanes = _mm_loadu_si128((const __m128i*) compactTable.lanes[mask]);
+            _mm_storeu_si128((__m128i*) (out + count), _mm_add_epi32(lanes, _mm_set1_epi32((int) i)));
+            count += compactTable.counts[mask];
+        }
+        return count;
+    }
+
+    SIMD_TARGET_AVX2 size_t cullAvx2(const BoundsTable& t, const Frustum& frustum, size_t begin, size_t end, uint32_t* out)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        const __m256i shifts = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+        const __m256i laneMask = _mm256_set1_epi32(7);
+        size_t count = 0;
+
+        for (size_t i = begin; i < end; i += 8) {
+            __m256 cx = _mm256_loadu_ps(&t.centerX[i]);
+            __m256 cy = _mm256_loadu_ps(&t.centerY[i]);
+            __m256 cz = _mm256_loadu_ps(&t.centerZ[i]);
+            __m256 negRadius = _mm256_xor_ps(_mm256_loadu_ps(&t.radius[i]), sign);
+
+            __m256 outside = _mm256_setzero_ps();
+            for (int p = 0; p < 6; p++) {
+                const float* plane = frustum.planes[p];
+                __m256 a = _mm256_set1_ps(plane[0]);
+                __m256 b = _mm256_set1_ps(plane[1]);
+                __m256 c = _mm256_set1_ps(plane[2]);
+                __m256 d = _mm256_set1_ps(plane[3]);
+
+                __m256 sphere = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, cx), _mm256_mul_ps(b, cy)), _mm256_mul_ps(c, cz)), d);
+
+                __m256 x = _mm256_loadu_ps(plane[0] >= 0 ? &t.maxX[i] : &t.minX[i]);
+                __m256 y = _mm256_loadu_ps(plane[1] >= 0 ? &t.maxY[i] : &t.minY[i]);
+                __m256 z = _mm256_loadu_ps(plane[2] >= 0 ? &t.maxZ[i] : &t.minZ[i]);
+                __m256 box = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, x), _mm256_mul_ps(b, y)), _mm256_mul_ps(c, z)), d);
+
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(sphere, negRadius, _CMP_LT_OQ));
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(box, _mm256_setzero_ps(), _CMP_LT_OQ));
+                if (_mm256_movemask_ps(outside) == 0xFF)
+                    break;
+            }
+
+            int mask = ~_mm256_movemask_ps(outside) & 0xFF;
+            if (end - i < 8)
+                mask &= (1 << (end - i)) - 1;
+
+            // Writes all 8 lanes, only the first popcount are kept
+            __m256i lanes = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32((int) compactTable.nibbles[mask]), shifts), laneMask);
+            _mm256_storeu_si256((__m256i*) (out + count), _mm256_add_epi32(lanes, _mm256_set1_epi32((int) i)));
+            count += compactTable.counts[mask];
+        }
+        return count;
+    }
+#endif
+
+    // Culls [begin, end), begin a multiple of 8. Vector versions write up
+    // to 7 entries past the result, which stays within out[0, end - begin
+    // rounded up to 8).
+    size_t cullRange(const BoundsTable& table, const Frustum& frustum, size_t begin, size_t end, uint32_t* out)
+    {
+#ifdef SIMD_X86
+        if (simdLevel() >= SIMD_AVX2)
+            return cullAvx2(table, frustum, begin, end, out);
+        if (simdLevel() >= SIMD_SSE41)
+            return cullSse(table, frustum, begin, end, out);
+#endif
+        return cullScalar(table, frustum, begin, end, out);
+    }
+
+    void normalize(float* plane)
+    {
+        float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        for (int i = 0; i < 4; i++)
+            plane[i] /= length;
+    }
+}
+
+Frustum extractFrustum(const float* m)
+{
+    // Rows of the matrix, m[column * 4 + row]
+    float rows[4][4];
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++)
+            rows[r][c] = m[c * 4 + r];
+    }
+
+    // Clip space -w <= x, y, z <= w, so every plane is w plus or minus a row
+    Frustum frustum;
+    for (int p = 0; p < 6; p++) {
+        float side = p % 2 == 0 ? 1.0f : -1.0f;
+        for (int c = 0; c < 4; c++)
+            frustum.planes[p][c] = rows[3][c] + side * rows[p / 2][c];
+        normalize(frustum.planes[p]);
+    }
+    return frustum;
+}
+
+BoundsTable::BoundsTable() :
+    _size(0)
+{
+}
+
+void BoundsTable::resize(size_t size)
+{
+    _size = size;
+
+    size_t padded = (size + 7) & ~(size_t) 7;
+    std::vector<float>* arrays[] = { &centerX, &centerY, &centerZ, &radius, &minX, &minY, &minZ, &maxX, &maxY, &maxZ };
+    for (int i = 0; i < 10; i++)
+        arrays[i]->resize(padded, 0.0f);
+}
+
+size_t BoundsTable::add(const Bounds& bounds)
+{
+    size_t index = _size;
+    resize(_size + 1);
+    set(index, bounds);
+    return index;
+}
+
+void BoundsTable::set(size_t index, const Bounds& bounds)
+{
+    centerX[index] = bounds.center[0];
+    centerY[index] = bounds.center[1];
+    centerZ[index] = bounds.center[2];
+    radius[index] = bounds.radius;
+    minX[index] = bounds.min[0];
+    minY[index] = bounds.min[1];
+    minZ[index] = bounds.min[2];
+    maxX[index] = bounds.max[0];
+    maxY[index] = bounds.max[1];
+    maxZ[index] = bounds.max[2];
+}
+
+Bounds BoundsTable::get(size_t index) const
+{
+    Bounds bounds;
+    bounds.center[0] = centerX[index];
+    bounds.center[1] = centerY[index];
+    bounds.center[2] = centerZ[index];
+    bounds.radius = radius[index];
+    bounds.min[0] = minX[index];
+    bounds.min[1] = minY[index];
+    bounds.min[2] = minZ[index];
+    bounds.max[0] = maxX[index];
+    bounds.max[1] = maxY[index];
+    bounds.max[2] = maxZ[index];
+    return bounds;
+}
+
+void BoundsTable::remove(size_t index)
+{
+    if (index + 1 < _size)
+        set(index, get(_size - 1));
+    resize(_size - 1);
+}
+
+void BoundsTable::clear()
+{
+    resize(0);
+}
+
+size_t cullFrustum(const BoundsTable& table, const Frustum& frustum, std::vector<uint32_t>& visible, WorkerPool* pool)
+{
+    size_t size = table.size();
+    visible.resize(table.centerX.size());
+    if (size == 0)
+        return 0;
+
+    if (!pool || pool->threadCount() == 1 || size <= CHUNK_SIZE) {
+        size_t count = cullRange(table, frustum, 0, size, visible.data());
+        visible.resize(count);
+        return count;
+    }
+
+    // Every chunk writes to its own part of the output, which is then
+    // closed up in order
+    size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<size_t> counts(chunks);
+    pool->parallelFor(size, CHUNK_SIZE, [&](size_t begin, size_t end) {
+        counts[begin / CHUNK_SIZE] = cullRange(table, frustum, begin, end, visible.data() + begin);
+    });
+
+    size_t count = counts[0];
+    for (size_t i = 1; i < chunks; i++) {
+        memmove(visible.data() + count, visible.data() + i * CHUNK_SIZE, counts[i] * sizeof(uint32_t));
+        count += counts[i];
+    }
+    visible.resize(count);
+    return count;
+}
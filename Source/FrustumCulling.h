@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+// Planes are (a, b, c, d) with a * x + b * y + c * z + d >= 0 inside and
+// (a, b, c) normalized, in the order left, right, bottom, top, near, far
+class Frustum
+{
+public:
+    float planes[6][4];
+};
+
+// Extracts the frustum planes in world space from projMatrix * viewMatrix,
+// column major as GDT's Matrix4f stores it
+Frustum extractFrustum(const float* viewProjection);
+
+// World space bounds of one object. An object is culled when either its
+// sphere or its box is outside a plane, so the sphere can be loose.
+class Bounds
+{
+public:
+    float center[3];
+    float radius;
+    float min[3];
+    float max[3];
+};
+
+// Bounds of many objects, stored per component so the culling kernels can
+// test 8 objects with one instruction per component. Indices are stable
+// except for remove(), which moves the last object into the hole.
+class BoundsTable
+{
+public:
+    BoundsTable();
+
+    size_t add(const Bounds& bounds);
+    void set(size_t index, const Bounds& bounds);
+    Bounds get(size_t index) const;
+    void remove(size_t index);
+    void clear();
+
+    size_t size() const { return _size; }
+
+    // Component arrays, padded to a multiple of 8 entries
+    std::vector<float> centerX, centerY, centerZ, radius;
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+
+private:
+    void resize(size_t size);
+
+    size_t _size;
+};
+
+// Writes the indices of the objects inside the frustum to visible, in
+// ascending order, and returns how many there are. With a pool the table is
+// split into chunks that are culled in parallel.
+size_t cullFrustum(const BoundsTable& table, const Frustum& frustum, std::vector<uint32_t>& visible, WorkerPool* pool = 0);
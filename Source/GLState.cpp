@@ -0,0 +1,224 @@
+#include "GLState.h"
+
+#include <cstring>
+
+namespace
+{
+    const unsigned int MAX_TEXTURE_UNITS = 16;
+    const int MAX_CAPABILITIES = 8;
+
+    // Texture bindings are per unit and per target
+    class TextureBinding
+    {
+    public:
+        GLenum target;
+        GLuint texture;
+    };
+
+    class Capability
+    {
+    public:
+        GLenum capability;
+        bool enabled;
+    };
+
+    // Unknown states are -1 / empty so the first call always goes through
+    class State
+    {
+    public:
+        State() { invalidate(); }
+
+        void invalidate()
+        {
+            program = ~0u;
+            vertexArray = ~0u;
+            activeUnit = ~0u;
+            for (unsigned int i = 0; i < MAX_TEXTURE_UNITS; i++)
+                textureCount[i] = 0;
+            capabilityCount = 0;
+            depthFunc = GL_NONE;
+            depthMask = -1;
+            colorMask = -1;
+        }
+
+        GLuint program;
+        GLuint vertexArray;
+        unsigned int activeUnit;
+
+        TextureBinding textures[MAX_TEXTURE_UNITS][4];
+        int textureCount[MAX_TEXTURE_UNITS];
+
+        Capability capabilities[MAX_CAPABILITIES];
+        int capabilityCount;
+
+        GLenum depthFunc;
+        int depthMask;
+        int colorMask;
+    };
+
+    State state;
+    GLStateStats stats;
+
+    // Returns whether the value changed, storing it if so
+    template <typename T>
+    bool update(T& cached, T value, GLStateCounter& counter)
+    {
+        if (cached == value) {
+            counter.elided++;
+            return false;
+        }
+        cached = value;
+        counter.issued++;
+        return true;
+    }
+
+    void setCapability(GLenum capability, bool enabled)
+    {
+        for (int i = 0; i < state.capabilityCount; i++) {
+            if (state.capabilities[i].capability == capability) {
+                if (update(state.capabilities[i].enabled, enabled, stats.capabilities)) {
+                    if (enabled)
+                        glEnable(capability);
+                    else
+                        glDisable(capability);
+                }
+                return;
+            }
+        }
+
+        // Not tracked yet, or no room left to track it
+        if (state.capabilityCount < MAX_CAPABILITIES) {
+            Capability& entry = state.capabilities[state.capabilityCount++];
+            entry.capability = capability;
+            entry.enabled = enabled;
+        }
+        stats.capabilities.issued++;
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+}
+
+void useProgram(GLuint program)
+{
+    if (update(state.program, program, stats.programs))
+        glUseProgram(program);
+}
+
+void bindVertexArray(GLuint vertexArray)
+{
+    if (update(state.vertexArray, vertexArray, stats.vertexArrays))
+        glBindVertexArray(vertexArray);
+}
+
+void activeTexture(unsigned int unit)
+{
+    if (state.activeUnit != unit) {
+        state.activeUnit = unit;
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+}
+
+void bindTexture(GLenum target, GLuint texture)
+{
+    // Units past what's tracked, or an unknown active unit, aren't cached
+    unsigned int unit = state.activeUnit;
+    if (unit >= MAX_TEXTURE_UNITS) {
+        stats.textures.issued++;
+        glBindTexture(target, texture);
+        return;
+    }
+
+    TextureBinding* bindings = state.textures[unit];
+    int& count = state.textureCount[unit];
+    for (int i = 0; i < count; i++) {
+        if (bindings[i].target == target) {
+            if (update(bindings[i].texture, texture, stats.textures))
+                glBindTexture(target, texture);
+            return;
+        }
+    }
+
+    if (count < 4) {
+        bindings[count].target = target;
+        bindings[count].texture = texture;
+        count++;
+    }
+    stats.textures.issued++;
+    glBindTexture(target, texture);
+}
+
+void enable(GLenum capability)
+{
+    setCapability(capability, true);
+}
+
+void disable(GLenum capability)
+{
+    setCapability(capability, false);
+}
+
+void depthFunc(GLenum func)
+{
+    if (update(state.depthFunc, func, stats.capabilities))
+        glDepthFunc(func);
+}
+
+void depthMask(bool write)
+{
+    if (update(state.depthMask, (int) write, stats.capabilities))
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+}
+
+void colorMask(bool write)
+{
+    if (update(state.colorMask, (int) write, stats.capabilities)) {
+        GLboolean mask = write ? GL_TRUE : GL_FALSE;
+        glColorMask(mask, mask, mask, mask);
+    }
+}
+
+void deleteProgram(GLuint program)
+{
+    if (state.program == program)
+        state.program = 0;
+    glDeleteProgram(program);
+}
+
+void deleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    for (GLsizei i = 0; i < count; i++) {
+        if (state.vertexArray == vertexArrays[i])
+            state.vertexArray = 0;
+    }
+    glDeleteVertexArrays(count, vertexArrays);
+}
+
+void deleteTextures(GLsizei count, const GLuint* textures)
+{
+    for (GLsizei i = 0; i < count; i++) {
+        for (unsigned int unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+            for (int b = 0; b < state.textureCount[unit]; b++) {
+                if (state.textures[unit][b].texture == textures[i])
+                    state.textures[unit][b].texture = 0;
+            }
+        }
+    }
+    glDeleteTextures(count, textures);
+}
+
+void invalidateGLState()
+{
+    state.invalidate();
+}
+
+GLStateStats& glStateStats()
+{
+    return stats;
+}
+
+void resetGLStateStats()
+{
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+
+// Thin cache over the GL binding state. Each function mirrors the GL call
+// it replaces but returns without calling GL when the state already has
+// that value. All code that binds programs, vertex arrays or textures
+// should go through these, or call invalidateGLState() afterwards.
+
+void useProgram(GLuint program);
+void bindVertexArray(GLuint vertexArray);
+
+// Like glActiveTexture, but takes the unit index instead of GL_TEXTUREi
+void activeTexture(unsigned int unit);
+void bindTexture(GLenum target, GLuint texture);
+
+void enable(GLenum capability);
+void disable(GLenum capability);
+void depthFunc(GLenum func);
+void depthMask(bool write);
+void colorMask(bool write);
+
+// Deleting a bound object resets its binding to 0, these keep the cache
+// in line with that
+void deleteProgram(GLuint program);
+void deleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
+void deleteTextures(GLsizei count, const GLuint* textures);
+
+// Forgets everything, for after code that changes state behind the cache
+void invalidateGLState();
+
+class GLStateCounter
+{
+public:
+    int issued;
+    int elided;
+};
+
+// Calls made and skipped since the last reset
+class GLStateStats
+{
+public:
+    GLStateCounter programs;
+    GLStateCounter vertexArrays;
+    GLStateCounter textures;
+    GLStateCounter capabilities;
+    GLStateCounter uniforms;
+};
+
+GLStateStats& glStateStats();
+void resetGLStateStats();
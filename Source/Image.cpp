@@ -1,4 +1,9 @@
 #include "Image.h"
+#include "TextureFile.h"
+#include "BlockCompression.h"
+#include "Extensions.h"
+#include "PixelConversion.h"
+#include "GLState.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -6,14 +11,201 @@
 #include <GDT/OpenGL.h>
 
 #include <iostream>
+#include <algorithm>
+
+// Compressed formats that are extensions to the 3.3 core profile
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT 0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#define GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM 0x8E8D
+
+namespace
+{
+    size_t totalTextureMemory = 0;
+
+    GLenum glInternalFormat(TextureFormat format)
+    {
+        switch (format) {
+        case FORMAT_RGBA8: return GL_RGBA8;
+        case FORMAT_RGBA8_SRGB: return GL_SRGB8_ALPHA8;
+        case FORMAT_BC1: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+        case FORMAT_BC1_SRGB: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;
+        case FORMAT_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case FORMAT_BC3_SRGB: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+        case FORMAT_BC5: return GL_COMPRESSED_RG_RGTC2;
+        case FORMAT_BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+        case FORMAT_BC7_SRGB: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+        default: return 0;
+        }
+    }
+
+    bool isFormatSupported(TextureFormat format)
+    {
+        switch (format) {
+        case FORMAT_BC1:
+        case FORMAT_BC3:
+            return hasExtension("GL_EXT_texture_compression_s3tc");
+        case FORMAT_BC1_SRGB:
+        case FORMAT_BC3_SRGB:
+            return hasExtension("GL_EXT_texture_compression_s3tc") && hasExtension("GL_EXT_texture_sRGB");
+        case FORMAT_BC7:
+        case FORMAT_BC7_SRGB:
+            return hasExtension("GL_ARB_texture_compression_bptc");
+        default:
+            // RGTC is core since 3.0
+            return true;
+        }
+    }
+
+    void warnUnsupported(TextureFormat format)
+    {
+        static bool warned = false;
+        if (!warned)
+            std::cerr << "Texture format " << format << " not supported by driver, decoding on the CPU" << std::endl;
+        warned = true;
+    }
+
+    Image loadTextureFile(std::string path)
+    {
+        TextureFile texture;
+        if (!readTextureFile(path, texture)) {
+            std::cout << "Failed to load image at: " << path << std::endl;
+            exit(0);
+        }
+
+        Image image;
+        image.width = texture.width;
+        image.height = texture.height;
+        image.data = 0;
+        image.levels = (int) texture.levels.size();
+        image.byteSize = 0;
+
+        glGenTextures(1, &image.handle);
+        bindTexture(GL_TEXTURE_2D, image.handle);
+
+        for (int i = 0; i < image.levels; i++)
+            image.byteSize += uploadTextureLevel(texture.format, i, texture.levels[i]);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        totalTextureMemory += image.byteSize;
+        return image;
+    }
+}
+
+bool isTextureFormatSupported(TextureFormat format)
+{
+    return !isBlockCompressed(format) || isFormatSupported(format);
+}
+
+unsigned int textureInternalFormat(TextureFormat format)
+{
+    return glInternalFormat(format);
+}
+
+size_t uploadTextureLevel(TextureFormat format, int level, const TextureLevel& data)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    size_t size;
+    if (isBlockCompressed(format) && isFormatSupported(format)) {
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, glInternalFormat(format), data.width, data.height, 0, (GLsizei) data.data.size(), data.data.data());
+        size = data.data.size();
+    }
+    else {
+        // Uncompressed files and the fallback for missing formats
+        std::vector<unsigned char> pixels;
+        if (isBlockCompressed(format)) {
+            warnUnsupported(format);
+            pixels = decompressImage(format, data.data.data(), data.width, data.height);
+        }
+        glTexImage2D(GL_TEXTURE_2D, level, isSrgb(format) ? GL_SRGB8_ALPHA8 : GL_RGBA8, data.width, data.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.empty() ? data.data.data() : pixels.data());
+        size = (size_t) data.width * data.height * 4;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return size;
+}
+
+size_t allocateTextureLevels(TextureFormat format, const std::vector<TextureLevel>& levels)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        int width = levels[i].width, height = levels[i].height;
+        if (isBlockCompressed(format) && isFormatSupported(format)) {
+            size_t levelSize = textureLevelSize(format, width, height);
+            glCompressedTexImage2D(GL_TEXTURE_2D, (GLint) i, glInternalFormat(format), width, height, 0, (GLsizei) levelSize, 0);
+            size += levelSize;
+        }
+        else {
+            glTexImage2D(GL_TEXTURE_2D, (GLint) i, isSrgb(format) ? GL_SRGB8_ALPHA8 : GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            size += (size_t) width * height * 4;
+        }
+    }
+    return size;
+}
+
+size_t updateTextureLevel(TextureFormat format, int level, const TextureLevel& data)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    size_t size;
+    if (isBlockCompressed(format) && isFormatSupported(format)) {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, data.width, data.height, glInternalFormat(format), (GLsizei) data.data.size(), data.data.data());
+        size = data.data.size();
+    }
+    else {
+        std::vector<unsigned char> pixels;
+        if (isBlockCompressed(format)) {
+            warnUnsupported(format);
+            pixels = decompressImage(format, data.data.data(), data.width, data.height);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, data.width, data.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.empty() ? data.data.data() : pixels.data());
+        size = (size_t) data.width * data.height * 4;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return size;
+}
+
+size_t uploadTextureArrayLevel(TextureFormat format, int level, int width, int height, int layers, const unsigned char* data)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    size_t layerSize = textureLevelSize(format, width, height);
+    size_t size;
+    if (isBlockCompressed(format) && isFormatSupported(format)) {
+        glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, glInternalFormat(format), width, height, layers, 0, (GLsizei) (layerSize * layers), data);
+        size = layerSize * layers;
+    }
+    else {
+        std::vector<unsigned char> pixels;
+        if (isBlockCompressed(format)) {
+            warnUnsupported(format);
+            for (int i = 0; i < layers; i++) {
+                std::vector<unsigned char> layer = decompressImage(format, data + i * layerSize, width, height);
+                pixels.insert(pixels.end(), layer.begin(), layer.end());
+            }
+        }
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, isSrgb(format) ? GL_SRGB8_ALPHA8 : GL_RGBA8, width, height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.empty() ? data : pixels.data());
+        size = (size_t) width * height * 4 * layers;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return size;
+}
 
 Image loadImage(std::string path)
 {
-    int comp;
-    int width, height;
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".ktx2") == 0)
+        return loadTextureFile(path);
 
     Image image;
-    image.data = stbi_load(path.c_str(), &image.width, &image.height, &comp, 4);
+    image.data = loadRgbaPixels(path.c_str(), &image.width, &image.height);
 
     if (!image.data) {
         std::cout << "Failed to load image at: " << path << std::endl;
@@ -21,11 +213,25 @@ Image loadImage(std::string path)
     }
 
     glGenTextures(1, &image.handle);
-    glBindTexture(GL_TEXTURE_2D, image.handle);
+    bindTexture(GL_TEXTURE_2D, image.handle);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // Unbaked images still get box filtered mips from the driver, run them
+    // through TextureBaker to get filtered, precomputed mips instead
     glGenerateMipmap(GL_TEXTURE_2D);
 
+    // Full chain is 4/3 of the base level
+    image.levels = 1;
+    for (int size = std::max(image.width, image.height); size > 1; size /= 2)
+        image.levels++;
+    image.byteSize = (size_t) image.width * image.height * 4 * 4 / 3;
+    totalTextureMemory += image.byteSize;
+
     return image;
 }
+
+size_t textureMemoryUsage()
+{
+    return totalTextureMemory;
+}
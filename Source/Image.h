@@ -1,5 +1,7 @@
 #pragma once
 
+#include "TextureFile.h"
+
 #include <string>
 
 class Image
@@ -9,6 +11,38 @@ public:
     unsigned char* data;
 
     unsigned int handle;
+
+    // Number of mip levels and the GPU memory they take up
+    int levels;
+    size_t byteSize;
 };
 
+// Loads an image and uploads it as a texture. Files ending in .ktx2 are
+// baked textures (see Tools/TextureBaker.cpp) and are uploaded with their
+// stored mip chain, any other file is decoded with stb_image.
 Image loadImage(std::string path);
+
+// Whether the driver can hold the format natively, and the GL internal
+// format to use for it. Formats that aren't supported are decoded to RGBA8.
+bool isTextureFormatSupported(TextureFormat format);
+unsigned int textureInternalFormat(TextureFormat format);
+
+// Uploads one level of a baked texture into the GL_TEXTURE_2D currently
+// bound, decoding it on the CPU if the driver lacks the compressed format.
+// Returns the GPU memory the level takes up.
+size_t uploadTextureLevel(TextureFormat format, int level, const TextureLevel& data);
+
+// Allocates every level of the bound GL_TEXTURE_2D without data, in the
+// format uploadTextureLevel() would store them in. Only the sizes of the
+// levels are used. Returns the GPU memory they take up.
+size_t allocateTextureLevels(TextureFormat format, const std::vector<TextureLevel>& levels);
+
+// Fills in one level allocated by allocateTextureLevels()
+size_t updateTextureLevel(TextureFormat format, int level, const TextureLevel& data);
+
+// Same for one level of all layers of the bound GL_TEXTURE_2D_ARRAY, data
+// holds the layers back to back
+size_t uploadTextureArrayLevel(TextureFormat format, int level, int width, int height, int layers, const unsigned char* data);
+
+// Total GPU memory of all textures uploaded through loadImage
+size_t textureMemoryUsage();
@@ -0,0 +1,197 @@
+#include "InstanceSet.h"
+#include "GLState.h"
+
+#include <algorithm>
+#include <cstring>
+
+const size_t InstanceSet::MERGE_GAP;
+
+InstanceSet::InstanceSet() :
+    _vao(0),
+    _buffer(0),
+    _capacity(0),
+    _indexCount(0),
+    _reallocate(false)
+{
+    memset(&_uploadStats, 0, sizeof(_uploadStats));
+}
+
+void InstanceSet::create(const Model& model, size_t capacity)
+{
+    _capacity = std::max((size_t) 1, capacity);
+    _indexCount = (GLsizei) model.indices.size();
+
+    glGenVertexArrays(1, &_vao);
+    bindVertexArray(_vao);
+
+    // Same layout as the model's own vertex array
+    glBindBuffer(GL_ARRAY_BUFFER, model.vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, model.nbo);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(1);
+    if (model.tbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, model.tbo);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(2);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.ebo);
+
+    glGenBuffers(1, &_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+    glBufferData(GL_ARRAY_BUFFER, _capacity * sizeof(InstanceData), 0, GL_DYNAMIC_DRAW);
+
+    for (GLuint column = 0; column < 4; column++) {
+        GLuint attribute = INSTANCE_MATRIX_ATTRIBUTE + column;
+        glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*) (column * 4 * sizeof(float)));
+        glVertexAttribDivisor(attribute, 1);
+        glEnableVertexAttribArray(attribute);
+    }
+    // Integer attribute, so it isn't converted to float on the way
+    glVertexAttribIPointer(INSTANCE_MATERIAL_ATTRIBUTE, 1, GL_INT, sizeof(InstanceData), (void*) sizeof(Matrix4f));
+    glVertexAttribDivisor(INSTANCE_MATERIAL_ATTRIBUTE, 1);
+    glEnableVertexAttribArray(INSTANCE_MATERIAL_ATTRIBUTE);
+
+    bindVertexArray(0);
+}
+
+void InstanceSet::destroy()
+{
+    deleteVertexArrays(1, &_vao);
+    glDeleteBuffers(1, &_buffer);
+    _vao = _buffer = 0;
+    clear();
+}
+
+InstanceId InstanceSet::add(const Matrix4f& modelMatrix, int materialIndex)
+{
+    InstanceId id;
+    if (!_freeIds.empty()) {
+        id = _freeIds.back();
+        _freeIds.pop_back();
+    }
+    else {
+        id = (InstanceId) _slots.size();
+        _slots.push_back(0);
+    }
+
+    InstanceData instance;
+    instance.modelMatrix = modelMatrix;
+    instance.materialIndex = materialIndex;
+
+    _slots[id] = (unsigned int) _instances.size();
+    _instances.push_back(instance);
+    _ids.push_back(id);
+    _dirty.push_back(false);
+
+    // Grow geometrically so adding many instances stays linear
+    if (_instances.size() > _capacity) {
+        while (_capacity < _instances.size())
+            _capacity *= 2;
+        _reallocate = true;
+    }
+    markDirty(_instances.size() - 1);
+    return id;
+}
+
+void InstanceSet::update(InstanceId id, const Matrix4f& modelMatrix)
+{
+    _instances[_slots[id]].modelMatrix = modelMatrix;
+    markDirty(_slots[id]);
+}
+
+void InstanceSet::setMaterial(InstanceId id, int materialIndex)
+{
+    _instances[_slots[id]].materialIndex = materialIndex;
+    markDirty(_slots[id]);
+}
+
+void InstanceSet::remove(InstanceId id)
+{
+    unsigned int slot = _slots[id];
+    unsigned int last = (unsigned int) _instances.size() - 1;
+
+    // Fill the hole with the last instance to keep the buffer packed
+    if (slot != last) {
+        _instances[slot] = _instances[last];
+        _ids[slot] = _ids[last];
+        _slots[_ids[slot]] = slot;
+        markDirty(slot);
+    }
+    _instances.pop_back();
+    _ids.pop_back();
+    _freeIds.push_back(id);
+
+    // The slot may still be listed, upload() skips slots past the end
+    _dirty.pop_back();
+}
+
+void InstanceSet::clear()
+{
+    _instances.clear();
+    _slots.clear();
+    _ids.clear();
+    _freeIds.clear();
+    _dirtySlots.clear();
+    _dirty.clear();
+}
+
+void InstanceSet::markDirty(size_t slot)
+{
+    if (!_dirty[slot]) {
+        _dirty[slot] = true;
+        _dirtySlots.push_back((unsigned int) slot);
+    }
+}
+
+void InstanceSet::upload()
+{
+    if (!_reallocate && _dirtySlots.empty())
+        return;
+
+    memset(&_uploadStats, 0, sizeof(_uploadStats));
+    glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+    if (_reallocate) {
+        // New storage, everything goes up
+        glBufferData(GL_ARRAY_BUFFER, _capacity * sizeof(InstanceData), 0, GL_DYNAMIC_DRAW);
+        _dirtySlots.clear();
+        for (size_t i = 0; i < _instances.size(); i++)
+            _dirtySlots.push_back((unsigned int) i);
+        _reallocate = false;
+    }
+
+    // Slots removed since they were marked can be listed again when the
+    // slot was refilled, sorting brings the copies together
+    std::sort(_dirtySlots.begin(), _dirtySlots.end());
+    _dirtySlots.erase(std::unique(_dirtySlots.begin(), _dirtySlots.end()), _dirtySlots.end());
+    while (!_dirtySlots.empty() && _dirtySlots.back() >= _instances.size())
+        _dirtySlots.pop_back();
+
+    size_t i = 0;
+    while (i < _dirtySlots.size()) {
+        size_t begin = _dirtySlots[i];
+        size_t end = begin + 1;
+        for (i++; i < _dirtySlots.size() && _dirtySlots[i] <= end + MERGE_GAP; i++)
+            end = _dirtySlots[i] + 1;
+
+        glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(InstanceData), (end - begin) * sizeof(InstanceData), &_instances[begin]);
+        _uploadStats.ranges++;
+        _uploadStats.instances += (int) (end - begin);
+        _uploadStats.bytes += (end - begin) * sizeof(InstanceData);
+    }
+
+    for (size_t j = 0; j < _dirtySlots.size(); j++)
+        _dirty[_dirtySlots[j]] = false;
+    _dirtySlots.clear();
+}
+
+void InstanceSet::draw()
+{
+    upload();
+    if (_instances.empty())
+        return;
+
+    bindVertexArray(_vao);
+    glDrawElementsInstanced(GL_TRIANGLES, _indexCount, GL_UNSIGNED_INT, 0, (GLsizei) _instances.size());
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Model.h"
+#include "VertexLayout.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+
+#include <vector>
+
+// Per-instance vertex attributes, read with a divisor of 1, in the
+// INSTANCE_MATRIX_ATTRIBUTE and INSTANCE_MATERIAL_ATTRIBUTE slots
+class InstanceData
+{
+public:
+    Matrix4f modelMatrix;
+    int materialIndex;
+};
+
+typedef unsigned int InstanceId;
+
+// What the last upload sent
+class InstanceUploadStats
+{
+public:
+    int ranges;
+    int instances;
+    size_t bytes;
+};
+
+// Many copies of one model drawn with a single glDrawElementsInstanced.
+// Instances are kept packed so the whole buffer can be drawn as is:
+// removing one moves the last instance into its place, and ids stay valid
+// through an indirection table. Changes are collected on the CPU and
+// uploaded on the next draw, as one glBufferSubData per run of changed
+// instances, so the upload grows with the number of instances that
+// changed rather than with the size of the set.
+class InstanceSet
+{
+public:
+    InstanceSet();
+
+    // Builds a vertex array that reads the model's vertex buffers and the
+    // instance buffer. The model must outlive the set.
+    void create(const Model& model, size_t capacity = 1024);
+    void destroy();
+
+    InstanceId add(const Matrix4f& modelMatrix, int materialIndex);
+    void update(InstanceId id, const Matrix4f& modelMatrix);
+    void setMaterial(InstanceId id, int materialIndex);
+    void remove(InstanceId id);
+    void clear();
+
+    size_t size() const { return _instances.size(); }
+
+    // Uploads pending changes and draws every instance. Needs a program
+    // that reads the instance attributes, like the INSTANCED variant of
+    // blinnphong.vert.
+    void draw();
+
+    const InstanceUploadStats& uploadStats() const { return _uploadStats; }
+
+    // Changed runs closer than this many instances go up as one, the
+    // unchanged instances between them are cheaper than another call
+    static const size_t MERGE_GAP = 4;
+
+private:
+    void markDirty(size_t slot);
+    void upload();
+
+    GLuint _vao;
+    GLuint _buffer;
+    size_t _capacity;
+    GLsizei _indexCount;
+
+    std::vector<InstanceData> _instances;
+
+    // id -> slot in _instances and back, and ids free for reuse
+    std::vector<unsigned int> _slots;
+    std::vector<InstanceId> _ids;
+    std::vector<InstanceId> _freeIds;
+
+    // Changed slots, each listed once while its flag is set
+    std::vector<unsigned int> _dirtySlots;
+    std::vector<bool> _dirty;
+    bool _reallocate;
+
+    InstanceUploadStats _uploadStats;
+};
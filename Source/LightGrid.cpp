@@ -0,0 +1,263 @@
+#include "LightGrid.h"
+#include "WorkerPool.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Box components of the tiles of one slice
+    class SliceBoxes
+    {
+    public:
+        const float* minX;
+        const float* minY;
+        const float* minZ;
+        const float* maxX;
+        const float* maxY;
+        const float* maxZ;
+    };
+
+    // Sets bit i % 8 of masks[i / 8] for every box within the sphere. All
+    // versions take the squared distance from the sphere's center to the
+    // box with the same operations in the same order, so they agree on
+    // spheres that just touch a cluster.
+
+    void overlapScalar(const SliceBoxes& b, int count, const float* sphere, uint8_t* masks)
+    {
+        float x = sphere[0], y = sphere[1], z = sphere[2];
+        float radiusSquared = sphere[3] * sphere[3];
+        for (int g = 0; g < count / 8; g++) {
+            int mask = 0;
+            for (int lane = 0; lane < 8; lane++) {
+                int i = g * 8 + lane;
+                float dx = std::max(std::max(b.minX[i] - x, x - b.maxX[i]), 0.0f);
+                float dy = std::max(std::max(b.minY[i] - y, y - b.maxY[i]), 0.0f);
+                float dz = std::max(std::max(b.minZ[i] - z, z - b.maxZ[i]), 0.0f);
+                float distance = dx * dx + dy * dy + dz * dz;
+                if (distance <= radiusSquared)
+                    mask |= 1 << lane;
+            }
+            masks[g] = (uint8_t) mask;
+        }
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET_SSE41 void overlapSse(const SliceBoxes& b, int count, const float* sphere, uint8_t* masks)
+    {
+        __m128 x = _mm_set1_ps(sphere[0]);
+        __m128 y = _mm_set1_ps(sphere[1]);
+        __m128 z = _mm_set1_ps(sphere[2]);
+        __m128 radiusSquared = _mm_set1_ps(sphere[3] * sphere[3]);
+        __m128 zero = _mm_setzero_ps();
+
+        for (int g = 0; g < count / 8; g++) {
+            int mask = 0;
+            for (int half = 0; half < 2; half++) {
+                int i = g * 8 + half * 4;
+                __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(b.minX + i), x), _mm_sub_ps(x, _mm_loadu_ps(b.maxX + i))), zero);
+                __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(b.minY + i), y), _mm_sub_ps(y, _mm_loadu_ps(b.maxY + i))), zero);
+                __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(b.minZ + i), z), _mm_sub_ps(z, _mm_loadu_ps(b.maxZ + i))), zero);
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                mask |= _mm_movemask_ps(_mm_cmple_ps(distance, radiusSquared)) << (half * 4);
+            }
+            masks[g] = (uint8_t) mask;
+        }
+    }
+
+    SIMD_TARGET_AVX2 void overlapAvx2(const SliceBoxes& b, int count, const float* sphere, uint8_t* masks)
+    {
+        __m256 x = _mm256_set1_ps(sphere[0]);
+        __m256 y = _mm256_set1_ps(sphere[1]);
+        __m256 z = _mm256_set1_ps(sphere[2]);
+        __m256 radiusSquared = _mm256_set1_ps(sphere[3] * sphere[3]);
+        __m256 zero = _mm256_setzero_ps();
+
+        for (int g = 0; g < count / 8; g++) {
+            int i = g * 8;
+            __m256 dx = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(b.minX + i), x), _mm256_sub_ps(x, _mm256_loadu_ps(b.maxX + i))), zero);
+            __m256 dy = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(b.minY + i), y), _mm256_sub_ps(y, _mm256_loadu_ps(b.maxY + i))), zero);
+            __m256 dz = _mm256_max_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(b.minZ + i), z), _mm256_sub_ps(z, _mm256_loadu_ps(b.maxZ + i))), zero);
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+            masks[g] = (uint8_t) _mm256_movemask_ps(_mm256_cmp_ps(distance, radiusSquared, _CMP_LE_OQ));
+        }
+    }
+#endif
+
+    void overlap(const SliceBoxes& boxes, int count, const float* sphere, uint8_t* masks)
+    {
+#ifdef SIMD_X86
+        if (simdLevel() >= SIMD_AVX2)
+            return overlapAvx2(boxes, count, sphere, masks);
+        if (simdLevel() >= SIMD_SSE41)
+            return overlapSse(boxes, count, sphere, masks);
+#endif
+        overlapScalar(boxes, count, sphere, masks);
+    }
+
+    // View space point of a normalized device coordinate
+    void unproject(const float* m, float x, float y, float z, float* out)
+    {
+        float w = m[3] * x + m[7] * y + m[11] * z + m[15];
+        for (int c = 0; c < 3; c++)
+            out[c] = (m[c] * x + m[c + 4] * y + m[c + 8] * z + m[c + 12]) / w;
+    }
+
+    // Point at view depth along the line through a near and a far point
+    void atDepth(const float* nearPoint, const float* farPoint, float depth, float* out)
+    {
+        float t = (depth + nearPoint[2]) / (nearPoint[2] - farPoint[2]);
+        for (int c = 0; c < 3; c++)
+            out[c] = nearPoint[c] + (farPoint[c] - nearPoint[c]) * t;
+    }
+}
+
+LightGrid::LightGrid(int tilesX, int tilesY, int slices) :
+    _tilesX(tilesX),
+    _tilesY(tilesY),
+    _slices(slices),
+    _tileStride((tilesX * tilesY + 7) & ~7),
+    _zNear(0),
+    _zFar(0),
+    _sliceScale(0),
+    _sliceBias(0)
+{
+    memset(_inverseProjection, 0, sizeof(_inverseProjection));
+    memset(&_stats, 0, sizeof(_stats));
+
+    size_t boxes = (size_t) _tileStride * slices;
+    std::vector<float>* arrays[] = { &_minX, &_minY, &_minZ, &_maxX, &_maxY, &_maxZ };
+    for (int i = 0; i < 6; i++)
+        arrays[i]->assign(boxes, 0.0f);
+
+    _sliceDepths.assign(slices + 1, 0.0f);
+    _clusterLights.resize((size_t) clusterCount() * MAX_LIGHTS_PER_CLUSTER);
+    _clusterCounts.assign(clusterCount(), 0);
+    _sliceDropped.assign(slices, 0);
+    _grid.assign(clusterCount() * 2, 0);
+}
+
+void LightGrid::setProjection(const float* inverseProjection, float zNear, float zFar)
+{
+    if (memcmp(inverseProjection, _inverseProjection, sizeof(_inverseProjection)) == 0 && zNear == _zNear && zFar == _zFar)
+        return;
+    memcpy(_inverseProjection, inverseProjection, sizeof(_inverseProjection));
+    _zNear = zNear;
+    _zFar = zFar;
+
+    // Slicing needs a positive near plane, the camera's may not have one
+    zNear = std::max(zNear, 0.01f);
+    zFar = std::max(zFar, zNear * 1.01f);
+    _sliceScale = _slices / std::log(zFar / zNear);
+    _sliceBias = -std::log(zNear) * _sliceScale;
+    for (int k = 0; k <= _slices; k++)
+        _sliceDepths[k] = zNear * std::pow(zFar / zNear, (float) k / _slices);
+
+    // Tile corners on the near and far planes
+    int cornersX = _tilesX + 1, cornersY = _tilesY + 1;
+    std::vector<float> nearCorners(cornersX * cornersY * 3), farCorners(cornersX * cornersY * 3);
+    for (int j = 0; j < cornersY; j++) {
+        for (int i = 0; i < cornersX; i++) {
+            float x = -1 + 2.0f * i / _tilesX;
+            float y = -1 + 2.0f * j / _tilesY;
+            unproject(inverseProjection, x, y, -1, &nearCorners[(j * cornersX + i) * 3]);
+            unproject(inverseProjection, x, y, 1, &farCorners[(j * cornersX + i) * 3]);
+        }
+    }
+
+    for (int s = 0; s < _slices; s++) {
+        for (int ty = 0; ty < _tilesY; ty++) {
+            for (int tx = 0; tx < _tilesX; tx++) {
+                size_t box = (size_t) s * _tileStride + ty * _tilesX + tx;
+                float min[3] = { 1e30f, 1e30f, 1e30f }, max[3] = { -1e30f, -1e30f, -1e30f };
+                for (int corner = 0; corner < 8; corner++) {
+                    int c = (ty + (corner >> 1 & 1)) * cornersX + tx + (corner & 1);
+                    float point[3];
+                    atDepth(&nearCorners[c * 3], &farCorners[c * 3], _sliceDepths[s + (corner >> 2)], point);
+                    for (int k = 0; k < 3; k++) {
+                        min[k] = std::min(min[k], point[k]);
+                        max[k] = std::max(max[k], point[k]);
+                    }
+                }
+                _minX[box] = min[0]; _minY[box] = min[1]; _minZ[box] = min[2];
+                _maxX[box] = max[0]; _maxY[box] = max[1]; _maxZ[box] = max[2];
+            }
+        }
+    }
+}
+
+void LightGrid::assign(const float* spheres, size_t count, WorkerPool* pool)
+{
+    // Indices have to fit the 16 bit lists
+    count = std::min(count, (size_t) 65535);
+
+    if (pool)
+        pool->parallelFor(_slices, 1, [&](size_t begin, size_t end) {
+            for (size_t slice = begin; slice < end; slice++)
+                assignSlice((int) slice, spheres, count);
+        });
+    else {
+        for (int slice = 0; slice < _slices; slice++)
+            assignSlice(slice, spheres, count);
+    }
+
+    // Closes up the fixed size lists in cluster order
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.lights = (int) count;
+    _indices.clear();
+    for (int c = 0; c < clusterCount(); c++) {
+        int lights = _clusterCounts[c];
+        const uint16_t* list = &_clusterLights[(size_t) c * MAX_LIGHTS_PER_CLUSTER];
+        _grid[c * 2] = (uint32_t) _indices.size();
+        _grid[c * 2 + 1] = (uint32_t) lights;
+        _indices.insert(_indices.end(), list, list + lights);
+        _stats.maxPerCluster = std::max(_stats.maxPerCluster, lights);
+    }
+    _stats.assignments = (int) _indices.size();
+    for (int s = 0; s < _slices; s++)
+        _stats.dropped += _sliceDropped[s];
+}
+
+void LightGrid::assignSlice(int slice, const float* spheres, size_t count)
+{
+    int tiles = _tilesX * _tilesY;
+    uint16_t* counts = &_clusterCounts[(size_t) slice * tiles];
+    uint16_t* lists = &_clusterLights[(size_t) slice * tiles * MAX_LIGHTS_PER_CLUSTER];
+    memset(counts, 0, tiles * sizeof(uint16_t));
+
+    size_t first = (size_t) slice * _tileStride;
+    SliceBoxes boxes = { &_minX[first], &_minY[first], &_minZ[first], &_maxX[first], &_maxY[first], &_maxZ[first] };
+    std::vector<uint8_t> masks(_tileStride / 8);
+
+    float sliceNear = _sliceDepths[slice];
+    float sliceFar = _sliceDepths[slice + 1];
+    int dropped = 0;
+    for (size_t light = 0; light < count; light++) {
+        const float* sphere = spheres + light * 4;
+        float depth = -sphere[2];
+        if (depth + sphere[3] < sliceNear || depth - sphere[3] > sliceFar)
+            continue;
+
+        overlap(boxes, _tileStride, sphere, masks.data());
+        for (int g = 0; g < _tileStride / 8; g++) {
+            if (!masks[g])
+                continue;
+            for (int lane = 0; lane < 8; lane++) {
+                int tile = g * 8 + lane;
+                if (!(masks[g] & (1 << lane)) || tile >= tiles)
+                    continue;
+                if (counts[tile] < MAX_LIGHTS_PER_CLUSTER)
+                    lists[tile * MAX_LIGHTS_PER_CLUSTER + counts[tile]++] = (uint16_t) light;
+                else
+                    dropped++;
+            }
+        }
+    }
+    _sliceDropped[slice] = dropped;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+class LightGridStats
+{
+public:
+    int lights;
+    int assignments;
+    int maxPerCluster;
+    int dropped;
+};
+
+// Splits the view frustum into tiles across the screen and slices in depth
+// and finds the point lights that reach each of those clusters, so a
+// fragment only has to light itself with the lights of its own cluster.
+//
+// Slices get exponentially deeper away from the camera, which keeps
+// clusters roughly cube shaped: slice k starts at zNear * (zFar / zNear) ^
+// (k / slices). A fragment at view depth d is in slice
+// log(d) * sliceScale() + sliceBias().
+//
+// The lights of cluster c are indices()[grid()[2c] .. + grid()[2c + 1]].
+// Clusters are numbered x first, then y, then slice. Nothing here touches
+// GL, see ClusteredLights for the upload.
+class LightGrid
+{
+public:
+    LightGrid(int tilesX = 16, int tilesY = 16, int slices = 24);
+
+    // Builds the view space cluster boxes from the inverse of the
+    // projection matrix, column major. Does nothing if neither changed.
+    void setProjection(const float* inverseProjection, float zNear, float zFar);
+
+    // Assigns view space spheres, x, y, z and radius each, to the clusters
+    // they touch. Slices are assigned in parallel on the pool.
+    void assign(const float* spheres, size_t count, WorkerPool* pool = 0);
+
+    int tilesX() const { return _tilesX; }
+    int tilesY() const { return _tilesY; }
+    int slices() const { return _slices; }
+    int clusterCount() const { return _tilesX * _tilesY * _slices; }
+    float sliceScale() const { return _sliceScale; }
+    float sliceBias() const { return _sliceBias; }
+
+    const std::vector<uint32_t>& grid() const { return _grid; }
+    const std::vector<uint16_t>& indices() const { return _indices; }
+    const LightGridStats& stats() const { return _stats; }
+
+    // Lights past this in one cluster are dropped
+    static const int MAX_LIGHTS_PER_CLUSTER = 128;
+
+private:
+    void assignSlice(int slice, const float* spheres, size_t count);
+
+    int _tilesX, _tilesY, _slices;
+
+    // Tiles of one slice, padded to a multiple of 8 so the kernels test
+    // whole groups of lanes
+    int _tileStride;
+
+    float _inverseProjection[16];
+    float _zNear, _zFar;
+    float _sliceScale, _sliceBias;
+    std::vector<float> _sliceDepths;
+
+    // View space cluster boxes per component, _tileStride per slice
+    std::vector<float> _minX, _minY, _minZ;
+    std::vector<float> _maxX, _maxY, _maxZ;
+
+    // Lights per cluster while assigning, each slice writes only its own
+    std::vector<uint16_t> _clusterLights;
+    std::vector<uint16_t> _clusterCounts;
+    std::vector<int> _sliceDropped;
+
+    std::vector<uint32_t> _grid;
+    std::vector<uint16_t> _indices;
+    LightGridStats _stats;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+#include <GDT/Vector3f.h>
+#include <GDT/Vector4f.h>
+
+// Where a texture ended up after packing: a layer of a 2D array texture,
+// and for atlased textures the part of that layer it covers
+class TextureRef
+{
+public:
+    TextureRef() : array(0), layer(0), uvTransform(1, 1, 0, 0) { }
+
+    GLuint array;
+    int layer;
+
+    // Texture coordinates are mapped to uv * xy + zw
+    Vector4f uvTransform;
+};
+
+class Material
+{
+public:
+    Material() : ks(1), index(-1) { }
+
+    Vector3f ka;
+    Vector3f kd;
+    float ks;
+
+    // Diffuse texture, array is 0 for untextured materials. Materials that
+    // share an array can be drawn together, selecting their layer per draw.
+    TextureRef colorMap;
+
+    // Slot in the MaterialTable, -1 until the material is added to it
+    int index;
+};
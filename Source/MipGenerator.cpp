@@ -0,0 +1,347 @@
+#include "MipGenerator.h"
+#include "PixelConversion.h"
+#include "WorkerPool.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const float PI = 3.14159265359f;
+
+    // Half-width of each filter, in destination pixels
+    float filterSupport(MipFilter filter)
+    {
+        return filter == MIP_BOX ? 0.5f : 3.0f;
+    }
+
+    float sinc(float x)
+    {
+        if (std::fabs(x) < 1e-5f)
+            return 1.0f;
+        return std::sin(PI * x) / (PI * x);
+    }
+
+    // Zeroth order modified Bessel function of the first kind
+    float besselI0(float x)
+    {
+        float sum = 1.0f, term = 1.0f;
+        for (int k = 1; k < 20; k++) {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    float filterWeight(MipFilter filter, float x)
+    {
+        float support = filterSupport(filter);
+        if (std::fabs(x) >= support)
+            return filter == MIP_BOX && std::fabs(x) == support ? 0.5f : 0.0f;
+
+        switch (filter) {
+        case MIP_BOX:
+            return 1.0f;
+        case MIP_LANCZOS:
+            return sinc(x) * sinc(x / support);
+        case MIP_KAISER: {
+            const float beta = 4.0f;
+            float r = x / support;
+            return sinc(x) * besselI0(beta * std::sqrt(1 - r * r)) / besselI0(beta);
+        }
+        }
+        return 0.0f;
+    }
+
+    // Per destination pixel list of source indices and normalized weights.
+    // Every pixel gets the same number of taps, unused taps weigh zero.
+    class Kernel
+    {
+    public:
+        int taps;
+        std::vector<int> indices;
+        std::vector<float> weights;
+
+        Kernel(MipFilter filter, int srcSize, int dstSize)
+        {
+            float scale = (float) srcSize / dstSize;
+            float support = filterSupport(filter) * scale;
+            taps = (int) std::ceil(support * 2) + 1;
+            indices.resize((size_t) dstSize * taps);
+            weights.resize((size_t) dstSize * taps);
+
+            for (int x = 0; x < dstSize; x++) {
+                float center = (x + 0.5f) * scale;
+                int first = (int) std::floor(center - support);
+                float sum = 0;
+                for (int t = 0; t < taps; t++) {
+                    int i = first + t;
+                    float w = filterWeight(filter, (i + 0.5f - center) / scale);
+                    indices[x * taps + t] = std::min(std::max(i, 0), srcSize - 1);
+                    weights[x * taps + t] = w;
+                    sum += w;
+                }
+                for (int t = 0; t < taps; t++)
+                    weights[x * taps + t] /= sum;
+            }
+        }
+    };
+
+    class FloatImage
+    {
+    public:
+        int width, height;
+        std::vector<float> pixels;
+
+        FloatImage(int width, int height) : width(width), height(height), pixels((size_t) width * height * 4) { }
+
+        float* row(int y) { return pixels.data() + (size_t) y * width * 4; }
+        const float* row(int y) const { return pixels.data() + (size_t) y * width * 4; }
+    };
+
+    // Rows per parallelFor chunk, small levels are filtered on the caller
+    const int ROW_GRAIN = 16;
+
+    // Runs fn(begin, end) over row ranges, on the pool when there is one
+    void forRows(WorkerPool* pool, int rows, const std::function<void(size_t, size_t)>& fn)
+    {
+        if (!pool || pool->threadCount() == 1 || rows <= ROW_GRAIN)
+            fn(0, rows);
+        else
+            pool->parallelFor(rows, ROW_GRAIN, fn);
+    }
+
+    // The kernels below all add up the taps in the same order without FMA,
+    // so every SIMD level gives the same result as the scalar loops.
+
+    // One destination pixel of the horizontal pass
+    void filterPixel(const float* in, float* out, const Kernel& kernel, int x)
+    {
+        const int* indices = &kernel.indices[x * kernel.taps];
+        const float* weights = &kernel.weights[x * kernel.taps];
+        float acc[4] = { 0, 0, 0, 0 };
+        for (int t = 0; t < kernel.taps; t++) {
+            for (int c = 0; c < 4; c++)
+                acc[c] += weights[t] * in[indices[t] * 4 + c];
+        }
+        for (int c = 0; c < 4; c++)
+            out[x * 4 + c] = acc[c];
+    }
+
+#ifdef SIMD_X86
+    // Two neighbouring destination pixels per iteration, one vector each
+    SIMD_TARGET_SSE41 int filterRowSse(const float* in, float* out, const Kernel& kernel, int width)
+    {
+        const int taps = kernel.taps;
+
+        int x = 0;
+        for (; x + 2 <= width; x += 2) {
+            const int* indices = &kernel.indices[x * taps];
+            const float* weights = &kernel.weights[x * taps];
+            __m128 acc0 = _mm_setzero_ps();
+            __m128 acc1 = _mm_setzero_ps();
+            for (int t = 0; t < taps; t++) {
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(in + indices[t] * 4)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_set1_ps(weights[taps + t]), _mm_loadu_ps(in + indices[taps + t] * 4)));
+            }
+            _mm_storeu_ps(out + x * 4, acc0);
+            _mm_storeu_ps(out + x * 4 + 4, acc1);
+        }
+        return x;
+    }
+
+    // Four neighbouring destination pixels per iteration, two per vector
+    SIMD_TARGET_AVX2 int filterRowAvx2(const float* in, float* out, const Kernel& kernel, int width)
+    {
+        const int taps = kernel.taps;
+
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            const int* indices = &kernel.indices[x * taps];
+            const float* weights = &kernel.weights[x * taps];
+            __m256 acc[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+            for (int t = 0; t < taps; t++) {
+                for (int h = 0; h < 2; h++) {
+                    const int lo = h * 2 * taps + t, hi = lo + taps;
+                    __m256 w = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(weights[lo])), _mm_set1_ps(weights[hi]), 1);
+                    __m256 s = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(in + indices[lo] * 4)), _mm_loadu_ps(in + indices[hi] * 4), 1);
+                    acc[h] = _mm256_add_ps(acc[h], _mm256_mul_ps(w, s));
+                }
+            }
+            _mm256_storeu_ps(out + x * 4, acc[0]);
+            _mm256_storeu_ps(out + x * 4 + 8, acc[1]);
+        }
+        return x;
+    }
+
+    // out = sum of weights[t] * rows[t], over count floats
+    SIMD_TARGET_SSE41 size_t blendRowsSse(const float* const* rows, const float* weights, int taps, float* out, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128 acc0 = _mm_setzero_ps();
+            __m128 acc1 = _mm_setzero_ps();
+            for (int t = 0; t < taps; t++) {
+                __m128 w = _mm_set1_ps(weights[t]);
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(w, _mm_loadu_ps(rows[t] + i)));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(w, _mm_loadu_ps(rows[t] + i + 4)));
+            }
+            _mm_storeu_ps(out + i, acc0);
+            _mm_storeu_ps(out + i + 4, acc1);
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t blendRowsAvx2(const float* const* rows, const float* weights, int taps, float* out, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            for (int t = 0; t < taps; t++) {
+                __m256 w = _mm256_set1_ps(weights[t]);
+                acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(w, _mm256_loadu_ps(rows[t] + i)));
+                acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(w, _mm256_loadu_ps(rows[t] + i + 8)));
+            }
+            _mm256_storeu_ps(out + i, acc0);
+            _mm256_storeu_ps(out + i + 8, acc1);
+        }
+        return i;
+    }
+#endif
+
+    void filterRow(const float* in, float* out, const Kernel& kernel, int width)
+    {
+        int x = 0;
+#ifdef SIMD_X86
+        if (simdLevel() >= SIMD_AVX2)
+            x = filterRowAvx2(in, out, kernel, width);
+        else if (simdLevel() >= SIMD_SSE41)
+            x = filterRowSse(in, out, kernel, width);
+#endif
+        for (; x < width; x++)
+            filterPixel(in, out, kernel, x);
+    }
+
+    void blendRows(const float* const* rows, const float* weights, int taps, float* out, size_t count)
+    {
+        size_t i = 0;
+#ifdef SIMD_X86
+        if (simdLevel() >= SIMD_AVX2)
+            i = blendRowsAvx2(rows, weights, taps, out, count);
+        else if (simdLevel() >= SIMD_SSE41)
+            i = blendRowsSse(rows, weights, taps, out, count);
+#endif
+        for (; i < count; i++) {
+            float acc = 0;
+            for (int t = 0; t < taps; t++)
+                acc += weights[t] * rows[t][i];
+            out[i] = acc;
+        }
+    }
+
+    FloatImage downsample(const FloatImage& src, MipFilter filter, WorkerPool* pool)
+    {
+        int dstWidth = std::max(1, src.width / 2);
+        int dstHeight = std::max(1, src.height / 2);
+        Kernel horizontal(filter, src.width, dstWidth);
+        Kernel vertical(filter, src.height, dstHeight);
+
+        FloatImage tmp(dstWidth, src.height);
+        forRows(pool, src.height, [&](size_t begin, size_t end) {
+            for (size_t y = begin; y < end; y++)
+                filterRow(src.row((int) y), tmp.row((int) y), horizontal, dstWidth);
+        });
+
+        // Vertical pass walks whole rows per tap, which keeps loads contiguous
+        FloatImage dst(dstWidth, dstHeight);
+        forRows(pool, dstHeight, [&](size_t begin, size_t end) {
+            std::vector<const float*> rows(vertical.taps);
+            std::vector<float> weights(vertical.taps);
+            for (size_t y = begin; y < end; y++) {
+                int taps = 0;
+                for (int t = 0; t < vertical.taps; t++) {
+                    float w = vertical.weights[y * vertical.taps + t];
+                    if (w == 0.0f)
+                        continue;
+                    rows[taps] = tmp.row(vertical.indices[y * vertical.taps + t]);
+                    weights[taps++] = w;
+                }
+                blendRows(rows.data(), weights.data(), taps, dst.row((int) y), (size_t) dstWidth * 4);
+            }
+        });
+
+        return dst;
+    }
+
+    float srgbToLinear(float c)
+    {
+        return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    // Linear value halfway between each pair of neighbouring sRGB codes, so
+    // encoding is a binary search that rounds exactly in sRGB space
+    class SrgbEncoder
+    {
+    public:
+        SrgbEncoder()
+        {
+            for (int i = 0; i < 255; i++)
+                thresholds[i] = srgbToLinear((i + 0.5f) / 255.0f);
+        }
+
+        unsigned char encode(float v) const
+        {
+            return (unsigned char) (std::upper_bound(thresholds, thresholds + 255, v) - thresholds);
+        }
+
+    private:
+        float thresholds[255];
+    };
+
+    TextureLevel toLevel(const FloatImage& image, bool srgb, WorkerPool* pool)
+    {
+        static const SrgbEncoder encoder;
+
+        TextureLevel level;
+        level.width = image.width;
+        level.height = image.height;
+        level.data.resize(image.pixels.size());
+
+        // The sRGB search costs more than filtering, so it's split up too
+        size_t rowSize = (size_t) image.width * 4;
+        forRows(pool, image.height, [&](size_t begin, size_t end) {
+            for (size_t i = begin * rowSize; i < end * rowSize; i++) {
+                float v = std::min(1.0f, std::max(0.0f, image.pixels[i]));
+                level.data[i] = srgb && i % 4 != 3 ? encoder.encode(v) : (unsigned char) (v * 255 + 0.5f);
+            }
+        });
+        return level;
+    }
+}
+
+std::vector<TextureLevel> generateMipChain(const unsigned char* rgba, int width, int height, bool srgb, MipFilter filter, WorkerPool* pool)
+{
+    FloatImage image(width, height);
+    convertToFloat(rgba, image.pixels.data(), (size_t) width * height, srgb);
+
+    std::vector<TextureLevel> chain(1);
+    chain[0].width = width;
+    chain[0].height = height;
+    chain[0].data.assign(rgba, rgba + (size_t) width * height * 4);
+
+    // Each level is filtered from the float result of the previous one, so
+    // quantization error doesn't accumulate down the chain
+    while (image.width > 1 || image.height > 1) {
+        image = downsample(image, filter, pool);
+        chain.push_back(toLevel(image, srgb, pool));
+    }
+
+    return chain;
+}
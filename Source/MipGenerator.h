@@ -0,0 +1,22 @@
+#pragma once
+
+#include "TextureFile.h"
+
+#include <vector>
+
+class WorkerPool;
+
+enum MipFilter
+{
+    MIP_BOX,
+    MIP_LANCZOS,
+    MIP_KAISER
+};
+
+// Builds the full mip chain of an RGBA8 image down to 1x1, level 0 being a
+// copy of the input. Filtering happens in linear light when srgb is set,
+// so the colour channels are decoded before and encoded after each level.
+// With a pool the rows of each pass are split over its threads. Neighbouring
+// destination pixels are filtered together with SSE4.1 or AVX2 kernels
+// picked at run time, all of which give the same result.
+std::vector<TextureLevel> generateMipChain(const unsigned char* rgba, int width, int height, bool srgb, MipFilter filter = MIP_KAISER, WorkerPool* pool = 0);
@@ -1,9 +1,41 @@
 #include "Model.h"
+#include "GLState.h"
+#include "DeletionQueue.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <unordered_map>
+
+namespace
+{
+    // Identifies an OBJ corner by the attributes it references
+    class VertexKey
+    {
+    public:
+        int vertex, normal, texCoord;
+
+        bool operator==(const VertexKey& other) const
+        {
+            return vertex == other.vertex && normal == other.normal && texCoord == other.texCoord;
+        }
+    };
+
+    class VertexKeyHash
+    {
+    public:
+        size_t operator()(const VertexKey& key) const
+        {
+            size_t hash = (size_t) key.vertex * 73856093u;
+            hash ^= (size_t) key.normal * 19349663u;
+            hash ^= (size_t) key.texCoord * 83492791u;
+            return hash;
+        }
+    };
+}
 
 Model loadModel(std::string path)
 {
@@ -39,6 +71,9 @@ Model loadModel(std::string path)
         std::cerr << "Model does not have normal vectors, please re-export with normals." << std::endl;
     }
 
+    std::unordered_map<VertexKey, unsigned int, VertexKeyHash> vertexIndices;
+    std::unordered_map<int, unsigned int> positionIndices;
+
     // Loop over shapes
     for (size_t s = 0; s < shapes.size(); s++) {
         // Loop over faces(polygon)
@@ -50,6 +85,31 @@ Model loadModel(std::string path)
             for (size_t v = 0; v < fv; v++) {
                 // access to vertex
                 tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+
+                // The depth stream only tells corners apart by position
+                std::unordered_map<int, unsigned int>::iterator position = positionIndices.find(idx.vertex_index);
+                if (position != positionIndices.end())
+                    model.depthIndices.push_back(position->second);
+                else {
+                    unsigned int index = (unsigned int) model.depthVertices.size();
+                    positionIndices[idx.vertex_index] = index;
+                    model.depthIndices.push_back(index);
+                    model.depthVertices.push_back(Vector3f(attrib.vertices[3 * idx.vertex_index + 0],
+                                                           attrib.vertices[3 * idx.vertex_index + 1],
+                                                           attrib.vertices[3 * idx.vertex_index + 2]));
+                }
+
+                // Reuse the vertex if this corner was seen before
+                VertexKey key = { idx.vertex_index, idx.normal_index, idx.texcoord_index };
+                std::unordered_map<VertexKey, unsigned int, VertexKeyHash>::iterator found = vertexIndices.find(key);
+                if (found != vertexIndices.end()) {
+                    model.indices.push_back(found->second);
+                    continue;
+                }
+                unsigned int index = (unsigned int) model.vertices.size();
+                vertexIndices[key] = index;
+                model.indices.push_back(index);
+
                 tinyobj::real_t vx = attrib.vertices[3 * idx.vertex_index + 0];
                 tinyobj::real_t vy = attrib.vertices[3 * idx.vertex_index + 1];
                 tinyobj::real_t vz = attrib.vertices[3 * idx.vertex_index + 2];
@@ -77,30 +137,93 @@ Model loadModel(std::string path)
         }
     }
 
+    if (!model.vertices.empty()) {
+        model.boundsMin = model.boundsMax = model.vertices[0];
+        for (size_t i = 1; i < model.vertices.size(); i++) {
+            const Vector3f& v = model.vertices[i];
+            model.boundsMin = Vector3f(std::min(model.boundsMin.x, v.x), std::min(model.boundsMin.y, v.y), std::min(model.boundsMin.z, v.z));
+            model.boundsMax = Vector3f(std::max(model.boundsMax.x, v.x), std::max(model.boundsMax.y, v.y), std::max(model.boundsMax.z, v.z));
+        }
+    }
+
     glGenVertexArrays(1, &model.vao);
-    glBindVertexArray(model.vao);
+    bindVertexArray(model.vao);
 
-    GLuint vbo;
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glGenBuffers(1, &model.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, model.vbo);
     glBufferData(GL_ARRAY_BUFFER, model.vertices.size() * sizeof(Vector3f), model.vertices.data(), GL_STATIC_DRAW);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
     glEnableVertexAttribArray(0);
-    GLuint nbo;
-    glGenBuffers(1, &nbo);
-    glBindBuffer(GL_ARRAY_BUFFER, nbo);
+    glGenBuffers(1, &model.nbo);
+    glBindBuffer(GL_ARRAY_BUFFER, model.nbo);
     glBufferData(GL_ARRAY_BUFFER, model.normals.size() * sizeof(Vector3f), model.normals.data(), GL_STATIC_DRAW);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
     glEnableVertexAttribArray(1);
+    model.tbo = 0;
     if (model.texCoords.size() > 0)
     {
-        GLuint tbo;
-        glGenBuffers(1, &tbo);
-        glBindBuffer(GL_ARRAY_BUFFER, tbo);
+        glGenBuffers(1, &model.tbo);
+        glBindBuffer(GL_ARRAY_BUFFER, model.tbo);
         glBufferData(GL_ARRAY_BUFFER, model.texCoords.size() * sizeof(Vector2f), model.texCoords.data(), GL_STATIC_DRAW);
         glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
         glEnableVertexAttribArray(2);
     }
 
+    // The element buffer binding is part of the vertex array state
+    glGenBuffers(1, &model.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, model.indices.size() * sizeof(unsigned int), model.indices.data(), GL_STATIC_DRAW);
+
+    glGenVertexArrays(1, &model.depthVao);
+    bindVertexArray(model.depthVao);
+
+    glGenBuffers(1, &model.depthVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, model.depthVbo);
+    glBufferData(GL_ARRAY_BUFFER, model.depthVertices.size() * sizeof(Vector3f), model.depthVertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glGenBuffers(1, &model.depthEbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.depthEbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, model.depthIndices.size() * sizeof(unsigned int), model.depthIndices.data(), GL_STATIC_DRAW);
+
+    bindVertexArray(0);
+
     return model;
 }
+
+void unloadModel(Model& model)
+{
+    GLuint vertexArrays[] = { model.vao, model.depthVao };
+    GLuint buffers[] = { model.vbo, model.nbo, model.tbo, model.ebo, model.depthVbo, model.depthEbo };
+    deletionQueue().deleteVertexArrays(2, vertexArrays);
+    deletionQueue().deleteBuffers(6, buffers);
+
+    model.vao = model.depthVao = 0;
+    model.vbo = model.nbo = model.tbo = model.ebo = 0;
+    model.depthVbo = model.depthEbo = 0;
+}
+
+Bounds worldBounds(const Model& model, const Matrix4f& modelMatrix)
+{
+    Bounds bounds;
+    for (int i = 0; i < 8; i++) {
+        Vector3f corner(i & 1 ? model.boundsMax.x : model.boundsMin.x,
+                        i & 2 ? model.boundsMax.y : model.boundsMin.y,
+                        i & 4 ? model.boundsMax.z : model.boundsMin.z);
+        Vector3f p = modelMatrix.transform(corner, 1);
+        float values[3] = { p.x, p.y, p.z };
+        for (int c = 0; c < 3; c++) {
+            bounds.min[c] = i == 0 ? values[c] : std::min(bounds.min[c], values[c]);
+            bounds.max[c] = i == 0 ? values[c] : std::max(bounds.max[c], values[c]);
+        }
+    }
+
+    float extent = 0;
+    for (int c = 0; c < 3; c++) {
+        bounds.center[c] = (bounds.min[c] + bounds.max[c]) / 2;
+        float half = (bounds.max[c] - bounds.min[c]) / 2;
+        extent += half * half;
+    }
+    bounds.radius = std::sqrt(extent);
+    return bounds;
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include "Material.h"
+#include "FrustumCulling.h"
+
 #include <GDT/OpenGL.h>
 #include <GDT/Vector2f.h>
 #include <GDT/Vector3f.h>
 #include <GDT/Vector4f.h>
+#include <GDT/Matrix4f.h>
 
 #include <vector>
 #include <string>
@@ -14,11 +18,38 @@ public:
     std::vector<Vector3f> vertices;
     std::vector<Vector3f> normals;
     std::vector<Vector2f> texCoords;
-	Vector3f ka;
-	Vector3f kd;
-	float ks;
+
+    // Corners that share a position, normal and texture coordinate are
+    // stored once and referenced from here
+    std::vector<unsigned int> indices;
+
+    // Each position once, with indices of its own. Depth-only passes draw
+    // these, which reads less vertex data and gets more out of the
+    // post-transform cache than the full vertices.
+    std::vector<Vector3f> depthVertices;
+    std::vector<unsigned int> depthIndices;
+
+    // Model space bounding box of the vertices
+    Vector3f boundsMin, boundsMax;
+
+    Material material;
 
     GLuint vao;
+
+    // Vertex buffers, so other vertex arrays can draw the same mesh
+    GLuint vbo, nbo, tbo, ebo;
+
+    // The position-only stream, attribute 0 only
+    GLuint depthVao;
+    GLuint depthVbo, depthEbo;
 };
 
 Model loadModel(std::string path);
+
+// Frees the model's vertex arrays and buffers through the deletionQueue(),
+// so frames still drawing it aren't waited for
+void unloadModel(Model& model);
+
+// World space bounds of a model placed with modelMatrix, the box around its
+// transformed bounding box corners
+Bounds worldBounds(const Model& model, const Matrix4f& modelMatrix);
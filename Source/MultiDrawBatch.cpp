@@ -0,0 +1,248 @@
+#include "MultiDrawBatch.h"
+#include "Extensions.h"
+#include "GLState.h"
+
+#include <cstring>
+
+// Not part of the 3.3 core headers
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+
+namespace
+{
+    // Four texels of matrix columns and one with the material index
+    const int TEXELS_PER_INSTANCE = 5;
+}
+
+const unsigned int MultiDrawBatch::INSTANCE_DATA_UNIT;
+
+MultiDrawBatch::MultiDrawBatch() :
+    _meshesDirty(false),
+    _stream(0),
+    _vao(0),
+    _instanceCapacity(0),
+    _multiDrawIndirect(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void MultiDrawBatch::create(StreamBuffer& stream)
+{
+    _stream = &stream;
+
+    // MDI honours baseInstance only with ARB_base_instance, which 4.3 has
+    if (hasGLVersion(4, 3) || (hasExtension("GL_ARB_multi_draw_indirect") && hasExtension("GL_ARB_base_instance")))
+        _multiDrawIndirect = (MultiDrawElementsIndirect) getProcAddress("glMultiDrawElementsIndirect");
+
+    glGenBuffers(1, &_positionBuffer);
+    glGenBuffers(1, &_normalBuffer);
+    glGenBuffers(1, &_texCoordBuffer);
+    glGenBuffers(1, &_indexBuffer);
+    glGenBuffers(1, &_instanceIndexBuffer);
+    glGenBuffers(1, &_instanceDataBuffer);
+    glGenBuffers(1, &_commandBuffer);
+
+    glGenVertexArrays(1, &_vao);
+    bindVertexArray(_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, _positionBuffer);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, _normalBuffer);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, _texCoordBuffer);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(2);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceIndexBuffer);
+    glVertexAttribIPointer(INSTANCE_INDEX_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0, 0);
+    glVertexAttribDivisor(INSTANCE_INDEX_ATTRIBUTE, 1);
+    glEnableVertexAttribArray(INSTANCE_INDEX_ATTRIBUTE);
+    bindVertexArray(0);
+
+    glGenTextures(1, &_instanceDataTexture);
+    reserveInstances(1024);
+}
+
+void MultiDrawBatch::destroy()
+{
+    GLuint buffers[] = { _positionBuffer, _normalBuffer, _texCoordBuffer, _indexBuffer, _instanceIndexBuffer, _instanceDataBuffer, _commandBuffer };
+    glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+    deleteVertexArrays(1, &_vao);
+    deleteTextures(1, &_instanceDataTexture);
+    _vao = 0;
+    _instanceCapacity = 0;
+
+    _meshes.clear();
+    _meshCounts.clear();
+    _meshesDirty = false;
+    _positions.clear();
+    _normals.clear();
+    _texCoords.clear();
+    _indices.clear();
+    _instances.clear();
+}
+
+int MultiDrawBatch::addMesh(const Model& model)
+{
+    MeshRange range;
+    range.firstIndex = (GLuint) _indices.size();
+    range.indexCount = (GLuint) model.indices.size();
+    range.baseVertex = (GLint) (_positions.size() / 3);
+
+    for (size_t i = 0; i < model.vertices.size(); i++) {
+        const Vector3f& p = model.vertices[i];
+        const Vector3f& n = model.normals[i];
+        _positions.push_back(p.x);
+        _positions.push_back(p.y);
+        _positions.push_back(p.z);
+        _normals.push_back(n.x);
+        _normals.push_back(n.y);
+        _normals.push_back(n.z);
+
+        // Every mesh needs the attribute since they share a vertex format
+        _texCoords.push_back(i < model.texCoords.size() ? model.texCoords[i].x : 0);
+        _texCoords.push_back(i < model.texCoords.size() ? model.texCoords[i].y : 0);
+    }
+    _indices.insert(_indices.end(), model.indices.begin(), model.indices.end());
+
+    _meshes.push_back(range);
+    _meshCounts.push_back(0);
+    _meshesDirty = true;
+    return (int) _meshes.size() - 1;
+}
+
+void MultiDrawBatch::uploadMeshes()
+{
+    glBindBuffer(GL_ARRAY_BUFFER, _positionBuffer);
+    glBufferData(GL_ARRAY_BUFFER, _positions.size() * sizeof(float), _positions.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, _normalBuffer);
+    glBufferData(GL_ARRAY_BUFFER, _normals.size() * sizeof(float), _normals.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, _texCoordBuffer);
+    glBufferData(GL_ARRAY_BUFFER, _texCoords.size() * sizeof(float), _texCoords.data(), GL_STATIC_DRAW);
+
+    // The element buffer binding belongs to the vertex array
+    bindVertexArray(_vao);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, _indices.size() * sizeof(GLuint), _indices.data(), GL_STATIC_DRAW);
+
+    _meshesDirty = false;
+}
+
+void MultiDrawBatch::reserveInstances(size_t count)
+{
+    if (count <= _instanceCapacity)
+        return;
+
+    size_t capacity = _instanceCapacity ? _instanceCapacity : 1;
+    while (capacity < count)
+        capacity *= 2;
+    _instanceCapacity = capacity;
+
+    std::vector<GLuint> indices(capacity);
+    for (size_t i = 0; i < capacity; i++)
+        indices[i] = (GLuint) i;
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceIndexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_TEXTURE_BUFFER, _instanceDataBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, capacity * TEXELS_PER_INSTANCE * 4 * sizeof(float), 0, GL_STREAM_DRAW);
+    activeTexture(INSTANCE_DATA_UNIT);
+    bindTexture(GL_TEXTURE_BUFFER, _instanceDataTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, _instanceDataBuffer);
+}
+
+void MultiDrawBatch::add(int mesh, const Matrix4f& modelMatrix, int materialIndex)
+{
+    Instance instance;
+    instance.mesh = mesh;
+    instance.modelMatrix = modelMatrix;
+    instance.materialIndex = materialIndex;
+    _instances.push_back(instance);
+}
+
+void MultiDrawBatch::draw()
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.instances = (int) _instances.size();
+    if (_instances.empty())
+        return;
+
+    if (_meshesDirty)
+        uploadMeshes();
+    reserveInstances(_instances.size());
+
+    // Counting sort by mesh, so every mesh becomes one command
+    for (size_t i = 0; i < _meshCounts.size(); i++)
+        _meshCounts[i] = 0;
+    for (size_t i = 0; i < _instances.size(); i++)
+        _meshCounts[_instances[i].mesh]++;
+
+    _commands.clear();
+    size_t offset = 0;
+    for (size_t i = 0; i < _meshCounts.size(); i++) {
+        size_t count = _meshCounts[i];
+        _meshCounts[i] = offset;
+        if (count == 0)
+            continue;
+
+        DrawCommand command;
+        command.count = _meshes[i].indexCount;
+        command.instanceCount = (GLuint) count;
+        command.firstIndex = _meshes[i].firstIndex;
+        command.baseVertex = _meshes[i].baseVertex;
+        command.baseInstance = (GLuint) offset;
+        _commands.push_back(command);
+        offset += count;
+    }
+
+    _instanceData.resize(_instances.size() * TEXELS_PER_INSTANCE * 4);
+    for (size_t i = 0; i < _instances.size(); i++) {
+        const Instance& instance = _instances[i];
+        float* data = &_instanceData[_meshCounts[instance.mesh]++ * TEXELS_PER_INSTANCE * 4];
+        for (int e = 0; e < 16; e++)
+            data[e] = instance.modelMatrix[e];
+        data[16] = (float) instance.materialIndex;
+        data[17] = data[18] = data[19] = 0;
+    }
+    _instances.clear();
+
+    // A buffer texture covers a whole buffer, plain 3.3 has no
+    // glTexBufferRange to point it into the stream, so this one is orphaned
+    glBindBuffer(GL_TEXTURE_BUFFER, _instanceDataBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, _instanceCapacity * TEXELS_PER_INSTANCE * 4 * sizeof(float), 0, GL_STREAM_DRAW);
+    glBufferSubData(GL_TEXTURE_BUFFER, 0, _instanceData.size() * sizeof(float), _instanceData.data());
+    activeTexture(INSTANCE_DATA_UNIT);
+    bindTexture(GL_TEXTURE_BUFFER, _instanceDataTexture);
+
+    bindVertexArray(_vao);
+    _stats.commands = (int) _commands.size();
+
+    if (_multiDrawIndirect) {
+        // From the stream, re-specifying the command buffer only when it's full
+        size_t bytes = _commands.size() * sizeof(DrawCommand);
+        StreamAllocation allocation = _stream->write(_commands.data(), bytes, sizeof(GLuint));
+        if (allocation.size > 0)
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _stream->handle());
+        else {
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _commandBuffer);
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, bytes, _commands.data(), GL_STREAM_DRAW);
+        }
+        _multiDrawIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*) allocation.offset, (GLsizei) _commands.size(), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        _stats.calls = 1;
+        return;
+    }
+
+    // No base instance in 3.3, offset the index attribute instead
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceIndexBuffer);
+    for (size_t i = 0; i < _commands.size(); i++) {
+        const DrawCommand& command = _commands[i];
+        glVertexAttribIPointer(INSTANCE_INDEX_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0, (void*) (command.baseInstance * sizeof(GLuint)));
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT, (void*) (command.firstIndex * sizeof(GLuint)),
+                                          command.instanceCount, command.baseVertex);
+    }
+    glVertexAttribIPointer(INSTANCE_INDEX_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0, 0);
+    _stats.calls = (int) _commands.size();
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Model.h"
+#include "VertexLayout.h"
+#include "StreamBuffer.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+
+#include <vector>
+
+// Where a mesh ended up in the batch's shared buffers
+class MeshRange
+{
+public:
+    GLuint firstIndex;
+    GLuint indexCount;
+    GLint baseVertex;
+};
+
+class MultiDrawStats
+{
+public:
+    int instances;
+    int commands;
+    int calls;
+};
+
+// Draws many objects of one program and vertex format with a single
+// glMultiDrawElementsIndirect. All meshes live in one set of vertex and
+// index buffers, so the commands differ only in their ranges.
+//
+// Per-object transforms and material indices go into a texture buffer,
+// five texels per instance. The vertex shader finds its instance through
+// an instanced attribute that reads 0, 1, 2, ... from a fixed buffer: each
+// command's baseInstance makes it start at the command's first instance.
+// See blinnphong.vert with INDIRECT.
+//
+// Without GL 4.3 or ARB_multi_draw_indirect the same commands are issued
+// one by one with glDrawElementsInstancedBaseVertex, moving the index
+// attribute to each command's first instance instead.
+class MultiDrawBatch
+{
+public:
+    MultiDrawBatch();
+
+    // The indirect commands are written into the stream, so draw() has to
+    // run between its beginFrame() and endFrame()
+    void create(StreamBuffer& stream);
+    void destroy();
+
+    // Copies the mesh into the shared buffers
+    int addMesh(const Model& model);
+    const MeshRange& mesh(int id) const { return _meshes[id]; }
+
+    void add(int mesh, const Matrix4f& modelMatrix, int materialIndex);
+
+    // Draws everything added since the last draw with the bound program.
+    // The instance data is bound to texture unit INSTANCE_DATA_UNIT.
+    void draw();
+
+    bool usesMultiDrawIndirect() const { return _multiDrawIndirect != 0; }
+    const MultiDrawStats& stats() const { return _stats; }
+
+    static const unsigned int INSTANCE_DATA_UNIT = 2;
+
+private:
+    class Instance
+    {
+    public:
+        int mesh;
+        Matrix4f modelMatrix;
+        int materialIndex;
+    };
+
+    // Layout fixed by glMultiDrawElementsIndirect
+    class DrawCommand
+    {
+    public:
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    typedef void (APIENTRYP MultiDrawElementsIndirect)(GLenum mode, GLenum type, const void* indirect, GLsizei drawCount, GLsizei stride);
+
+    void uploadMeshes();
+    void reserveInstances(size_t count);
+
+    std::vector<MeshRange> _meshes;
+    std::vector<float> _positions, _normals, _texCoords;
+    std::vector<GLuint> _indices;
+    bool _meshesDirty;
+
+    std::vector<Instance> _instances;
+    std::vector<float> _instanceData;
+    std::vector<DrawCommand> _commands;
+    std::vector<size_t> _meshCounts;
+
+    StreamBuffer* _stream;
+    GLuint _vao;
+    GLuint _positionBuffer, _normalBuffer, _texCoordBuffer, _indexBuffer;
+    GLuint _instanceIndexBuffer;
+    GLuint _instanceDataBuffer, _instanceDataTexture;
+    GLuint _commandBuffer;
+    size_t _instanceCapacity;
+
+    MultiDrawElementsIndirect _multiDrawIndirect;
+    MultiDrawStats _stats;
+};
@@ -0,0 +1,345 @@
+#include "OcclusionBuffer.h"
+#include "WorkerPool.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const int TILE_SIZE = 8;
+
+    // Objects tested per job in cullOccluded
+    const size_t TEST_CHUNK = 256;
+
+    // Column major a * b
+    void multiply(const float* a, const float* b, float* out)
+    {
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                float sum = 0;
+                for (int k = 0; k < 4; k++)
+                    sum += a[k * 4 + r] * b[c * 4 + k];
+                out[c * 4 + r] = sum;
+            }
+        }
+    }
+
+    // Fills rows [y0, y1) and columns [x0, x1), x0 and x1 on 8 pixel
+    // boundaries so that every version visits the same pixels. They also
+    // evaluate the edges and depth with the same operations, without FMA,
+    // and so write the same buffer.
+    typedef void (*RasterFunction)(const float* edges, const float* z, int x0, int x1, int y0, int y1, float* depth, int width);
+
+    void rasterScalar(const float* edges, const float* z, int x0, int x1, int y0, int y1, float* depth, int width)
+    {
+        for (int y = y0; y < y1; y++) {
+            float py = y + 0.5f;
+            float row[3];
+            for (int i = 0; i < 3; i++)
+                row[i] = edges[i * 3 + 1] * py + edges[i * 3 + 2];
+            float rowZ = z[1] * py + z[2];
+
+            float* line = depth + (size_t) y * width;
+            for (int x = x0; x < x1; x++) {
+                float px = x + 0.5f;
+                float e0 = edges[0] * px + row[0];
+                float e1 = edges[3] * px + row[1];
+                float e2 = edges[6] * px + row[2];
+                if (e0 >= 0 && e1 >= 0 && e2 >= 0) {
+                    float d = z[0] * px + rowZ;
+                    line[x] = line[x] < d ? line[x] : d;
+                }
+            }
+        }
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET_SSE41 void rasterSse(const float* edges, const float* z, int x0, int x1, int y0, int y1, float* depth, int width)
+    {
+        const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 zero = _mm_setzero_ps();
+        __m128 a0 = _mm_set1_ps(edges[0]), a1 = _mm_set1_ps(edges[3]), a2 = _mm_set1_ps(edges[6]);
+        __m128 za = _mm_set1_ps(z[0]);
+
+        for (int y = y0; y < y1; y++) {
+            float py = y + 0.5f;
+            __m128 row0 = _mm_set1_ps(edges[1] * py + edges[2]);
+            __m128 row1 = _mm_set1_ps(edges[4] * py + edges[5]);
+            __m128 row2 = _mm_set1_ps(edges[7] * py + edges[8]);
+            __m128 rowZ = _mm_set1_ps(z[1] * py + z[2]);
+
+            float* line = depth + (size_t) y * width;
+            for (int x = x0; x < x1; x += 4) {
+                __m128 px = _mm_add_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x), lanes)), half);
+                __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), row0), zero);
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), row1), zero));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), row2), zero));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                __m128 d = _mm_add_ps(_mm_mul_ps(za, px), rowZ);
+                __m128 old = _mm_loadu_ps(line + x);
+                _mm_storeu_ps(line + x, _mm_blendv_ps(old, _mm_min_ps(old, d), inside));
+            }
+        }
+    }
+
+    SIMD_TARGET_AVX2 void rasterAvx2(const float* edges, const float* z, int x0, int x1, int y0, int y1, float* depth, int width)
+    {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 a0 = _mm256_set1_ps(edges[0]), a1 = _mm256_set1_ps(edges[3]), a2 = _mm256_set1_ps(edges[6]);
+        __m256 za = _mm256_set1_ps(z[0]);
+
+        for (int y = y0; y < y1; y++) {
+            float py = y + 0.5f;
+            __m256 row0 = _mm256_set1_ps(edges[1] * py + edges[2]);
+            __m256 row1 = _mm256_set1_ps(edges[4] * py + edges[5]);
+            __m256 row2 = _mm256_set1_ps(edges[7] * py + edges[8]);
+            __m256 rowZ = _mm256_set1_ps(z[1] * py + z[2]);
+
+            float* line = depth + (size_t) y * width;
+            for (int x = x0; x < x1; x += 8) {
+                __m256 px = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lanes)), half);
+                __m256 inside = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a0, px), row0), zero, _CMP_GE_OQ);
+                inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a1, px), row1), zero, _CMP_GE_OQ));
+                inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a2, px), row2), zero, _CMP_GE_OQ));
+                if (_mm256_movemask_ps(inside) == 0)
+                    continue;
+
+                __m256 d = _mm256_add_ps(_mm256_mul_ps(za, px), rowZ);
+                __m256 old = _mm256_loadu_ps(line + x);
+                _mm256_storeu_ps(line + x, _mm256_blendv_ps(old, _mm256_min_ps(old, d), inside));
+            }
+        }
+    }
+#endif
+
+    RasterFunction rasterFunction()
+    {
+#ifdef SIMD_X86
+        if (simdLevel() >= SIMD_AVX2)
+            return rasterAvx2;
+        if (simdLevel() >= SIMD_SSE41)
+            return rasterSse;
+#endif
+        return rasterScalar;
+    }
+}
+
+OcclusionBuffer::OcclusionBuffer(int width, int height) :
+    _width((width + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE),
+    _height((height + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE),
+    _tilesX(_width / TILE_SIZE),
+    _tilesY(_height / TILE_SIZE),
+    _depth((size_t) _width * _height, 1.0f),
+    _tileMax((size_t) _tilesX * _tilesY, 1.0f)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_viewProjection, 0, sizeof(_viewProjection));
+}
+
+void OcclusionBuffer::begin(const float* viewProjection)
+{
+    memcpy(_viewProjection, viewProjection, sizeof(_viewProjection));
+    _triangles.clear();
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void OcclusionBuffer::addOccluder(const float* positions, size_t vertexCount, const unsigned int* indices, size_t indexCount, const float* modelMatrix)
+{
+    float m[16];
+    multiply(_viewProjection, modelMatrix, m);
+
+    // Window space, y up like GL
+    _vertices.resize(vertexCount * 3);
+    _inFront.resize(vertexCount);
+    for (size_t i = 0; i < vertexCount; i++) {
+        const float* p = positions + i * 3;
+        float clip[4];
+        for (int r = 0; r < 4; r++)
+            clip[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+
+        _inFront[i] = clip[3] > 0 && clip[2] >= -clip[3];
+        if (!_inFront[i])
+            continue;
+        float* v = &_vertices[i * 3];
+        v[0] = (clip[0] / clip[3] * 0.5f + 0.5f) * _width;
+        v[1] = (clip[1] / clip[3] * 0.5f + 0.5f) * _height;
+        v[2] = clip[2] / clip[3] * 0.5f + 0.5f;
+    }
+
+    for (size_t i = 0; i + 2 < indexCount; i += 3) {
+        _stats.occluderTriangles++;
+        unsigned int i0 = indices[i], i1 = indices[i + 1], i2 = indices[i + 2];
+        if (!_inFront[i0] || !_inFront[i1] || !_inFront[i2])
+            continue;
+
+        const float* v0 = &_vertices[i0 * 3];
+        const float* v1 = &_vertices[i1 * 3];
+        const float* v2 = &_vertices[i2 * 3];
+
+        // Counter clockwise is front facing
+        float area = (v1[0] - v0[0]) * (v2[1] - v0[1]) - (v2[0] - v0[0]) * (v1[1] - v0[1]);
+        if (area <= 0)
+            continue;
+
+        // Pixels with their centre inside the bounding box
+        Triangle t;
+        t.minX = std::max(0, (int) std::ceil(std::min(v0[0], std::min(v1[0], v2[0])) - 0.5f));
+        t.maxX = std::min(_width - 1, (int) std::floor(std::max(v0[0], std::max(v1[0], v2[0])) - 0.5f));
+        t.minY = std::max(0, (int) std::ceil(std::min(v0[1], std::min(v1[1], v2[1])) - 0.5f));
+        t.maxY = std::min(_height - 1, (int) std::floor(std::max(v0[1], std::max(v1[1], v2[1])) - 0.5f));
+        if (t.minX > t.maxX || t.minY > t.maxY)
+            continue;
+
+        const float* v[3] = { v0, v1, v2 };
+        for (int e = 0; e < 3; e++) {
+            const float* a = v[e];
+            const float* b = v[(e + 1) % 3];
+            t.edges[e][0] = a[1] - b[1];
+            t.edges[e][1] = b[0] - a[0];
+            t.edges[e][2] = a[0] * b[1] - a[1] * b[0];
+        }
+
+        // Depth plane through the three vertices
+        float dz1 = v1[2] - v0[2], dz2 = v2[2] - v0[2];
+        t.z[0] = (dz1 * (v2[1] - v0[1]) - dz2 * (v1[1] - v0[1])) / area;
+        t.z[1] = (dz2 * (v1[0] - v0[0]) - dz1 * (v2[0] - v0[0])) / area;
+        t.z[2] = v0[2] - t.z[0] * v0[0] - t.z[1] * v0[1];
+
+        _triangles.push_back(t);
+    }
+}
+
+void OcclusionBuffer::rasterize(WorkerPool* pool)
+{
+    _stats.rasterizedTriangles = (int) _triangles.size();
+
+    if (pool)
+        pool->parallelFor(_tilesY, 1, [this](size_t begin, size_t end) {
+            for (size_t band = begin; band < end; band++)
+                rasterizeBand((int) band);
+        });
+    else {
+        for (int band = 0; band < _tilesY; band++)
+            rasterizeBand(band);
+    }
+}
+
+void OcclusionBuffer::rasterizeBand(int band)
+{
+    int y0 = band * TILE_SIZE;
+    int y1 = y0 + TILE_SIZE;
+    for (int y = y0; y < y1; y++)
+        std::fill(_depth.begin() + (size_t) y * _width, _depth.begin() + (size_t) (y + 1) * _width, 1.0f);
+
+    RasterFunction raster = rasterFunction();
+    for (size_t i = 0; i < _triangles.size(); i++) {
+        const Triangle& t = _triangles[i];
+        if (t.maxY < y0 || t.minY >= y1)
+            continue;
+
+        int x0 = t.minX & ~(TILE_SIZE - 1);
+        int x1 = (t.maxX | (TILE_SIZE - 1)) + 1;
+        raster(&t.edges[0][0], t.z, x0, x1, std::max(y0, t.minY), std::min(y1, t.maxY + 1), _depth.data(), _width);
+    }
+
+    // Furthest depth per tile, for rejecting whole tiles in isVisible
+    for (int tx = 0; tx < _tilesX; tx++) {
+        float furthest = 0;
+        for (int y = y0; y < y1; y++) {
+            const float* line = &_depth[(size_t) y * _width + tx * TILE_SIZE];
+            for (int x = 0; x < TILE_SIZE; x++)
+                furthest = std::max(furthest, line[x]);
+        }
+        _tileMax[band * _tilesX + tx] = furthest;
+    }
+}
+
+bool OcclusionBuffer::isVisible(const Bounds& bounds) const
+{
+    const float* m = _viewProjection;
+    float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f, minZ = 1e30f;
+    for (int i = 0; i < 8; i++) {
+        float p[3] = {
+            i & 1 ? bounds.max[0] : bounds.min[0],
+            i & 2 ? bounds.max[1] : bounds.min[1],
+            i & 4 ? bounds.max[2] : bounds.min[2]
+        };
+        float clip[4];
+        for (int r = 0; r < 4; r++)
+            clip[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r];
+        if (clip[3] <= 0 || clip[2] < -clip[3])
+            return true;
+
+        float x = (clip[0] / clip[3] * 0.5f + 0.5f) * _width;
+        float y = (clip[1] / clip[3] * 0.5f + 0.5f) * _height;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        minZ = std::min(minZ, clip[2] / clip[3] * 0.5f + 0.5f);
+    }
+
+    // Off screen boxes are left to frustum culling
+    if (maxX < 0 || maxY < 0 || minX >= _width || minY >= _height)
+        return true;
+
+    // Every pixel the box touches
+    int x0 = std::max(0, (int) std::floor(minX));
+    int x1 = std::min(_width - 1, (int) std::floor(maxX));
+    int y0 = std::max(0, (int) std::floor(minY));
+    int y1 = std::min(_height - 1, (int) std::floor(maxY));
+
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++) {
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++) {
+            if (minZ > _tileMax[ty * _tilesX + tx])
+                continue;
+
+            // Part of the tile is behind the box, look at its pixels
+            int py0 = std::max(y0, ty * TILE_SIZE), py1 = std::min(y1, ty * TILE_SIZE + TILE_SIZE - 1);
+            int px0 = std::max(x0, tx * TILE_SIZE), px1 = std::min(x1, tx * TILE_SIZE + TILE_SIZE - 1);
+            for (int y = py0; y <= py1; y++) {
+                const float* line = &_depth[(size_t) y * _width];
+                for (int x = px0; x <= px1; x++) {
+                    if (minZ <= line[x])
+                        return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+size_t OcclusionBuffer::cullOccluded(const BoundsTable& table, std::vector<uint32_t>& indices, WorkerPool* pool)
+{
+    std::vector<unsigned char> visible(indices.size());
+    std::function<void(size_t, size_t)> test = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            visible[i] = isVisible(table.get(indices[i]));
+    };
+    if (pool)
+        pool->parallelFor(indices.size(), TEST_CHUNK, test);
+    else
+        test(0, indices.size());
+
+    size_t count = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (visible[i])
+            indices[count++] = indices[i];
+    }
+
+    _stats.tested += (int) indices.size();
+    _stats.rejected += (int) (indices.size() - count);
+    indices.resize(count);
+    return count;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "FrustumCulling.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+class OcclusionStats
+{
+public:
+    int occluderTriangles;
+    int rasterizedTriangles;
+    int tested;
+    int rejected;
+};
+
+// Software depth buffer for occlusion culling. Each frame a few large
+// meshes are rasterized into it at low resolution on the CPU, then the
+// screen space boxes of other objects are tested against it, so objects
+// hidden behind the occluders never reach the GPU.
+//
+// The buffer is split into 8x8 tiles that keep the furthest depth in them.
+// A box whose nearest point is behind that in every tile it covers is
+// hidden without looking at single pixels.
+//
+// Depth is window depth in [0, 1], with 1 where nothing was drawn.
+// Nothing here touches GL.
+class OcclusionBuffer
+{
+public:
+    // Rounded up to whole tiles
+    OcclusionBuffer(int width = 256, int height = 128);
+
+    // Clears the buffer and occluder list for a frame seen through
+    // projMatrix * viewMatrix, column major
+    void begin(const float* viewProjection);
+
+    // Queues the triangles of a mesh placed with modelMatrix. Back faces and
+    // triangles crossing the near plane are left out, which can only make
+    // the occluder smaller. Low poly stand-ins work best here.
+    void addOccluder(const float* positions, size_t vertexCount, const unsigned int* indices, size_t indexCount, const float* modelMatrix);
+
+    // Draws the queued occluders, one band of tiles per job on the pool
+    void rasterize(WorkerPool* pool = 0);
+
+    // Whether any part of the box could be in front of the occluders.
+    // Boxes reaching behind the camera always are.
+    bool isVisible(const Bounds& bounds) const;
+
+    // Removes the hidden objects from a list of table indices, keeping the
+    // order, and returns how many are left
+    size_t cullOccluded(const BoundsTable& table, std::vector<uint32_t>& indices, WorkerPool* pool = 0);
+
+    const OcclusionStats& stats() const { return _stats; }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    const float* depth() const { return _depth.data(); }
+
+private:
+    // Edge functions a * x + b * y + c, positive inside, and the depth plane
+    class Triangle
+    {
+    public:
+        float edges[3][3];
+        float z[3];
+        int minX, maxX, minY, maxY;
+    };
+
+    void rasterizeBand(int band);
+
+    int _width, _height;
+    int _tilesX, _tilesY;
+    std::vector<float> _depth;
+    std::vector<float> _tileMax;
+    std::vector<Triangle> _triangles;
+
+    // Window space x, y, z of the occluder being added and whether it's
+    // in front of the near plane
+    std::vector<float> _vertices;
+    std::vector<bool> _inFront;
+    float _viewProjection[16];
+    OcclusionStats _stats;
+};
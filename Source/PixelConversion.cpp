@@ -0,0 +1,423 @@
+#include "PixelConversion.h"
+#include "Simd.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    class SrgbTable
+    {
+    public:
+        float values[256];
+
+        SrgbTable()
+        {
+            for (int i = 0; i < 256; i++) {
+                float c = i / 255.0f;
+                values[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+        }
+    };
+
+    const SrgbTable srgbTable;
+
+    // Exact round(c * a / 255) without a division
+    inline unsigned char mulDiv255(unsigned int c, unsigned int a)
+    {
+        unsigned int t = c * a + 128;
+        return (unsigned char) ((t + (t >> 8)) >> 8);
+    }
+
+    inline unsigned char encodeSnorm(float v)
+    {
+        return (unsigned char) (int) std::nearbyint(v * 127.5f + 127.5f);
+    }
+
+    void packNormal(const unsigned char* in, unsigned char* out)
+    {
+        float x = in[0] * (2.0f / 255) - 1;
+        float y = in[1] * (2.0f / 255) - 1;
+        float z = in[2] * (2.0f / 255) - 1;
+        float scale = 1.0f / std::sqrt(std::max(x * x + y * y + z * z, 1e-12f));
+        out[0] = encodeSnorm(x * scale);
+        out[1] = encodeSnorm(y * scale);
+        out[2] = 0;
+        out[3] = 255;
+    }
+
+    uint16_t halfScalar(float value)
+    {
+        uint32_t f;
+        memcpy(&f, &value, 4);
+
+        uint32_t sign = f & 0x80000000u;
+        f ^= sign;
+
+        uint32_t o;
+        if (f >= (127 + 16) << 23) {
+            // Overflow to infinity, NaNs are quieted and keep the top of
+            // their payload like the F16C conversion does
+            o = f > (255u << 23) ? 0x7e00 | ((f >> 13) & 0x3ff) : 0x7c00;
+        }
+        else if (f < (113 << 23)) {
+            // Subnormal or zero, let the FPU do the rounding
+            const uint32_t magicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+            float magic, shifted;
+            memcpy(&magic, &magicBits, 4);
+            memcpy(&shifted, &f, 4);
+            shifted += magic;
+            memcpy(&o, &shifted, 4);
+            o -= magicBits;
+        }
+        else {
+            uint32_t mantissaOdd = (f >> 13) & 1;
+            f += ((uint32_t) (15 - 127) << 23) + 0xfff;
+            f += mantissaOdd;
+            o = f >> 13;
+        }
+
+        return (uint16_t) (o | (sign >> 16));
+    }
+
+#ifdef SIMD_X86
+    SIMD_TARGET_SSE41 size_t expandRgbToRgbaSse(const unsigned char* rgb, unsigned char* rgba, size_t pixels)
+    {
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+
+        // 16 byte loads for 12 bytes of input, stop before reading past the end
+        size_t i = 0;
+        for (; i + 6 <= pixels; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (rgb + i * 3));
+            _mm_storeu_si128((__m128i*) (rgba + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t expandRgbToRgbaAvx2(const unsigned char* rgb, unsigned char* rgba, size_t pixels)
+    {
+        const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m256i alpha = _mm256_set1_epi32((int) 0xFF000000);
+
+        size_t i = 0;
+        for (; i + 10 <= pixels; i += 8) {
+            __m128i lo = _mm_loadu_si128((const __m128i*) (rgb + i * 3));
+            __m128i hi = _mm_loadu_si128((const __m128i*) (rgb + i * 3 + 12));
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            _mm256_storeu_si256((__m256i*) (rgba + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_SSE41 size_t convertToFloatSse(const unsigned char* rgba, float* out, size_t pixels, bool srgb)
+    {
+        // Without a gather the table lookups have to be scalar anyway, and
+        // the plain scalar loop does them with less shuffling
+        if (srgb)
+            return 0;
+
+        const __m128 scale = _mm_set1_ps(1.0f / 255);
+
+        // Four pixels per iteration, one vector each
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (rgba + i * 4));
+            for (int p = 0; p < 4; p++) {
+                __m128i c = _mm_cvtepu8_epi32(_mm_srli_si128(v, p * 4));
+                _mm_storeu_ps(out + (i + p) * 4, _mm_mul_ps(_mm_cvtepi32_ps(c), scale));
+            }
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t convertToFloatAvx2(const unsigned char* rgba, float* out, size_t pixels, bool srgb)
+    {
+        const __m256 scale = _mm256_set1_ps(1.0f / 255);
+
+        // Two pixels per iteration, colour channels through a gathered table
+        size_t i = 0;
+        for (; i + 2 <= pixels; i += 2) {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (rgba + i * 4)));
+            __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale);
+            if (srgb)
+                f = _mm256_blend_ps(_mm256_i32gather_ps(srgbTable.values, v, 4), f, 0x88);
+            _mm256_storeu_ps(out + i * 4, f);
+        }
+        return i;
+    }
+
+    SIMD_TARGET_SSE41 size_t premultiplyAlphaSse(unsigned char* rgba, size_t pixels)
+    {
+        const __m128i alphaLanes = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+        const __m128i half = _mm_set1_epi16(128);
+        const __m128i zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (rgba + i * 4));
+            __m128i result[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i c = h == 0 ? _mm_unpacklo_epi8(v, zero) : _mm_unpackhi_epi8(v, zero);
+                // Broadcast each pixel's alpha, multiplying alpha itself by 255
+                __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xFF), 0xFF);
+                a = _mm_or_si128(a, alphaLanes);
+                __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), half);
+                result[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+            }
+            _mm_storeu_si128((__m128i*) (rgba + i * 4), _mm_packus_epi16(result[0], result[1]));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t premultiplyAlphaAvx2(unsigned char* rgba, size_t pixels)
+    {
+        const __m256i alphaLanes = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+        const __m256i half = _mm256_set1_epi16(128);
+        const __m256i zero = _mm256_setzero_si256();
+
+        // Unpacks work within 128-bit lanes, and so does the pack back, so
+        // the pixel order comes out right without a permute
+        size_t i = 0;
+        for (; i + 8 <= pixels; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) (rgba + i * 4));
+            __m256i result[2];
+            for (int h = 0; h < 2; h++) {
+                __m256i c = h == 0 ? _mm256_unpacklo_epi8(v, zero) : _mm256_unpackhi_epi8(v, zero);
+                __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, 0xFF), 0xFF);
+                a = _mm256_or_si256(a, alphaLanes);
+                __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(c, a), half);
+                result[h] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+            }
+            _mm256_storeu_si256((__m256i*) (rgba + i * 4), _mm256_packus_epi16(result[0], result[1]));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_SSE41 size_t packNormalMapSse(const unsigned char* rgba, unsigned char* out, size_t pixels)
+    {
+        const __m128i byteMask = _mm_set1_epi32(0xFF);
+        const __m128 toSigned = _mm_set1_ps(2.0f / 255);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 half = _mm_set1_ps(127.5f);
+        const __m128 epsilon = _mm_set1_ps(1e-12f);
+        const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (rgba + i * 4));
+            __m128 x = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(v, byteMask)), toSigned), one);
+            __m128 y = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), byteMask)), toSigned), one);
+            __m128 z = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), byteMask)), toSigned), one);
+
+            __m128 length = _mm_sqrt_ps(_mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)), epsilon));
+            __m128 scale = _mm_div_ps(one, length);
+
+            // cvtps rounds to nearest even, like nearbyint in the scalar path
+            __m128i r = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(x, scale), half), half));
+            __m128i g = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(y, scale), half), half));
+            _mm_storeu_si128((__m128i*) (out + i * 4), _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), alpha));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t packNormalMapAvx2(const unsigned char* rgba, unsigned char* out, size_t pixels)
+    {
+        const __m256i byteMask = _mm256_set1_epi32(0xFF);
+        const __m256 toSigned = _mm256_set1_ps(2.0f / 255);
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256 half = _mm256_set1_ps(127.5f);
+        const __m256 epsilon = _mm256_set1_ps(1e-12f);
+        const __m256i alpha = _mm256_set1_epi32((int) 0xFF000000);
+
+        size_t i = 0;
+        for (; i + 8 <= pixels; i += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) (rgba + i * 4));
+            __m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(v, byteMask)), toSigned), one);
+            __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 8), byteMask)), toSigned), one);
+            __m256 z = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(v, 16), byteMask)), toSigned), one);
+
+            // Same operation order as the scalar path, no FMA contraction
+            __m256 length = _mm256_sqrt_ps(_mm256_max_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)), epsilon));
+            __m256 scale = _mm256_div_ps(one, length);
+
+            __m256i r = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(x, scale), half), half));
+            __m256i g = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(y, scale), half), half));
+            _mm256_storeu_si256((__m256i*) (out + i * 4), _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), alpha));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_SSE41 size_t floatToHalfSse(const float* in, uint16_t* out, size_t count)
+    {
+        const __m128i signMask = _mm_set1_epi32((int) 0x80000000u);
+        const __m128i f16max = _mm_set1_epi32((127 + 16) << 23);
+        const __m128i nanBits = _mm_set1_epi32(0x3ff);
+        const __m128i quietBit = _mm_set1_epi32(0x200);
+        const __m128i infinity = _mm_set1_epi32(0x7c00);
+        const __m128i minNormal = _mm_set1_epi32((127 - 14) << 23);
+        const __m128i subnormalMagic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+        const __m128i normalBias = _mm_set1_epi32(0xfff - ((127 - 15) << 23));
+        const __m128i zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m128i bits[2], sign[2], halves[2];
+            int common = 0xffff;
+            for (int h = 0; h < 2; h++) {
+                __m128i f = _mm_loadu_si128((const __m128i*) (in + i + h * 4));
+                sign[h] = _mm_and_si128(f, signMask);
+                bits[h] = _mm_xor_si128(f, sign[h]);
+
+                // Same rounding as halfScalar's normal path, zeros are masked
+                __m128i mantissaOdd = _mm_srai_epi32(_mm_slli_epi32(bits[h], 31 - 13), 31);
+                __m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits[h], normalBias), mantissaOdd), 13);
+                __m128i isZero = _mm_cmpeq_epi32(bits[h], zero);
+                halves[h] = _mm_andnot_si128(isZero, normal);
+
+                __m128i isNormal = _mm_andnot_si128(_mm_cmpgt_epi32(minNormal, bits[h]), _mm_cmpgt_epi32(f16max, bits[h]));
+                common &= _mm_movemask_epi8(_mm_or_si128(isNormal, isZero));
+            }
+
+            // Image data is almost always normal or zero, only blocks with
+            // subnormals, overflow or NaNs pay for the other paths
+            if (common != 0xffff) {
+                for (int h = 0; h < 2; h++) {
+                    __m128 absf = _mm_castsi128_ps(bits[h]);
+                    __m128i isRegular = _mm_cmpgt_epi32(f16max, bits[h]);
+                    __m128i payload = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(bits[h], 13), nanBits), quietBit);
+                    __m128i special = _mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmpunord_ps(absf, absf)), payload), infinity);
+
+                    __m128i isSubnormal = _mm_cmpgt_epi32(minNormal, bits[h]);
+                    __m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(absf, _mm_castsi128_ps(subnormalMagic))), subnormalMagic);
+
+                    __m128i regular = _mm_blendv_epi8(halves[h], subnormal, isSubnormal);
+                    halves[h] = _mm_blendv_epi8(special, regular, isRegular);
+                }
+            }
+
+            // Values are sign extended from 16 bits, so a signed pack is exact
+            __m128i lo = _mm_or_si128(halves[0], _mm_srai_epi32(sign[0], 16));
+            __m128i hi = _mm_or_si128(halves[1], _mm_srai_epi32(sign[1], 16));
+            _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(lo, hi));
+        }
+        return i;
+    }
+
+    SIMD_TARGET_AVX2 size_t floatToHalfAvx2(const float* in, uint16_t* out, size_t count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+            _mm_storeu_si128((__m128i*) (out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+        return i;
+    }
+#endif
+}
+
+void expandRgbToRgba(const unsigned char* rgb, unsigned char* rgba, size_t pixels)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() >= SIMD_AVX2)
+        i = expandRgbToRgbaAvx2(rgb, rgba, pixels);
+    else if (simdLevel() >= SIMD_SSE41)
+        i = expandRgbToRgbaSse(rgb, rgba, pixels);
+#endif
+    for (; i < pixels; i++) {
+        rgba[i * 4 + 0] = rgb[i * 3 + 0];
+        rgba[i * 4 + 1] = rgb[i * 3 + 1];
+        rgba[i * 4 + 2] = rgb[i * 3 + 2];
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+void convertToFloat(const unsigned char* rgba, float* out, size_t pixels, bool srgb)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() >= SIMD_AVX2)
+        i = convertToFloatAvx2(rgba, out, pixels, srgb);
+    else if (simdLevel() >= SIMD_SSE41)
+        i = convertToFloatSse(rgba, out, pixels, srgb);
+#endif
+    for (; i < pixels; i++) {
+        const unsigned char* p = rgba + i * 4;
+        float* o = out + i * 4;
+        for (int c = 0; c < 3; c++)
+            o[c] = srgb ? srgbTable.values[p[c]] : p[c] * (1.0f / 255);
+        o[3] = p[3] * (1.0f / 255);
+    }
+}
+
+void premultiplyAlpha(unsigned char* rgba, size_t pixels)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() >= SIMD_AVX2)
+        i = premultiplyAlphaAvx2(rgba, pixels);
+    else if (simdLevel() >= SIMD_SSE41)
+        i = premultiplyAlphaSse(rgba, pixels);
+#endif
+    for (; i < pixels; i++) {
+        unsigned char* p = rgba + i * 4;
+        p[0] = mulDiv255(p[0], p[3]);
+        p[1] = mulDiv255(p[1], p[3]);
+        p[2] = mulDiv255(p[2], p[3]);
+    }
+}
+
+void packNormalMap(const unsigned char* rgba, unsigned char* out, size_t pixels)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() >= SIMD_AVX2)
+        i = packNormalMapAvx2(rgba, out, pixels);
+    else if (simdLevel() >= SIMD_SSE41)
+        i = packNormalMapSse(rgba, out, pixels);
+#endif
+    for (; i < pixels; i++)
+        packNormal(rgba + i * 4, out + i * 4);
+}
+
+void floatToHalf(const float* in, uint16_t* out, size_t count)
+{
+    size_t i = 0;
+#ifdef SIMD_X86
+    if (simdLevel() >= SIMD_AVX2)
+        i = floatToHalfAvx2(in, out, count);
+    else if (simdLevel() >= SIMD_SSE41)
+        i = floatToHalfSse(in, out, count);
+#endif
+    for (; i < count; i++)
+        out[i] = halfScalar(in[i]);
+}
+
+unsigned char* loadRgbaPixels(const char* path, int* width, int* height)
+{
+    int comp;
+    if (!stbi_info(path, width, height, &comp))
+        return 0;
+
+    if (comp != 3)
+        return stbi_load(path, width, height, &comp, 4);
+
+    unsigned char* rgb = stbi_load(path, width, height, &comp, 3);
+    if (!rgb)
+        return 0;
+
+    // stbi_image_free is free() unless STBI_FREE is overridden
+    size_t pixels = (size_t) *width * *height;
+    unsigned char* rgba = (unsigned char*) malloc(pixels * 4);
+    expandRgbToRgba(rgb, rgba, pixels);
+    stbi_image_free(rgb);
+    return rgba;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Pixel format conversion kernels used by the image pipeline. Every kernel
+// has a scalar version and SSE4.1/AVX2 versions picked at run time (see
+// Simd.h), except sRGB decoding which stays scalar below AVX2 gathers. All
+// of them produce identical results, "Benchmark verify" checks that.
+
+// 8-bit RGB to RGBA with alpha 255
+void expandRgbToRgba(const unsigned char* rgb, unsigned char* rgba, size_t pixels);
+
+// 8-bit RGBA to float RGBA in [0, 1]. With srgb set the colour channels are
+// decoded to linear light; alpha is always linear.
+void convertToFloat(const unsigned char* rgba, float* out, size_t pixels, bool srgb);
+
+// Multiplies the colour channels of 8-bit RGBA by alpha, rounding exactly
+void premultiplyAlpha(unsigned char* rgba, size_t pixels);
+
+// Renormalizes tangent space normals stored as 8-bit RGB and writes X and Y
+// to the red and green channels, blue 0 and alpha 255. This is the layout
+// BC5 compresses; the shader rebuilds Z from X and Y. Works in place.
+void packNormalMap(const unsigned char* rgba, unsigned char* out, size_t pixels);
+
+// IEEE half floats, rounding to nearest even
+void floatToHalf(const float* in, uint16_t* out, size_t count);
+
+// Loads an image as tightly packed RGBA8. RGB files are expanded with
+// expandRgbToRgba instead of by stb_image. Free the result with
+// stbi_image_free.
+unsigned char* loadRgbaPixels(const char* path, int* width, int* height);
@@ -0,0 +1,381 @@
+#include "Program.h"
+#include "VertexLayout.h"
+#include "GLState.h"
+#include "ProgramCache.h"
+#include "Extensions.h"
+
+#include <GDT/File.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// Not part of the 3.3 core headers, the ARB extension uses the same value
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+namespace
+{
+    typedef void (APIENTRYP MaxShaderCompilerThreads)(GLuint count);
+
+    // Whether the driver can say a link is done without waiting for it.
+    // Checked once, asking for as many compiler threads as it likes.
+    bool parallelCompile()
+    {
+        static int supported = -1;
+        if (supported < 0) {
+            MaxShaderCompilerThreads maxThreads = 0;
+            if (hasExtension("GL_KHR_parallel_shader_compile"))
+                maxThreads = (MaxShaderCompilerThreads) getProcAddress("glMaxShaderCompilerThreadsKHR");
+            else if (hasExtension("GL_ARB_parallel_shader_compile"))
+                maxThreads = (MaxShaderCompilerThreads) getProcAddress("glMaxShaderCompilerThreadsARB");
+            if (maxThreads)
+                maxThreads(0xFFFFFFFF);
+            supported = maxThreads != 0;
+        }
+        return supported != 0;
+    }
+
+    GLenum glShaderType(ShaderType type)
+    {
+        switch (type) {
+        case VERTEX: return GL_VERTEX_SHADER;
+        case GEOMETRY: return GL_GEOMETRY_SHADER;
+        default: return GL_FRAGMENT_SHADER;
+        }
+    }
+
+    std::string shaderInfoLog(GLuint shader)
+    {
+        GLint length = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        std::vector<char> log(length + 1);
+        glGetShaderInfoLog(shader, length, 0, log.data());
+        return log.data();
+    }
+
+    std::string programInfoLog(GLuint program)
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        std::vector<char> log(length + 1);
+        glGetProgramInfoLog(program, length, 0, log.data());
+        return log.data();
+    }
+
+    class Attribute
+    {
+    public:
+        const char* name;
+        GLuint location;
+    };
+
+    // Attribute slots used by the vertex arrays in Model.cpp, InstanceSet.cpp,
+    // MultiDrawBatch.cpp and DebugDraw.cpp
+    const Attribute attributes[] = {
+        { "position", 0 },
+        { "normal", 1 },
+        { "texCoord", 2 },
+        { "instanceMatrix", INSTANCE_MATRIX_ATTRIBUTE },
+        { "instanceMaterial", INSTANCE_MATERIAL_ATTRIBUTE },
+        { "instanceIndex", INSTANCE_INDEX_ATTRIBUTE },
+        // Debug lines have no normals, see DebugDraw.cpp
+        { "color", 1 }
+    };
+
+    const GLenum intTypes[] = {
+        GL_INT, GL_BOOL,
+        GL_SAMPLER_2D, GL_SAMPLER_3D, GL_SAMPLER_CUBE, GL_SAMPLER_2D_SHADOW,
+        GL_SAMPLER_2D_ARRAY, GL_SAMPLER_2D_ARRAY_SHADOW, GL_SAMPLER_BUFFER,
+        GL_INT_SAMPLER_BUFFER, GL_UNSIGNED_INT_SAMPLER_BUFFER
+    };
+    const GLenum floatTypes[] = { GL_FLOAT };
+    const GLenum vec3Types[] = { GL_FLOAT_VEC3 };
+    const GLenum vec4Types[] = { GL_FLOAT_VEC4 };
+    const GLenum mat4Types[] = { GL_FLOAT_MAT4 };
+}
+
+Program::Program() :
+    _handle(0),
+    _pending(false),
+    _key(0)
+{
+
+}
+
+void Program::create()
+{
+    _handle = glCreateProgram();
+}
+
+void Program::addShader(ShaderType type, std::string path)
+{
+    addShader(type, path, "");
+}
+
+void Program::addShader(ShaderType type, std::string path, const std::string& defines)
+{
+    if (type == COMPUTE)
+        throw ShaderLoadingException("Compute shaders need OpenGL 4.3: " + path);
+
+    std::string source;
+    try {
+        source = loadFile(path);
+    }
+    catch (const FileNotFoundException& e) {
+        throw ShaderLoadingException(e);
+    }
+
+    // #version has to stay the first line, the defines go right after it
+    if (!defines.empty()) {
+        size_t version = source.find("#version");
+        size_t lineEnd = version == std::string::npos ? std::string::npos : source.find('\n', version);
+        if (lineEnd == std::string::npos)
+            throw ShaderLoadingException("No #version line to put defines after in " + path);
+
+        // Count the lines up to and including #version for the #line
+        int line = (int) std::count(source.begin(), source.begin() + lineEnd, '\n') + 2;
+        source.insert(lineEnd + 1, defines + "#line " + std::to_string(line) + "\n");
+    }
+
+    // Compiled in build(), which can skip it when the program is cached
+    ShaderSource shader;
+    shader.type = type;
+    shader.path = path;
+    shader.source = source;
+    _sources.push_back(shader);
+}
+
+void Program::submit()
+{
+    // The key covers the attribute slots as well, they're baked into the
+    // binary
+    std::vector<std::string> keySources;
+    std::string layout;
+    for (size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++)
+        layout += std::string(attributes[i].name) + " " + std::to_string(attributes[i].location) + "\n";
+    keySources.push_back(layout);
+    for (size_t i = 0; i < _sources.size(); i++)
+        keySources.push_back(std::to_string((int) _sources[i].type) + "\n" + _sources[i].source);
+
+    ProgramCache& cache = programCache();
+    _key = cache.key(keySources);
+    _pending = true;
+    if (cache.load(_handle, _key)) {
+        _sources.clear();
+        return;
+    }
+
+    // Statuses aren't asked for here, that would wait for the compiler
+    parallelCompile();
+    for (size_t i = 0; i < _sources.size(); i++) {
+        GLuint shader = glCreateShader(glShaderType(_sources[i].type));
+        const char* text = _sources[i].source.c_str();
+        glShaderSource(shader, 1, &text, 0);
+        glCompileShader(shader);
+        glAttachShader(_handle, shader);
+        _shaders.push_back(shader);
+    }
+
+    for (size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++)
+        glBindAttribLocation(_handle, attributes[i].location, attributes[i].name);
+
+    cache.prepare(_handle);
+    glLinkProgram(_handle);
+}
+
+bool Program::ready() const
+{
+    if (!_pending)
+        return true;
+
+    // Without the extension there's no way to tell, the status query in
+    // finish() waits. Programs submitted together still compile while the
+    // first of them is waited on.
+    if (!parallelCompile())
+        return true;
+
+    GLint done = 0;
+    glGetProgramiv(_handle, GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+
+bool Program::completionQuery()
+{
+    return parallelCompile();
+}
+
+void Program::build()
+{
+    submit();
+    finish();
+}
+
+void Program::finish()
+{
+    if (!_pending)
+        return;
+    _pending = false;
+
+    // Programs loaded from the cache have no shaders and are linked already
+    bool compiled = !_shaders.empty();
+
+    GLint linked = 0;
+    glGetProgramiv(_handle, GL_LINK_STATUS, &linked);
+    std::string error;
+    if (!linked) {
+        // A shader that didn't compile says more than the link log
+        for (size_t i = 0; i < _shaders.size() && error.empty(); i++) {
+            GLint shaderCompiled = 0;
+            glGetShaderiv(_shaders[i], GL_COMPILE_STATUS, &shaderCompiled);
+            if (!shaderCompiled)
+                error = "Failed to compile " + _sources[i].path + ":\n" + shaderInfoLog(_shaders[i]);
+        }
+        if (error.empty())
+            error = "Failed to link program:\n" + programInfoLog(_handle);
+    }
+
+    // The program keeps the compiled code, the shader objects can go
+    for (size_t i = 0; i < _shaders.size(); i++) {
+        glDetachShader(_handle, _shaders[i]);
+        glDeleteShader(_shaders[i]);
+    }
+    _shaders.clear();
+    _sources.clear();
+
+    if (!linked)
+        throw ShaderLoadingException(error);
+    if (compiled)
+        programCache().store(_handle, _key);
+
+    // Shared blocks always use the same binding point
+    for (int block = 0; block < UNIFORM_BLOCK_COUNT; block++) {
+        GLuint index = glGetUniformBlockIndex(_handle, uniformBlockName((UniformBlock) block));
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(_handle, index, block);
+    }
+
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(_handle, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(_handle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    std::vector<char> name(maxLength + 1);
+    _uniforms.clear();
+    for (GLint i = 0; i < count; i++) {
+        UniformInfo info;
+        glGetActiveUniform(_handle, i, maxLength, 0, &info.size, &info.type, name.data());
+
+        // Uniforms in blocks have no location
+        info.location = glGetUniformLocation(_handle, name.data());
+        if (info.location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]", look them up by the plain name
+        info.name = name.data();
+        size_t bracket = info.name.find('[');
+        if (bracket != std::string::npos)
+            info.name.erase(bracket);
+
+        _uniforms.push_back(info);
+    }
+
+    // Uniforms start out as zero after linking, but leave them unknown so
+    // the first set always goes through
+    GLint maxLocation = -1;
+    for (size_t i = 0; i < _uniforms.size(); i++)
+        maxLocation = std::max(maxLocation, _uniforms[i].location);
+    // Drivers can hand out sparse locations, don't shadow those
+    maxLocation = std::min(maxLocation, (GLint) 1023);
+    _shadow.assign((maxLocation + 1) * 16, 0);
+    _shadowValid.assign(maxLocation + 1, false);
+}
+
+void Program::bind() const
+{
+    useProgram(_handle);
+}
+
+void Program::release() const
+{
+    useProgram(0);
+}
+
+void Program::destroy()
+{
+    for (size_t i = 0; i < _shaders.size(); i++)
+        glDeleteShader(_shaders[i]);
+    _shaders.clear();
+    _sources.clear();
+    _pending = false;
+    _uniforms.clear();
+    _shadow.clear();
+    _shadowValid.clear();
+
+    deleteProgram(_handle);
+    _handle = 0;
+}
+
+GLint Program::location(const char* name, Uniform<int>) const
+{
+    return find(name, intTypes, sizeof(intTypes) / sizeof(intTypes[0]));
+}
+
+GLint Program::location(const char* name, Uniform<float>) const
+{
+    return find(name, floatTypes, 1);
+}
+
+GLint Program::location(const char* name, Uniform<Vector3f>) const
+{
+    return find(name, vec3Types, 1);
+}
+
+GLint Program::location(const char* name, Uniform<Vector4f>) const
+{
+    return find(name, vec4Types, 1);
+}
+
+GLint Program::location(const char* name, Uniform<Matrix4f>) const
+{
+    return find(name, mat4Types, 1);
+}
+
+GLint Program::find(const char* name, const GLenum* types, int typeCount) const
+{
+    for (size_t i = 0; i < _uniforms.size(); i++) {
+        const UniformInfo& info = _uniforms[i];
+        if (info.name != name)
+            continue;
+
+        for (int t = 0; t < typeCount; t++) {
+            if (info.type == types[t])
+                return info.location;
+        }
+        std::cerr << "Uniform " << name << " has a different type in the shader" << std::endl;
+        return -1;
+    }
+
+    // Unused uniforms are optimized out by the compiler, that's not an error
+    return -1;
+}
+
+bool Program::changed(GLint location, const void* value, int words) const
+{
+    // Missing uniforms would be ignored by GL anyway
+    if (location < 0)
+        return false;
+    if (location >= (GLint) _shadowValid.size())
+        return true;
+
+    unsigned int* shadow = &_shadow[location * 16];
+    if (_shadowValid[location] && memcmp(shadow, value, words * 4) == 0) {
+        glStateStats().uniforms.elided++;
+        return false;
+    }
+
+    memcpy(shadow, value, words * 4);
+    _shadowValid[location] = true;
+    glStateStats().uniforms.issued++;
+    return true;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+#include <GDT/Shader.h>
+#include <GDT/Vector3f.h>
+#include <GDT/Vector4f.h>
+#include <GDT/Matrix4f.h>
+
+#include <cstdint>
+#include <vector>
+#include <string>
+
+// Location of a uniform, resolved once after linking. The type parameter is
+// the C++ type that gets uploaded; samplers and bools use int. Handles to
+// uniforms the program doesn't have are -1, which GL silently ignores.
+template <typename T>
+class Uniform
+{
+public:
+    Uniform() : location(-1) { }
+    explicit Uniform(GLint location) : location(location) { }
+
+    GLint location;
+};
+
+// Shader program with its uniforms reflected at link time. Unlike GDT's
+// ShaderProgram, setting a uniform goes through a handle, so it doesn't
+// build a string or look anything up per call.
+class Program
+{
+public:
+    Program();
+
+    void create();
+    void addShader(ShaderType type, std::string path);
+
+    // Adds the shader with defines, one "#define NAME" line each,
+    // inserted after the #version line. Line numbers in errors still
+    // match the file.
+    void addShader(ShaderType type, std::string path, const std::string& defines);
+
+    // Compiles and links the shaders, or loads the program from the
+    // programCache() when it has a binary for these sources, and reflects
+    // the uniforms. Throws a ShaderLoadingException with the info log on
+    // failure. Same as submit() followed by finish().
+    void build();
+
+    // Hands the shaders to the driver without waiting for them. With
+    // KHR_parallel_shader_compile they compile on the driver's threads,
+    // otherwise drivers that compile lazily still overlap programs that
+    // are all submitted before any is finished.
+    void submit();
+
+    // Whether finish() can run without waiting for the compiler. Always
+    // true without KHR_parallel_shader_compile.
+    bool ready() const;
+
+    // Whether ready() can tell, which needs KHR_parallel_shader_compile
+    static bool completionQuery();
+
+    // Waits for the link if it isn't done and reflects the uniforms.
+    // Throws like build().
+    void finish();
+
+    // Submitted and not finished
+    bool pending() const { return _pending; }
+
+    void bind() const;
+    void release() const;
+    void destroy();
+
+    GLuint handle() const { return _handle; }
+
+    // Looks up a uniform by name, checking it against the handle's type.
+    // Call this once after build and keep the result.
+    template <typename T>
+    Uniform<T> uniform(const char* name) const
+    {
+        return Uniform<T>(location(name, Uniform<T>()));
+    }
+
+    // These upload to the program, which must be bound. Values are
+    // shadowed per program, setting a uniform to the value it already has
+    // doesn't reach GL.
+    void set(Uniform<int> uniform, int value) const
+    {
+        if (changed(uniform.location, &value, 1))
+            glUniform1i(uniform.location, value);
+    }
+    void set(Uniform<float> uniform, float value) const
+    {
+        if (changed(uniform.location, &value, 1))
+            glUniform1f(uniform.location, value);
+    }
+    void set(Uniform<Vector3f> uniform, const Vector3f& v) const
+    {
+        float values[3] = { v.x, v.y, v.z };
+        if (changed(uniform.location, values, 3))
+            glUniform3fv(uniform.location, 1, values);
+    }
+    void set(Uniform<Vector4f> uniform, const Vector4f& v) const
+    {
+        float values[4] = { v.x, v.y, v.z, v.w };
+        if (changed(uniform.location, values, 4))
+            glUniform4fv(uniform.location, 1, values);
+    }
+    void set(Uniform<Matrix4f> uniform, const Matrix4f& m) const
+    {
+        const float* values = m.toArray();
+        if (changed(uniform.location, values, 16))
+            glUniformMatrix4fv(uniform.location, 1, GL_FALSE, values);
+    }
+
+private:
+    class ShaderSource
+    {
+    public:
+        ShaderType type;
+        std::string path;
+        std::string source;
+    };
+
+    class UniformInfo
+    {
+    public:
+        std::string name;
+        GLint location;
+        GLenum type;
+        GLint size;
+    };
+
+    GLint location(const char* name, Uniform<int>) const;
+    GLint location(const char* name, Uniform<float>) const;
+    GLint location(const char* name, Uniform<Vector3f>) const;
+    GLint location(const char* name, Uniform<Vector4f>) const;
+    GLint location(const char* name, Uniform<Matrix4f>) const;
+    GLint find(const char* name, const GLenum* types, int typeCount) const;
+
+    // Compares against and updates the shadow copy of a uniform
+    bool changed(GLint location, const void* value, int words) const;
+
+    GLuint _handle;
+    std::vector<ShaderSource> _sources;
+    std::vector<GLuint> _shaders;
+    bool _pending;
+    uint64_t _key;
+    std::vector<UniformInfo> _uniforms;
+
+    // Last value set per location, 16 words each, and whether it's known
+    mutable std::vector<unsigned int> _shadow;
+    mutable std::vector<bool> _shadowValid;
+};
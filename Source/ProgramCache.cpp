@@ -0,0 +1,198 @@
+#include "ProgramCache.h"
+#include "Extensions.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Not part of the 3.3 core headers
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+namespace
+{
+    // Bump when the file layout changes
+    const uint32_t CACHE_MAGIC = 0x4E494250; // "PBIN"
+    const uint32_t CACHE_VERSION = 1;
+
+    // Written as is, the files never leave the machine that made them
+    class CacheHeader
+    {
+    public:
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint32_t format;
+        uint32_t length;
+    };
+
+    // FNV-1a, 64 bit
+    uint64_t hash(uint64_t h, const std::string& text)
+    {
+        for (size_t i = 0; i < text.size(); i++) {
+            h ^= (unsigned char) text[i];
+            h *= 1099511628211ull;
+        }
+        // Separator, so "ab" + "c" and "a" + "bc" differ
+        h ^= 0xFF;
+        h *= 1099511628211ull;
+        return h;
+    }
+
+    std::string glString(GLenum name)
+    {
+        const GLubyte* value = glGetString(name);
+        return value ? (const char*) value : "";
+    }
+
+    void makeDirectory(const std::string& path)
+    {
+        // Fails harmlessly if it's already there
+#ifdef _WIN32
+        _mkdir(path.c_str());
+#else
+        mkdir(path.c_str(), 0755);
+#endif
+    }
+
+    ProgramCache cache;
+}
+
+ProgramCache::ProgramCache() :
+    _writable(true),
+    _getProgramBinary(0),
+    _programBinary(0),
+    _programParameteri(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void ProgramCache::create(const std::string& directory)
+{
+    if (!hasGLVersion(4, 1) && !hasExtension("GL_ARB_get_program_binary"))
+        return;
+
+    // Drivers may support the calls but offer no format to save in
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats <= 0)
+        return;
+
+    _getProgramBinary = (GetProgramBinary) getProcAddress("glGetProgramBinary");
+    _programBinary = (ProgramBinary) getProcAddress("glProgramBinary");
+    _programParameteri = (ProgramParameteri) getProcAddress("glProgramParameteri");
+    if (!_getProgramBinary || !_programBinary || !_programParameteri) {
+        _programBinary = 0;
+        return;
+    }
+
+    _directory = directory;
+    _driver = glString(GL_VENDOR) + "\n" + glString(GL_RENDERER) + "\n" + glString(GL_VERSION);
+    makeDirectory(_directory);
+}
+
+uint64_t ProgramCache::key(const std::vector<std::string>& sources) const
+{
+    uint64_t h = hash(14695981039346656037ull, _driver);
+    for (size_t i = 0; i < sources.size(); i++)
+        h = hash(h, sources[i]);
+    return h;
+}
+
+std::string ProgramCache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) key);
+    return _directory + "/" + name;
+}
+
+bool ProgramCache::load(GLuint program, uint64_t key)
+{
+    if (!enabled())
+        return false;
+
+    std::ifstream ifs(path(key).c_str(), std::ios::binary);
+    CacheHeader header;
+    if (!ifs.is_open() || !ifs.read((char*) &header, sizeof(header)) ||
+        header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.key != key) {
+        _stats.misses++;
+        return false;
+    }
+
+    std::vector<char> binary(header.length);
+    if (!ifs.read(binary.data(), binary.size())) {
+        _stats.misses++;
+        return false;
+    }
+
+    // Drivers are free to turn down binaries they made themselves, the
+    // link status says whether it took
+    _programBinary(program, header.format, binary.data(), (GLsizei) binary.size());
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        _stats.rejected++;
+        return false;
+    }
+
+    _stats.hits++;
+    return true;
+}
+
+void ProgramCache::prepare(GLuint program) const
+{
+    if (enabled())
+        _programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void ProgramCache::store(GLuint program, uint64_t key)
+{
+    if (!enabled() || !_writable)
+        return;
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    CacheHeader header;
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.format = 0;
+    header.length = 0;
+
+    std::vector<char> binary(length);
+    GLsizei written = 0;
+    _getProgramBinary(program, length, &written, &header.format, binary.data());
+    header.length = written;
+
+    std::ofstream ofs(path(key).c_str(), std::ios::binary);
+    if (!ofs.is_open()) {
+        // Once is enough, every program would fail the same way
+        std::cerr << "Failed to write to the program cache in " << _directory << ", binaries won't be kept" << std::endl;
+        _writable = false;
+        return;
+    }
+    ofs.write((const char*) &header, sizeof(header));
+    ofs.write(binary.data(), written);
+}
+
+ProgramCache& programCache()
+{
+    return cache;
+}
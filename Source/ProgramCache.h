@@ -0,0 +1,71 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ProgramCacheStats
+{
+public:
+    int hits;
+    int misses;
+    int rejected;
+};
+
+// Linked programs kept on disk as driver binaries, one file per program,
+// so later runs can skip compiling and linking GLSL. A program's key
+// covers its sources (with their defines) and the vendor, renderer and
+// version strings, so a driver update makes a new key instead of loading
+// a binary the driver may not take anymore.
+//
+// Needs GL 4.1 or ARB_get_program_binary, and a driver with at least one
+// binary format. Without those, or before create(), every load misses and
+// nothing is stored.
+class ProgramCache
+{
+public:
+    ProgramCache();
+
+    // Makes the directory if it isn't there. Needs a current context.
+    void create(const std::string& directory);
+
+    bool enabled() const { return _programBinary != 0; }
+
+    // sources are the full shader texts in attach order
+    uint64_t key(const std::vector<std::string>& sources) const;
+
+    // Replaces the program with the binary stored under key. False if
+    // there is none, or if the driver rejected it, in which case the
+    // program has to be compiled and linked from source.
+    bool load(GLuint program, uint64_t key);
+
+    // Asks the driver to keep the binary around, call before linking
+    void prepare(GLuint program) const;
+
+    // Writes the binary of a linked program under key
+    void store(GLuint program, uint64_t key);
+
+    const ProgramCacheStats& stats() const { return _stats; }
+
+private:
+    typedef void (APIENTRYP GetProgramBinary)(GLuint program, GLsizei bufSize, GLsizei* length, GLenum* binaryFormat, void* binary);
+    typedef void (APIENTRYP ProgramBinary)(GLuint program, GLenum binaryFormat, const void* binary, GLsizei length);
+    typedef void (APIENTRYP ProgramParameteri)(GLuint program, GLenum pname, GLint value);
+
+    std::string path(uint64_t key) const;
+
+    std::string _directory;
+    std::string _driver;
+    bool _writable;
+
+    GetProgramBinary _getProgramBinary;
+    ProgramBinary _programBinary;
+    ProgramParameteri _programParameteri;
+
+    ProgramCacheStats _stats;
+};
+
+// The cache Program::build() goes through
+ProgramCache& programCache();
@@ -0,0 +1,394 @@
+#include "RenderQueue.h"
+#include "GLState.h"
+#include "DeletionQueue.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+    // Positive floats compare the same as their bit patterns
+    uint32_t depthBits(float depth)
+    {
+        if (!(depth > 0))
+            return 0;
+        uint32_t bits;
+        memcpy(&bits, &depth, 4);
+        return bits;
+    }
+
+    const unsigned int PROGRAM_BITS = 8;
+    const unsigned int TEXTURE_BITS = 10;
+    const unsigned int MESH_BITS = 12;
+
+    // Instance attributes of the bound vertex array read the instance
+    // buffer, pointed at each run's range in flush()
+    void enableInstanceAttributes()
+    {
+        for (GLuint column = 0; column < 4; column++) {
+            glVertexAttribDivisor(INSTANCE_MATRIX_ATTRIBUTE + column, 1);
+            glEnableVertexAttribArray(INSTANCE_MATRIX_ATTRIBUTE + column);
+        }
+        glVertexAttribDivisor(INSTANCE_MATERIAL_ATTRIBUTE, 1);
+        glEnableVertexAttribArray(INSTANCE_MATERIAL_ATTRIBUTE);
+    }
+}
+
+RenderQueue::RenderQueue() :
+    _stream(0),
+    _instanceBuffer(0),
+    _instanceCapacity(0),
+    _depthProgram(0),
+    _nextQuery(0),
+    _shadedSamples(0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    memset(_sampleQueries, 0, sizeof(_sampleQueries));
+    memset(_queryPending, 0, sizeof(_queryPending));
+}
+
+void RenderQueue::create(StreamBuffer& stream)
+{
+    _stream = &stream;
+    _instanceCapacity = 1024;
+    glGenBuffers(1, &_instanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * sizeof(InstanceData), 0, GL_STREAM_DRAW);
+    glGenQueries(2, _sampleQueries);
+
+    // Texture 0 is untextured
+    _textures[0] = 0;
+}
+
+void RenderQueue::destroy()
+{
+    for (size_t i = 0; i < _meshes.size(); i++) {
+        deleteVertexArrays(1, &_meshes[i].vao);
+        deleteVertexArrays(1, &_meshes[i].depthVao);
+    }
+    glDeleteBuffers(1, &_instanceBuffer);
+    _instanceBuffer = 0;
+    _stream = 0;
+    glDeleteQueries(2, _sampleQueries);
+    memset(_sampleQueries, 0, sizeof(_sampleQueries));
+    memset(_queryPending, 0, sizeof(_queryPending));
+
+    _meshes.clear();
+    _meshIds.clear();
+    _freeMeshIds.clear();
+    _programs.clear();
+    _textures.clear();
+}
+
+unsigned int RenderQueue::programId(const Program& program)
+{
+    for (size_t i = 0; i < _programs.size(); i++) {
+        if (_programs[i].program == &program)
+            return (unsigned int) i;
+    }
+
+    if (_programs.size() == 1u << PROGRAM_BITS) {
+        std::cerr << "Too many programs in the render queue" << std::endl;
+        exit(1);
+    }
+
+    ProgramInfo info;
+    info.program = &program;
+    _programs.push_back(info);
+    return (unsigned int) _programs.size() - 1;
+}
+
+unsigned int RenderQueue::textureId(GLuint texture)
+{
+    std::map<GLuint, unsigned int>::iterator it = _textures.find(texture);
+    if (it != _textures.end())
+        return it->second;
+
+    if (_textures.size() == 1u << TEXTURE_BITS) {
+        std::cerr << "Too many textures in the render queue" << std::endl;
+        exit(1);
+    }
+
+    unsigned int id = (unsigned int) _textures.size();
+    _textures[texture] = id;
+    return id;
+}
+
+unsigned int RenderQueue::meshId(const Model& mesh)
+{
+    std::map<const Model*, unsigned int>::iterator it = _meshIds.find(&mesh);
+    if (it != _meshIds.end())
+        return it->second;
+
+    if (_freeMeshIds.empty() && _meshes.size() == 1u << MESH_BITS) {
+        std::cerr << "Too many meshes in the render queue" << std::endl;
+        exit(1);
+    }
+
+    // A vertex array per mesh that also reads the shared instance buffer.
+    // The instance attributes are pointed at each run's range in flush().
+    MeshInfo info;
+    info.indexCount = (GLsizei) mesh.indices.size();
+
+    glGenVertexArrays(1, &info.vao);
+    bindVertexArray(info.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.nbo);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(1);
+    if (mesh.tbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.tbo);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(2);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+    enableInstanceAttributes();
+
+    // The same for the position-only stream of the depth pass
+    info.depthIndexCount = (GLsizei) mesh.depthIndices.size();
+    glGenVertexArrays(1, &info.depthVao);
+    bindVertexArray(info.depthVao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.depthVbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.depthEbo);
+    enableInstanceAttributes();
+    bindVertexArray(0);
+
+    unsigned int id = (unsigned int) _meshes.size();
+    if (_freeMeshIds.empty())
+        _meshes.push_back(info);
+    else {
+        id = _freeMeshIds.back();
+        _freeMeshIds.pop_back();
+        _meshes[id] = info;
+    }
+    _meshIds[&mesh] = id;
+    return id;
+}
+
+void RenderQueue::forget(const Model& mesh)
+{
+    std::map<const Model*, unsigned int>::iterator it = _meshIds.find(&mesh);
+    if (it == _meshIds.end())
+        return;
+
+    // Earlier frames may still be drawing with them
+    MeshInfo& info = _meshes[it->second];
+    GLuint vertexArrays[] = { info.vao, info.depthVao };
+    deletionQueue().deleteVertexArrays(2, vertexArrays);
+    info.vao = info.depthVao = 0;
+
+    _freeMeshIds.push_back(it->second);
+    _meshIds.erase(it);
+}
+
+void RenderQueue::submit(const Program& program, const Model& mesh, const Material& material, const Matrix4f& modelMatrix, float depth, RenderPass pass)
+{
+    InstanceData instance;
+    instance.modelMatrix = modelMatrix;
+    instance.materialIndex = material.index;
+
+    add(program, mesh, mesh.tbo ? material.colorMap.array : 0, instance, depth, pass);
+    if (pass == PASS_OPAQUE && _depthProgram)
+        add(*_depthProgram, mesh, 0, instance, depth, PASS_DEPTH);
+}
+
+void RenderQueue::add(const Program& program, const Model& mesh, GLuint texture, const InstanceData& instance, float depth, RenderPass pass)
+{
+    DrawItem item;
+    item.program = &program;
+    item.mesh = &mesh;
+    item.texture = texture;
+    item.programId = programId(program);
+    item.meshId = meshId(mesh);
+
+    uint64_t state = ((uint64_t) item.programId << (TEXTURE_BITS + MESH_BITS))
+                   | ((uint64_t) textureId(item.texture) << MESH_BITS)
+                   | item.meshId;
+
+    Packet packet;
+    packet.index = (unsigned int) _items.size();
+    if (pass == PASS_TRANSPARENT)
+        packet.key = ((uint64_t) pass << 62) | ((uint64_t) ~depthBits(depth) << 30) | state;
+    else
+        packet.key = ((uint64_t) pass << 62) | (state << 32) | depthBits(depth);
+    _packets.push_back(packet);
+    _items.push_back(item);
+    _instances.push_back(instance);
+}
+
+void RenderQueue::sort()
+{
+    // LSD radix sort, a byte per pass. Bytes that are the same in every key
+    // are skipped, which is most of them in a typical frame.
+    _sortBuffer.resize(_packets.size());
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = { 0 };
+        for (size_t i = 0; i < _packets.size(); i++)
+            counts[(_packets[i].key >> shift) & 0xFF]++;
+
+        if (counts[(_packets[0].key >> shift) & 0xFF] == _packets.size())
+            continue;
+
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t count = counts[b];
+            counts[b] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < _packets.size(); i++)
+            _sortBuffer[counts[(_packets[i].key >> shift) & 0xFF]++] = _packets[i];
+        _packets.swap(_sortBuffer);
+    }
+}
+
+void RenderQueue::beginPass(RenderPass pass, bool prepassed)
+{
+    colorMask(pass != PASS_DEPTH);
+    if (pass == PASS_OPAQUE && prepassed) {
+        // Depth is final already, shade only what ended up in front
+        depthFunc(GL_EQUAL);
+        depthMask(false);
+    }
+    else {
+        depthFunc(GL_LESS);
+        depthMask(true);
+    }
+}
+
+void RenderQueue::readSampleQuery()
+{
+    // The query about to be reused was issued two flushes ago, if it's
+    // still not done this flush goes unmeasured instead of waiting
+    if (!_queryPending[_nextQuery])
+        return;
+
+    GLuint available = 0;
+    glGetQueryObjectuiv(_sampleQueries[_nextQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+        glGetQueryObjectuiv(_sampleQueries[_nextQuery], GL_QUERY_RESULT, &_shadedSamples);
+        _queryPending[_nextQuery] = false;
+    }
+}
+
+void RenderQueue::flush()
+{
+    readSampleQuery();
+
+    memset(&_stats, 0, sizeof(_stats));
+    _stats.packets = (int) _packets.size();
+    _stats.shadedSamples = _shadedSamples;
+    if (_packets.empty())
+        return;
+
+    sort();
+    bool prepassed = _packets[0].key >> 62 == PASS_DEPTH;
+    bool measuring = false;
+
+    // Instance data in draw order, so every run is one contiguous range.
+    // Aligned to whole instances like the queue's own buffer.
+    size_t instanceBytes = _packets.size() * sizeof(InstanceData);
+    StreamAllocation allocation = _stream->allocate(instanceBytes, sizeof(InstanceData));
+    GLuint instanceBuffer = _stream->handle();
+    GLintptr instanceOffset = allocation.offset;
+    if (allocation.size > 0) {
+        for (size_t i = 0; i < _packets.size(); i++)
+            memcpy(allocation.data + i * sizeof(InstanceData), &_instances[_packets[i].index], sizeof(InstanceData));
+        _stream->commit(allocation);
+    }
+    else {
+        _sortedInstances.resize(_packets.size());
+        for (size_t i = 0; i < _packets.size(); i++)
+            _sortedInstances[i] = _instances[_packets[i].index];
+
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+        while (_instanceCapacity < _sortedInstances.size())
+            _instanceCapacity *= 2;
+        // Orphan last frame's data instead of waiting for the GPU to finish with it
+        glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * sizeof(InstanceData), 0, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instanceBytes, _sortedInstances.data());
+        instanceBuffer = _instanceBuffer;
+        instanceOffset = 0;
+    }
+    // Attribute pointers capture the buffer bound here
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+
+    const Program* boundProgram = 0;
+    GLuint boundTexture = 0;
+    GLuint boundVao = 0;
+    uint64_t boundPass = ~(uint64_t) 0;
+
+    size_t first = 0;
+    while (first < _packets.size()) {
+        const DrawItem& item = _items[_packets[first].index];
+        uint64_t pass = _packets[first].key >> 62;
+
+        // Extend the run while nothing but the instance data changes
+        size_t last = first + 1;
+        while (last < _packets.size()) {
+            const DrawItem& next = _items[_packets[last].index];
+            if (_packets[last].key >> 62 != pass || next.program != item.program || next.texture != item.texture || next.mesh != item.mesh)
+                break;
+            last++;
+        }
+
+        const MeshInfo& mesh = _meshes[item.meshId];
+        GLuint vao = pass == PASS_DEPTH ? mesh.depthVao : mesh.vao;
+
+        if (pass != boundPass) {
+            if (pass != PASS_DEPTH && !measuring && !_queryPending[_nextQuery]) {
+                glBeginQuery(GL_SAMPLES_PASSED, _sampleQueries[_nextQuery]);
+                measuring = true;
+            }
+            beginPass((RenderPass) pass, prepassed);
+            boundPass = pass;
+        }
+
+        if (item.program != boundProgram) {
+            item.program->bind();
+            boundProgram = item.program;
+            _stats.programChanges++;
+        }
+        if (item.texture != boundTexture) {
+            activeTexture(0);
+            bindTexture(GL_TEXTURE_2D_ARRAY, item.texture);
+            boundTexture = item.texture;
+            _stats.textureChanges++;
+        }
+        if (vao != boundVao) {
+            bindVertexArray(vao);
+            boundVao = vao;
+            _stats.meshChanges++;
+        }
+
+        // Point the instance attributes at this run's range
+        size_t offset = instanceOffset + first * sizeof(InstanceData);
+        for (GLuint column = 0; column < 4; column++) {
+            glVertexAttribPointer(INSTANCE_MATRIX_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                                  (void*) (offset + column * 4 * sizeof(float)));
+        }
+        glVertexAttribIPointer(INSTANCE_MATERIAL_ATTRIBUTE, 1, GL_INT, sizeof(InstanceData), (void*) (offset + sizeof(Matrix4f)));
+
+        GLsizei indexCount = pass == PASS_DEPTH ? mesh.depthIndexCount : mesh.indexCount;
+        glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, 0, (GLsizei) (last - first));
+        _stats.draws++;
+
+        first = last;
+    }
+
+    bindVertexArray(0);
+    beginPass(PASS_OVERLAY, false);
+
+    if (measuring) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        _queryPending[_nextQuery] = true;
+        _nextQuery ^= 1;
+    }
+
+    _packets.clear();
+    _items.clear();
+    _instances.clear();
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "Program.h"
+#include "Model.h"
+#include "Material.h"
+#include "InstanceSet.h"
+#include "StreamBuffer.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// Passes are drawn in this order
+enum RenderPass
+{
+    PASS_DEPTH,
+    PASS_OPAQUE,
+    PASS_TRANSPARENT,
+    PASS_OVERLAY
+};
+
+// State changes made by the last flush
+class RenderStats
+{
+public:
+    int packets;
+    int draws;
+    int programChanges;
+    int textureChanges;
+    int meshChanges;
+
+    // Samples that passed the depth test outside the depth pass, so
+    // roughly the fragments shaded. From an earlier flush, queries are
+    // read back late so they never stall.
+    GLuint shadedSamples;
+};
+
+// Collects draws during a frame and issues them sorted by state. Each
+// packet gets a 64-bit key:
+//
+//   pass (2) | program (8) | texture array (10) | mesh (12) | depth (32)
+//
+// so sorting the keys groups packets by the state they need, most
+// expensive change first, and front to back within a group. Transparent
+// packets put depth right after the pass instead, reversed, so they're
+// drawn back to front.
+//
+// Consecutive packets with the same program, texture and mesh become one
+// instanced draw. Material constants come from the MaterialData block and
+// are selected per instance, so they don't split runs. Programs used with
+// the queue must read the instance attributes of InstanceSet.
+//
+// With a depth pre-pass every opaque packet is also drawn in the depth
+// pass, with the pre-pass program and the mesh's position-only stream.
+// The opaque pass then tests GL_EQUAL without writing depth, so only the
+// nearest fragment of each pixel is shaded. The pre-pass program has to
+// compute gl_Position exactly like the opaque ones, declare it invariant
+// in both.
+//
+// Each flush writes its instance data into the frame's region of a
+// StreamBuffer, so flush() has to run between its beginFrame() and
+// endFrame(). If the region is full the data goes into a buffer of the
+// queue's own, orphaned every flush.
+class RenderQueue
+{
+public:
+    RenderQueue();
+
+    void create(StreamBuffer& stream);
+    void destroy();
+
+    // Frees the vertex arrays made for the mesh, call before unloading it
+    // and while none of its packets are waiting for a flush
+    void forget(const Model& mesh);
+
+    // Depth is the distance to the camera
+    void submit(const Program& program, const Model& mesh, const Material& material, const Matrix4f& modelMatrix, float depth, RenderPass pass = PASS_OPAQUE);
+
+    // Program for the depth pre-pass, 0 turns it off. Applies to packets
+    // submitted after the call.
+    void setDepthPrepass(const Program* program) { _depthProgram = program; }
+    bool depthPrepass() const { return _depthProgram != 0; }
+
+    // Sorts and draws everything submitted since the last flush. Leaves
+    // depth testing with GL_LESS and depth and color writes on.
+    void flush();
+
+    const RenderStats& stats() const { return _stats; }
+
+private:
+    class Packet
+    {
+    public:
+        uint64_t key;
+        unsigned int index;
+    };
+
+    // What a packet draws, the key only holds ids
+    class DrawItem
+    {
+    public:
+        const Program* program;
+        const Model* mesh;
+        GLuint texture;
+        unsigned int programId, meshId;
+    };
+
+    class ProgramInfo
+    {
+    public:
+        const Program* program;
+    };
+
+    class MeshInfo
+    {
+    public:
+        GLuint vao;
+        GLsizei indexCount;
+
+        // The position-only stream with the same instance attributes
+        GLuint depthVao;
+        GLsizei depthIndexCount;
+    };
+
+    unsigned int programId(const Program& program);
+    unsigned int textureId(GLuint texture);
+    unsigned int meshId(const Model& mesh);
+
+    void add(const Program& program, const Model& mesh, GLuint texture, const InstanceData& instance, float depth, RenderPass pass);
+
+    void sort();
+    void beginPass(RenderPass pass, bool prepassed);
+    void readSampleQuery();
+
+    std::vector<Packet> _packets;
+    std::vector<Packet> _sortBuffer;
+    std::vector<DrawItem> _items;
+    std::vector<InstanceData> _instances;
+    std::vector<InstanceData> _sortedInstances;
+
+    std::vector<ProgramInfo> _programs;
+    std::map<GLuint, unsigned int> _textures;
+    std::map<const Model*, unsigned int> _meshIds;
+    std::vector<MeshInfo> _meshes;
+    // Ids of forgotten meshes, handed out again first
+    std::vector<unsigned int> _freeMeshIds;
+
+    StreamBuffer* _stream;
+    GLuint _instanceBuffer;
+    size_t _instanceCapacity;
+
+    const Program* _depthProgram;
+
+    // GL_SAMPLES_PASSED queries used in turn, and whether each has a
+    // result coming
+    GLuint _sampleQueries[2];
+    bool _queryPending[2];
+    int _nextQuery;
+    GLuint _shadedSamples;
+
+    RenderStats _stats;
+};
@@ -0,0 +1,152 @@
+#include "ShaderVariants.h"
+
+#include <iostream>
+
+const char* shaderFeatureName(ShaderFeature feature)
+{
+    switch (feature) {
+    case FEATURE_TEXTURED: return "TEXTURED";
+    case FEATURE_SHADOWED: return "SHADOWED";
+    case FEATURE_POINT_LIGHTS: return "POINT_LIGHTS";
+    case FEATURE_INSTANCED: return "INSTANCED";
+    default: return "INDIRECT";
+    }
+}
+
+std::string shaderDefines(unsigned int features)
+{
+    std::string defines;
+    for (int i = 0; i < SHADER_FEATURE_COUNT; i++) {
+        if (features & (1u << i))
+            defines += std::string("#define ") + shaderFeatureName((ShaderFeature) (1u << i)) + "\n";
+    }
+    return defines;
+}
+
+const int ShaderVariants::FINISH_FRAMES;
+
+ShaderVariants::ShaderVariants() :
+    _frame(0)
+{
+
+}
+
+void ShaderVariants::create(const std::string& vertexPath, const std::string& fragmentPath, const std::function<void(Program&)>& setup)
+{
+    _vertexPath = vertexPath;
+    _fragmentPath = fragmentPath;
+    _setup = setup;
+}
+
+void ShaderVariants::destroy()
+{
+    for (std::map<unsigned int, Program>::iterator it = _variants.begin(); it != _variants.end(); ++it)
+        it->second.destroy();
+    _variants.clear();
+    _failed.clear();
+    _submitted.clear();
+}
+
+Program& ShaderVariants::submit(unsigned int features)
+{
+    std::map<unsigned int, Program>::iterator it = _variants.find(features);
+    if (it != _variants.end())
+        return it->second;
+
+    std::string defines = shaderDefines(features);
+    Program program;
+    program.create();
+    try {
+        program.addShader(VERTEX, _vertexPath, defines);
+        program.addShader(FRAGMENT, _fragmentPath, defines);
+        program.submit();
+    }
+    catch (const ShaderLoadingException&) {
+        program.destroy();
+        throw;
+    }
+    _submitted[features] = _frame;
+    return _variants[features] = program;
+}
+
+Program& ShaderVariants::finish(unsigned int features)
+{
+    Program& variant = _variants[features];
+    if (!variant.pending())
+        return variant;
+    _submitted.erase(features);
+
+    // Failed variants aren't kept, asking again builds them again
+    try {
+        variant.finish();
+    }
+    catch (const ShaderLoadingException&) {
+        variant.destroy();
+        _variants.erase(features);
+        throw;
+    }
+
+    if (_setup) {
+        variant.bind();
+        _setup(variant);
+    }
+    return variant;
+}
+
+bool ShaderVariants::ready(unsigned int features) const
+{
+    const Program& variant = _variants.find(features)->second;
+    if (!variant.pending())
+        return true;
+
+    // Never on the frame it was submitted in, finish() would wait for the
+    // whole compile
+    int age = _frame - _submitted.find(features)->second;
+    if (age == 0)
+        return false;
+    return Program::completionQuery() ? variant.ready() : age >= FINISH_FRAMES;
+}
+
+const Program& ShaderVariants::get(unsigned int features)
+{
+    submit(features);
+    return finish(features);
+}
+
+const Program& ShaderVariants::get(unsigned int features, unsigned int fallback)
+{
+    if (_failed.count(features) == 0) {
+        try {
+            submit(features);
+            if (ready(features))
+                return finish(features);
+        }
+        catch (const ShaderLoadingException& e) {
+            std::cerr << e.what() << std::endl;
+            _failed.insert(features);
+        }
+    }
+    return get(fallback);
+}
+
+void ShaderVariants::warm(unsigned int features)
+{
+    submit(features);
+}
+
+void ShaderVariants::finishAll()
+{
+    std::map<unsigned int, Program>::iterator it = _variants.begin();
+    while (it != _variants.end())
+        finish((it++)->first);
+}
+
+size_t ShaderVariants::pendingCount() const
+{
+    size_t count = 0;
+    for (std::map<unsigned int, Program>::const_iterator it = _variants.begin(); it != _variants.end(); ++it) {
+        if (it->second.pending())
+            count++;
+    }
+    return count;
+}
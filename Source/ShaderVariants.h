@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Program.h"
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+
+// Features a shader source can be specialized for. Each one is a #define
+// with the name shaderFeatureName() gives it, see blinnphong.vert.
+enum ShaderFeature
+{
+    FEATURE_TEXTURED = 1 << 0,
+    FEATURE_SHADOWED = 1 << 1,
+    FEATURE_POINT_LIGHTS = 1 << 2,
+    FEATURE_INSTANCED = 1 << 3,
+    FEATURE_INDIRECT = 1 << 4
+};
+
+const int SHADER_FEATURE_COUNT = 5;
+
+const char* shaderFeatureName(ShaderFeature feature);
+
+// The #define lines for a set of features
+std::string shaderDefines(unsigned int features);
+
+// Programs built from one vertex and fragment source, one per set of
+// features, so each only contains the code its draws need instead of
+// branching on uniforms. Variants are built the first time they're asked
+// for and kept until destroy().
+//
+// Building can wait for the compiler. Loading code warm()s every variant
+// it will draw with and then finishAll()s, so the driver compiles them
+// side by side; the frame loop can use get() with a fallback, which draws
+// with a ready variant while the one it wants is still compiling.
+//
+// Without KHR_parallel_shader_compile there's no asking whether a link is
+// done, so a variant submitted by get() with a fallback is only finished
+// FINISH_FRAMES frames later, giving the driver those frames to compile it
+// before the status query waits.
+class ShaderVariants
+{
+public:
+    static const int FINISH_FRAMES = 3;
+
+    ShaderVariants();
+
+    // setup is called on every new variant, bound, for the uniforms that
+    // are set once like sampler units
+    void create(const std::string& vertexPath, const std::string& fragmentPath, const std::function<void(Program&)>& setup);
+    void destroy();
+
+    // Throws a ShaderLoadingException if the variant doesn't build
+    const Program& get(unsigned int features);
+
+    // The variant if it's ready, otherwise the fallback variant, which
+    // should have been warmed up. Starts building the variant if it isn't
+    // yet. Variants that fail to build are reported once and fall back
+    // from then on.
+    const Program& get(unsigned int features, unsigned int fallback);
+
+    // Starts building the variant without waiting for it
+    void warm(unsigned int features);
+
+    // Counts the frames variants have been compiling for. Call once per
+    // frame.
+    void nextFrame() { _frame++; }
+
+    // Waits for every warmed variant. Throws a ShaderLoadingException for
+    // the first that doesn't build.
+    void finishAll();
+
+    size_t variantCount() const { return _variants.size(); }
+
+    // Variants still compiling
+    size_t pendingCount() const;
+
+private:
+    Program& submit(unsigned int features);
+    Program& finish(unsigned int features);
+    bool ready(unsigned int features) const;
+
+    std::string _vertexPath;
+    std::string _fragmentPath;
+    std::function<void(Program&)> _setup;
+
+    // Map nodes don't move, so programs can be referenced while others
+    // are added
+    std::map<unsigned int, Program> _variants;
+    std::set<unsigned int> _failed;
+
+    // Frame each pending variant was submitted in
+    std::map<unsigned int, int> _submitted;
+    int _frame;
+};
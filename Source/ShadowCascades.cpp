@@ -0,0 +1,373 @@
+#include "ShadowCascades.h"
+#include "GLState.h"
+#include "DeletionQueue.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+ShadowCascades::ShadowCascades() :
+    shadowDistance(50.0f),
+    splitLambda(0.75f),
+    casterDistance(50.0f),
+    _program(0),
+    _stream(0),
+    _size(0),
+    _cascadeCount(0),
+    _firstCachedCascade(0),
+    _texture(0),
+    _staticTexture(0),
+    _instanceBuffer(0),
+    _instanceCapacity(0),
+    _lightDirection(0, 0, 0)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    for (int i = 0; i < MAX_CASCADES; i++)
+        _cascades[i].cacheValid = false;
+}
+
+void ShadowCascades::create(const Program& program, StreamBuffer& stream, int size, int cascadeCount, int firstCachedCascade)
+{
+    _program = &program;
+    _stream = &stream;
+    _shadowMatrix = program.uniform<Matrix4f>("shadowMatrix");
+
+    _size = size;
+    _cascadeCount = std::max(1, std::min(cascadeCount, MAX_CASCADES));
+    _firstCachedCascade = firstCachedCascade;
+
+    GLuint* textures[] = { &_texture, &_staticTexture };
+    GLuint* framebuffers[] = { _framebuffers, _staticFramebuffers };
+    for (int t = 0; t < 2; t++) {
+        glGenTextures(1, textures[t]);
+        bindTexture(GL_TEXTURE_2D_ARRAY, *textures[t]);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, _cascadeCount, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+
+        // Outside the map counts as lit
+        const float border[] = { 1, 1, 1, 1 };
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        glGenFramebuffers(_cascadeCount, framebuffers[t]);
+        for (int i = 0; i < _cascadeCount; i++) {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[t][i]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, *textures[t], 0, i);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cerr << "Shadow cascade framebuffer " << i << " is incomplete" << std::endl;
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    _buffer.create(SHADOW_BLOCK, sizeof(ShadowData));
+
+    _instanceCapacity = 1024;
+    glGenBuffers(1, &_instanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * sizeof(Matrix4f), 0, GL_STREAM_DRAW);
+}
+
+void ShadowCascades::destroy()
+{
+    GLuint textures[] = { _texture, _staticTexture };
+    deleteTextures(2, textures);
+    glDeleteFramebuffers(_cascadeCount, _framebuffers);
+    glDeleteFramebuffers(_cascadeCount, _staticFramebuffers);
+    _buffer.destroy();
+    for (std::map<const Model*, GLuint>::iterator it = _vertexArrays.begin(); it != _vertexArrays.end(); ++it)
+        deleteVertexArrays(1, &it->second);
+    _vertexArrays.clear();
+    glDeleteBuffers(1, &_instanceBuffer);
+
+    _texture = _staticTexture = _instanceBuffer = 0;
+    clearStaticCasters();
+}
+
+void ShadowCascades::addStaticCaster(const Model& model, const Matrix4f& modelMatrix)
+{
+    Caster caster;
+    caster.model = &model;
+    caster.modelMatrix = modelMatrix;
+    _staticCasters.push_back(caster);
+    _staticBounds.add(worldBounds(model, modelMatrix));
+
+    for (int i = 0; i < MAX_CASCADES; i++)
+        _cascades[i].cacheValid = false;
+}
+
+void ShadowCascades::clearStaticCasters()
+{
+    _staticCasters.clear();
+    _staticBounds.clear();
+    for (int i = 0; i < MAX_CASCADES; i++)
+        _cascades[i].cacheValid = false;
+}
+
+void ShadowCascades::addDynamicCaster(const Model& model, const Matrix4f& modelMatrix)
+{
+    Caster caster;
+    caster.model = &model;
+    caster.modelMatrix = modelMatrix;
+    _dynamicCasters.push_back(caster);
+    _dynamicBounds.add(worldBounds(model, modelMatrix));
+}
+
+void ShadowCascades::update(const Matrix4f& viewMatrix, const Matrix4f& projMatrix, float zNear, float zFar, Vector3f lightDirection)
+{
+    lightDirection.normalize();
+    if (lightDirection != _lightDirection) {
+        _lightDirection = lightDirection;
+        for (int i = 0; i < MAX_CASCADES; i++)
+            _cascades[i].cacheValid = false;
+
+        // Light space, looking along the light. Only the rotation, the
+        // cascades add their own origin.
+        Vector3f up = std::abs(lightDirection.y) > 0.99f ? Vector3f(1, 0, 0) : Vector3f(0, 1, 0);
+        Vector3f right = normalize(cross(lightDirection, up));
+        up = cross(right, lightDirection);
+        _lightView = Matrix4f();
+        _lightView[0] = right.x; _lightView[4] = right.y; _lightView[8] = right.z;
+        _lightView[1] = up.x; _lightView[5] = up.y; _lightView[9] = up.z;
+        _lightView[2] = -lightDirection.x; _lightView[6] = -lightDirection.y; _lightView[10] = -lightDirection.z;
+    }
+
+    // Corners of the view frustum on the near and far planes
+    Matrix4f inverseViewProjection = inverse(projMatrix * viewMatrix);
+    Vector3f nearCorners[4], farCorners[4];
+    for (int i = 0; i < 4; i++) {
+        float x = i & 1 ? 1.0f : -1.0f;
+        float y = i & 2 ? 1.0f : -1.0f;
+        Vector4f n = inverseViewProjection * Vector4f(x, y, -1, 1);
+        Vector4f f = inverseViewProjection * Vector4f(x, y, 1, 1);
+        nearCorners[i] = Vector3f(n.x / n.w, n.y / n.w, n.z / n.w);
+        farCorners[i] = Vector3f(f.x / f.w, f.y / f.w, f.z / f.w);
+    }
+
+    // View depth changes linearly along the frustum's edges, so a split
+    // distance is a fixed fraction of the way along each of them
+    float distance = std::min(zFar, shadowDistance);
+    float splits[MAX_CASCADES + 1];
+    for (int i = 0; i <= _cascadeCount; i++) {
+        float fraction = (float) i / _cascadeCount;
+        float logarithmic = zNear * std::pow(distance / zNear, fraction);
+        float even = zNear + (distance - zNear) * fraction;
+        splits[i] = splitLambda * logarithmic + (1 - splitLambda) * even;
+    }
+
+    Matrix4f bias;
+    bias[0] = bias[5] = bias[10] = 0.5f;
+    bias[12] = bias[13] = bias[14] = 0.5f;
+
+    float cascadeSplits[MAX_CASCADES];
+    for (int i = 0; i < MAX_CASCADES; i++) {
+        if (i >= _cascadeCount) {
+            cascadeSplits[i] = cascadeSplits[i - 1];
+            continue;
+        }
+
+        Vector3f corners[8];
+        for (int c = 0; c < 4; c++) {
+            Vector3f edge = farCorners[c] - nearCorners[c];
+            corners[c] = nearCorners[c] + edge * ((splits[i] - zNear) / (zFar - zNear));
+            corners[c + 4] = nearCorners[c] + edge * ((splits[i + 1] - zNear) / (zFar - zNear));
+        }
+
+        Cascade& cascade = _cascades[i];
+        fit(cascade, corners, i >= _firstCachedCascade);
+        _data.cascadeMatrices[i] = bias * cascade.matrix;
+        cascadeSplits[i] = splits[i + 1];
+    }
+    _data.cascadeSplits = Vector4f(cascadeSplits[0], cascadeSplits[1], cascadeSplits[2], cascadeSplits[3]);
+}
+
+void ShadowCascades::fit(Cascade& cascade, const Vector3f* corners, bool cached)
+{
+    Vector3f center(0, 0, 0);
+    for (int i = 0; i < 8; i++)
+        center += corners[i];
+    center /= 8;
+
+    // Rounded so rounding errors don't make it jitter
+    float radius = 0;
+    for (int i = 0; i < 8; i++)
+        radius = std::max(radius, (corners[i] - center).length());
+    radius = std::ceil(radius * 16) / 16;
+
+    // Cached cascades get a slack of radius / 4 around the slice and snap
+    // in steps of radius / 2. Rounding moves them by at most half a step,
+    // which is the slack, so the slice stays inside between steps.
+    float extent = cached ? radius * 1.25f : radius;
+    float texel = 2 * extent / _size;
+    float step = cached ? std::max(texel, std::floor(radius * 0.5f / texel) * texel) : texel;
+
+    Vector3f origin = _lightView.transform(center, 1);
+    float x = std::floor(origin.x / step + 0.5f) * step;
+    float y = std::floor(origin.y / step + 0.5f) * step;
+    float z = cached ? std::floor(origin.z / step + 0.5f) * step : origin.z;
+
+    // Looks down -z in light space, reaching back towards the light for
+    // casters outside the slice
+    float zNear = -(z + extent + casterDistance);
+    float zFar = -(z - extent);
+    Matrix4f projection;
+    projection[0] = 1 / extent;
+    projection[5] = 1 / extent;
+    projection[10] = -2 / (zFar - zNear);
+    projection[12] = -x / extent;
+    projection[13] = -y / extent;
+    projection[14] = -(zFar + zNear) / (zFar - zNear);
+
+    cascade.matrix = projection * _lightView;
+    cascade.frustum = extractFrustum(cascade.matrix.toArray());
+}
+
+void ShadowCascades::bindLayer(GLuint framebuffer)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void ShadowCascades::forget(const Model& model)
+{
+    std::map<const Model*, GLuint>::iterator it = _vertexArrays.find(&model);
+    if (it == _vertexArrays.end())
+        return;
+
+    // Earlier frames may still be drawing with it
+    deletionQueue().deleteVertexArrays(1, &it->second);
+    _vertexArrays.erase(it);
+}
+
+GLuint ShadowCascades::vertexArray(const Model& model)
+{
+    GLuint& vao = _vertexArrays[&model];
+    if (vao != 0)
+        return vao;
+
+    glGenVertexArrays(1, &vao);
+    bindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, model.depthVbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.depthEbo);
+
+    // Pointed at each run of the instance buffer when it's drawn
+    for (GLuint column = 0; column < 4; column++) {
+        glVertexAttribDivisor(INSTANCE_MATRIX_ATTRIBUTE + column, 1);
+        glEnableVertexAttribArray(INSTANCE_MATRIX_ATTRIBUTE + column);
+    }
+    return vao;
+}
+
+int ShadowCascades::drawCasters(const std::vector<Caster>& casters, const BoundsTable& bounds, const Cascade& cascade, WorkerPool* pool)
+{
+    cullFrustum(bounds, cascade.frustum, _visible, pool);
+    if (_visible.empty())
+        return 0;
+
+    // Casters of one model next to each other, so each model is one draw
+    std::stable_sort(_visible.begin(), _visible.end(), [&casters](uint32_t a, uint32_t b) {
+        return casters[a].model < casters[b].model;
+    });
+    _matrices.resize(_visible.size());
+    for (size_t i = 0; i < _visible.size(); i++)
+        _matrices[i] = casters[_visible[i]].modelMatrix;
+
+    // Each draw gets its own range of the stream, earlier cascades may
+    // still be drawing from theirs
+    size_t bytes = _matrices.size() * sizeof(Matrix4f);
+    StreamAllocation allocation = _stream->write(_matrices.data(), bytes, sizeof(Matrix4f));
+    size_t offset = allocation.offset;
+    if (allocation.size > 0)
+        glBindBuffer(GL_ARRAY_BUFFER, _stream->handle());
+    else {
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+        while (_instanceCapacity < _matrices.size())
+            _instanceCapacity *= 2;
+        glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * sizeof(Matrix4f), 0, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, _matrices.data());
+        offset = 0;
+    }
+
+    _program->set(_shadowMatrix, cascade.matrix);
+    size_t first = 0;
+    while (first < _visible.size()) {
+        const Model* model = casters[_visible[first]].model;
+        size_t last = first + 1;
+        while (last < _visible.size() && casters[_visible[last]].model == model)
+            last++;
+
+        bindVertexArray(vertexArray(*model));
+        for (GLuint column = 0; column < 4; column++) {
+            glVertexAttribPointer(INSTANCE_MATRIX_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix4f),
+                                  (void*) (offset + first * sizeof(Matrix4f) + column * 4 * sizeof(float)));
+        }
+        glDrawElementsInstanced(GL_TRIANGLES, (GLsizei) model->depthIndices.size(), GL_UNSIGNED_INT, 0, (GLsizei) (last - first));
+        _stats.calls++;
+        first = last;
+    }
+    return (int) _visible.size();
+}
+
+void ShadowCascades::render(WorkerPool* pool)
+{
+    memset(&_stats, 0, sizeof(_stats));
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, _size, _size);
+
+    _program->bind();
+    enable(GL_DEPTH_TEST);
+    depthMask(true);
+    enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2, 4);
+
+    for (int i = 0; i < _cascadeCount; i++) {
+        Cascade& cascade = _cascades[i];
+
+        if (i >= _firstCachedCascade) {
+            if (!cascade.cacheValid || cascade.cachedMatrix != cascade.matrix) {
+                bindLayer(_staticFramebuffers[i]);
+                _stats.staticDraws += drawCasters(_staticCasters, _staticBounds, cascade, pool);
+                cascade.cacheValid = true;
+                cascade.cachedMatrix = cascade.matrix;
+            }
+            else
+                _stats.cachedCascades++;
+
+            // Start from the static depth, then add what moves
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, _staticFramebuffers[i]);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _framebuffers[i]);
+            glBlitFramebuffer(0, 0, _size, _size, 0, 0, _size, _size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, _framebuffers[i]);
+        }
+        else {
+            bindLayer(_framebuffers[i]);
+            _stats.staticDraws += drawCasters(_staticCasters, _staticBounds, cascade, pool);
+        }
+        _stats.dynamicDraws += drawCasters(_dynamicCasters, _dynamicBounds, cascade, pool);
+    }
+
+    bindVertexArray(0);
+    disable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    _dynamicCasters.clear();
+    _dynamicBounds.clear();
+    _buffer.write(*_stream, &_data, sizeof(ShadowData));
+}
+
+void ShadowCascades::bind(unsigned int unit) const
+{
+    activeTexture(unit);
+    bindTexture(GL_TEXTURE_2D_ARRAY, _texture);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Model.h"
+#include "Program.h"
+#include "UniformBuffer.h"
+#include "StreamBuffer.h"
+#include "FrustumCulling.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+#include <GDT/Vector3f.h>
+
+#include <map>
+#include <vector>
+
+class WorkerPool;
+
+class ShadowStats
+{
+public:
+    // Casters drawn, and the instanced draw calls they took
+    int staticDraws;
+    int dynamicDraws;
+    int calls;
+    int cachedCascades;
+};
+
+// Cascaded shadow maps for a directional light, in the layers of one depth
+// texture array that blinnphong.frag samples as shadowMap.
+//
+// Every cascade is fit around a bounding sphere of its slice of the view
+// frustum, which doesn't change size when the camera turns, and its origin
+// is snapped to whole texels so edges don't shimmer when it moves.
+//
+// Distant cascades keep the static casters in a second texture array. They
+// are fit with a slack of a quarter of the slice's radius and snap in
+// steps of half the radius, so snapping moves them by at most the slack
+// and the slice stays covered. They only move now and then; static
+// casters are drawn again only then, when the light turns or when the
+// static set changes. Other frames copy the cached depth and draw just the
+// dynamic casters on top.
+//
+// Near cascades draw every caster each frame, but casters of the same
+// model go in one instanced draw, so that's a call per model and cascade.
+class ShadowCascades
+{
+public:
+    ShadowCascades();
+
+    // The program draws depth with a shadowMatrix uniform and the
+    // instanceMatrix attribute, see shadow.vert, from the models'
+    // position-only streams. Cascades
+    // from firstCachedCascade on are cached. The caster matrices and the
+    // ShadowData block are written into the stream each frame, so render()
+    // has to run between its beginFrame() and endFrame().
+    void create(const Program& program, StreamBuffer& stream, int size = 2048, int cascadeCount = MAX_CASCADES, int firstCachedCascade = 2);
+    void destroy();
+
+    // Static casters stay until cleared, dynamic ones are for one frame
+    void addStaticCaster(const Model& model, const Matrix4f& modelMatrix);
+    void clearStaticCasters();
+    void addDynamicCaster(const Model& model, const Matrix4f& modelMatrix);
+
+    // Frees the vertex array made for the model, call before unloading it.
+    // It must not be a static caster.
+    void forget(const Model& model);
+
+    // Fits the cascades to the part of the view within shadowDistance.
+    // The light shines along lightDirection.
+    void update(const Matrix4f& viewMatrix, const Matrix4f& projMatrix, float zNear, float zFar, Vector3f lightDirection);
+
+    // Draws the casters into the cascades they overlap and uploads the
+    // ShadowData block. Leaves the default framebuffer bound, with the
+    // viewport as it was.
+    void render(WorkerPool* pool = 0);
+
+    // Binds the shadow map array to a texture unit
+    void bind(unsigned int unit) const;
+
+    const ShadowData& data() const { return _data; }
+    const ShadowStats& stats() const { return _stats; }
+
+    // How far from the camera shadows reach, and how the splits are spread
+    // between even (0) and logarithmic (1)
+    float shadowDistance;
+    float splitLambda;
+
+    // How far towards the light casters are gathered beyond a cascade
+    float casterDistance;
+
+private:
+    class Caster
+    {
+    public:
+        const Model* model;
+        Matrix4f modelMatrix;
+    };
+
+    class Cascade
+    {
+    public:
+        Matrix4f matrix;
+        Frustum frustum;
+
+        // Matrix the cached static depth was drawn with, if any
+        bool cacheValid;
+        Matrix4f cachedMatrix;
+    };
+
+    void fit(Cascade& cascade, const Vector3f* corners, bool cached);
+    int drawCasters(const std::vector<Caster>& casters, const BoundsTable& bounds, const Cascade& cascade, WorkerPool* pool);
+    void bindLayer(GLuint framebuffer);
+    GLuint vertexArray(const Model& model);
+
+    const Program* _program;
+    StreamBuffer* _stream;
+    Uniform<Matrix4f> _shadowMatrix;
+
+    int _size;
+    int _cascadeCount;
+    int _firstCachedCascade;
+
+    // Live depth and cached static depth, one framebuffer per layer
+    GLuint _texture;
+    GLuint _staticTexture;
+    GLuint _framebuffers[MAX_CASCADES];
+    GLuint _staticFramebuffers[MAX_CASCADES];
+
+    std::vector<Caster> _staticCasters, _dynamicCasters;
+    BoundsTable _staticBounds, _dynamicBounds;
+    std::vector<uint32_t> _visible;
+
+    // Matrices of the casters being drawn, grouped by model, and a vertex
+    // array per model that reads them. The buffer is only used when the
+    // stream is full.
+    std::vector<Matrix4f> _matrices;
+    GLuint _instanceBuffer;
+    size_t _instanceCapacity;
+    std::map<const Model*, GLuint> _vertexArrays;
+
+    Cascade _cascades[MAX_CASCADES];
+    Vector3f _lightDirection;
+    Matrix4f _lightView;
+
+    ShadowData _data;
+    UniformBuffer _buffer;
+    ShadowStats _stats;
+};
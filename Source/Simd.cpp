@@ -0,0 +1,79 @@
+#include "Simd.h"
+
+#ifdef SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace
+{
+    SimdLevel detect()
+    {
+#ifdef SIMD_X86
+        unsigned int regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        regs[2] = info[2];
+#else
+        __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        bool sse41 = (regs[2] & (1 << 19)) != 0;
+        bool osxsave = (regs[2] & (1 << 27)) != 0;
+        bool fma = (regs[2] & (1 << 12)) != 0;
+        bool f16c = (regs[2] & (1 << 29)) != 0;
+
+        // AVX registers also need to be saved by the OS
+        bool avxState = false;
+        if (osxsave) {
+#ifdef _MSC_VER
+            unsigned long long xcr0 = _xgetbv(0);
+#else
+            unsigned int eax, edx;
+            __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+            unsigned long long xcr0 = ((unsigned long long) edx << 32) | eax;
+#endif
+            avxState = (xcr0 & 6) == 6;
+        }
+
+#ifdef _MSC_VER
+        __cpuidex(info, 7, 0);
+        regs[1] = info[1];
+#else
+        __get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        bool avx2 = (regs[1] & (1 << 5)) != 0;
+
+        if (avx2 && fma && f16c && avxState)
+            return SIMD_AVX2;
+        if (sse41)
+            return SIMD_SSE41;
+#endif
+        return SIMD_SCALAR;
+    }
+
+    const SimdLevel detected = detect();
+    SimdLevel cap = SIMD_AVX2;
+}
+
+SimdLevel simdLevel()
+{
+    return detected < cap ? detected : cap;
+}
+
+void setSimdLevel(SimdLevel level)
+{
+    cap = level;
+}
+
+const char* simdLevelName(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_AVX2: return "AVX2";
+    case SIMD_SSE41: return "SSE4.1";
+    default: return "scalar";
+    }
+}
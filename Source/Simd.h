@@ -0,0 +1,35 @@
+#pragma once
+
+// Runtime selection of SIMD code paths. Kernels are compiled for every
+// instruction set the compiler knows and pick one at run time based on
+// what the CPU supports, so the build doesn't need -mavx2.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#endif
+
+// Marks a function as using AVX2 (+FMA/F16C) or SSE4.1 instructions. MSVC
+// allows intrinsics anywhere, GCC and Clang need the target attribute.
+#if defined(SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#else
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_SSE41
+#endif
+
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE41,
+    SIMD_AVX2
+};
+
+// Best level the CPU supports, capped by setSimdLevel
+SimdLevel simdLevel();
+
+// Caps the level used by all kernels, for benchmarking and testing the
+// fallbacks. Levels above what the CPU supports are ignored.
+void setSimdLevel(SimdLevel level);
+
+const char* simdLevelName(SimdLevel level);
@@ -0,0 +1,166 @@
+#include "StreamBuffer.h"
+#include "Extensions.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Not part of the 3.3 core headers
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+namespace
+{
+    typedef void (APIENTRYP BufferStorage)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+    // Allocations are written through GL_COPY_WRITE_BUFFER so they don't
+    // disturb the element buffer of the bound vertex array
+    const GLenum target = GL_COPY_WRITE_BUFFER;
+}
+
+const int StreamBuffer::MAX_FRAMES;
+
+StreamBuffer::StreamBuffer() :
+    _buffer(0),
+    _regionSize(0),
+    _frames(0),
+    _region(0),
+    _used(0),
+    _uniformAlignment(256),
+    _mapped(0)
+{
+    memset(_fences, 0, sizeof(_fences));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void StreamBuffer::create(size_t size, int frames)
+{
+    _frames = std::max(1, std::min(frames, MAX_FRAMES));
+    _regionSize = size / _frames;
+    _region = 0;
+    _used = 0;
+
+    GLint alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    _uniformAlignment = std::max(alignment, 1);
+
+    BufferStorage bufferStorage = 0;
+    if (hasGLVersion(4, 4) || hasExtension("GL_ARB_buffer_storage"))
+        bufferStorage = (BufferStorage) getProcAddress("glBufferStorage");
+
+    glGenBuffers(1, &_buffer);
+    glBindBuffer(target, _buffer);
+    if (bufferStorage) {
+        // Coherent, so writes reach the GPU without flushing
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(target, _regionSize * _frames, 0, flags);
+        _mapped = (uint8_t*) glMapBufferRange(target, 0, _regionSize * _frames, flags);
+    }
+    else {
+        glBufferData(target, _regionSize * _frames, 0, GL_STREAM_DRAW);
+    }
+}
+
+void StreamBuffer::destroy()
+{
+    for (int i = 0; i < MAX_FRAMES; i++) {
+        if (_fences[i])
+            glDeleteSync(_fences[i]);
+        _fences[i] = 0;
+    }
+
+    if (_mapped) {
+        glBindBuffer(target, _buffer);
+        glUnmapBuffer(target);
+        _mapped = 0;
+    }
+    glDeleteBuffers(1, &_buffer);
+    _buffer = 0;
+}
+
+void StreamBuffer::beginFrame()
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _region = (_region + 1) % _frames;
+    _used = 0;
+
+    GLsync& fence = _fences[_region];
+    if (!fence)
+        return;
+
+    // With enough frames in flight this has signaled long ago. If not,
+    // the GPU is more than that many frames behind and waiting is the
+    // only option left.
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        _stats.waits++;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+    }
+    glDeleteSync(fence);
+    fence = 0;
+}
+
+void StreamBuffer::endFrame()
+{
+    if (_used > 0)
+        _fences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+StreamAllocation StreamBuffer::allocate(size_t size, size_t alignment)
+{
+    StreamAllocation allocation;
+    allocation.data = 0;
+    allocation.offset = 0;
+    allocation.size = 0;
+
+    size_t regionStart = _region * _regionSize;
+    size_t offset = (regionStart + _used + alignment - 1) / alignment * alignment;
+    if (size == 0 || offset + size > regionStart + _regionSize) {
+        _stats.failed++;
+        return allocation;
+    }
+
+    if (_mapped) {
+        allocation.data = _mapped + offset;
+    }
+    else {
+        // The fence on this region has passed, no need for GL to wait
+        glBindBuffer(target, _buffer);
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+        allocation.data = (uint8_t*) glMapBufferRange(target, offset, size, flags);
+        if (!allocation.data) {
+            _stats.failed++;
+            return allocation;
+        }
+    }
+
+    allocation.offset = offset;
+    allocation.size = size;
+    _used = offset + size - regionStart;
+    _stats.bytes += size;
+    _stats.allocations++;
+    return allocation;
+}
+
+void StreamBuffer::commit(const StreamAllocation& allocation)
+{
+    if (_mapped || allocation.size == 0)
+        return;
+
+    glBindBuffer(target, _buffer);
+    glUnmapBuffer(target);
+}
+
+StreamAllocation StreamBuffer::write(const void* data, size_t size, size_t alignment)
+{
+    StreamAllocation allocation = allocate(size, alignment);
+    if (allocation.size > 0) {
+        memcpy(allocation.data, data, size);
+        commit(allocation);
+    }
+    return allocation;
+}
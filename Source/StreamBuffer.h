@@ -0,0 +1,86 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Space handed out by StreamBuffer::allocate(). size is 0 when the frame's
+// region had no room left.
+class StreamAllocation
+{
+public:
+    uint8_t* data;
+    GLintptr offset;
+    size_t size;
+};
+
+class StreamStats
+{
+public:
+    size_t bytes;
+    int allocations;
+    int failed;
+    // Frames that found their region still in use by the GPU
+    int waits;
+};
+
+// One buffer for data that is written every frame, split into a region
+// per frame in flight. Each frame allocates from its own region, and a
+// fence set at the end of the frame keeps the CPU from writing over a
+// region before the GPU is done with it, so writes don't need the driver
+// to synchronize or copy.
+//
+// With GL 4.4 or ARB_buffer_storage the buffer stays mapped for its whole
+// life. On plain 3.3 every allocation maps its range unsynchronized, the
+// fences already guarantee the GPU isn't reading it.
+//
+// Allocations can be used as vertex, index or uniform data; the buffer is
+// bound to whatever target the draw needs.
+class StreamBuffer
+{
+public:
+    StreamBuffer();
+
+    void create(size_t size, int frames = 3);
+    void destroy();
+
+    // Moves on to the next frame's region
+    void beginFrame();
+    // Fences off the frame's region
+    void endFrame();
+
+    // Space for size bytes at an offset that's a multiple of alignment.
+    // Write it through data, then commit() it before drawing from it.
+    StreamAllocation allocate(size_t size, size_t alignment = 16);
+    void commit(const StreamAllocation& allocation);
+
+    // allocate(), copy and commit()
+    StreamAllocation write(const void* data, size_t size, size_t alignment = 16);
+
+    GLuint handle() const { return _buffer; }
+    bool persistent() const { return _mapped != 0; }
+
+    // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, for allocations bound as blocks
+    size_t uniformAlignment() const { return _uniformAlignment; }
+
+    // Of the frame so far, cleared by beginFrame()
+    const StreamStats& stats() const { return _stats; }
+
+    static const int MAX_FRAMES = 4;
+
+private:
+    GLuint _buffer;
+    size_t _regionSize;
+    int _frames;
+    int _region;
+    size_t _used;
+    size_t _uniformAlignment;
+
+    // The whole buffer when it's persistently mapped
+    uint8_t* _mapped;
+
+    GLsync _fences[MAX_FRAMES];
+
+    StreamStats _stats;
+};
@@ -0,0 +1,253 @@
+#include "TextureFile.h"
+
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+
+namespace
+{
+    const unsigned char KTX2_IDENTIFIER[12] = {
+        0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'
+    };
+
+    // Identifier + header + index, the level index follows directly after
+    const size_t KTX2_HEADER_SIZE = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+    const size_t KTX2_LEVEL_INDEX_SIZE = 3 * 8;
+
+    // Level data is aligned to a multiple of the largest block size
+    const size_t LEVEL_ALIGNMENT = 16;
+
+    void put32(std::vector<unsigned char>& out, uint32_t v)
+    {
+        for (int i = 0; i < 4; i++)
+            out.push_back((unsigned char) (v >> (8 * i)));
+    }
+
+    void put64(std::vector<unsigned char>& out, uint64_t v)
+    {
+        for (int i = 0; i < 8; i++)
+            out.push_back((unsigned char) (v >> (8 * i)));
+    }
+
+    uint32_t get32(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    uint64_t get64(const unsigned char* p)
+    {
+        return get32(p) | ((uint64_t) get32(p + 4) << 32);
+    }
+}
+
+bool isBlockCompressed(TextureFormat format)
+{
+    return format != FORMAT_RGBA8 && format != FORMAT_RGBA8_SRGB && format != FORMAT_UNDEFINED;
+}
+
+bool isSrgb(TextureFormat format)
+{
+    return format == FORMAT_RGBA8_SRGB || format == FORMAT_BC1_SRGB || format == FORMAT_BC3_SRGB || format == FORMAT_BC7_SRGB;
+}
+
+size_t textureLevelSize(TextureFormat format, int width, int height)
+{
+    size_t blocks = (size_t) ((width + 3) / 4) * ((height + 3) / 4);
+
+    switch (format) {
+    case FORMAT_RGBA8:
+    case FORMAT_RGBA8_SRGB:
+        return (size_t) width * height * 4;
+    case FORMAT_BC1:
+    case FORMAT_BC1_SRGB:
+        return blocks * 8;
+    case FORMAT_BC3:
+    case FORMAT_BC3_SRGB:
+    case FORMAT_BC5:
+    case FORMAT_BC7:
+    case FORMAT_BC7_SRGB:
+        return blocks * 16;
+    default:
+        return 0;
+    }
+}
+
+size_t TextureFile::byteSize() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < levels.size(); i++)
+        size += levels[i].data.size();
+    return size;
+}
+
+bool writeTextureFile(std::string path, const TextureFile& texture)
+{
+    uint32_t levelCount = (uint32_t) texture.levels.size();
+
+    std::vector<unsigned char> header(KTX2_IDENTIFIER, KTX2_IDENTIFIER + 12);
+    put32(header, texture.format);
+    put32(header, 1); // typeSize
+    put32(header, texture.width);
+    put32(header, texture.height);
+    put32(header, 0); // pixelDepth
+    put32(header, 0); // layerCount
+    put32(header, 1); // faceCount
+    put32(header, levelCount);
+    put32(header, 0); // supercompressionScheme
+
+    // No data format descriptor, key/value or supercompression data
+    for (int i = 0; i < 4; i++)
+        put32(header, 0);
+    put64(header, 0);
+    put64(header, 0);
+
+    // As in KTX2 the smallest level is stored first, so a reader streaming
+    // in the chain gets the coarse levels before the large ones
+    std::vector<uint64_t> offsets(levelCount);
+    size_t offset = KTX2_HEADER_SIZE + levelCount * KTX2_LEVEL_INDEX_SIZE;
+    for (int i = (int) levelCount - 1; i >= 0; i--) {
+        offset = (offset + LEVEL_ALIGNMENT - 1) / LEVEL_ALIGNMENT * LEVEL_ALIGNMENT;
+        offsets[i] = offset;
+        offset += texture.levels[i].data.size();
+    }
+
+    for (uint32_t i = 0; i < levelCount; i++) {
+        put64(header, offsets[i]);
+        put64(header, texture.levels[i].data.size());
+        put64(header, texture.levels[i].data.size());
+    }
+
+    std::ofstream ofs(path.c_str(), std::ios::binary);
+    if (!ofs.is_open()) {
+        std::cerr << "Failed to open texture file for writing: " << path << std::endl;
+        return false;
+    }
+
+    ofs.write((const char*) header.data(), header.size());
+    size_t written = header.size();
+    for (int i = (int) levelCount - 1; i >= 0; i--) {
+        static const char padding[LEVEL_ALIGNMENT] = { 0 };
+        ofs.write(padding, offsets[i] - written);
+        ofs.write((const char*) texture.levels[i].data.data(), texture.levels[i].data.size());
+        written = offsets[i] + texture.levels[i].data.size();
+    }
+
+    return ofs.good();
+}
+
+namespace
+{
+    class LevelIndex
+    {
+    public:
+        uint64_t offset, length;
+    };
+
+    // Parses the header and level index from the start of a file, which
+    // must hold at least the header and the full level index
+    bool parseHeader(std::istream& in, std::string path, TextureFile& texture, std::vector<LevelIndex>& index)
+    {
+        unsigned char header[KTX2_HEADER_SIZE];
+        if (!in.read((char*) header, KTX2_HEADER_SIZE) || memcmp(header, KTX2_IDENTIFIER, 12) != 0) {
+            std::cerr << "Not a KTX2 texture file: " << path << std::endl;
+            return false;
+        }
+
+        texture.format = (TextureFormat) get32(header + 12);
+        texture.width = get32(header + 20);
+        texture.height = get32(header + 24);
+        uint32_t levelCount = std::max(1u, get32(header + 40));
+        uint32_t supercompression = get32(header + 44);
+
+        if (supercompression != 0 || textureLevelSize(texture.format, 1, 1) == 0) {
+            std::cerr << "Unsupported KTX2 format or supercompression in: " << path << std::endl;
+            return false;
+        }
+
+        std::vector<unsigned char> entries(levelCount * KTX2_LEVEL_INDEX_SIZE);
+        if (!in.read((char*) entries.data(), entries.size())) {
+            std::cerr << "Truncated texture file: " << path << std::endl;
+            return false;
+        }
+
+        texture.levels.resize(levelCount);
+        index.resize(levelCount);
+        for (uint32_t i = 0; i < levelCount; i++) {
+            TextureLevel& level = texture.levels[i];
+            level.width = std::max(1, texture.width >> i);
+            level.height = std::max(1, texture.height >> i);
+            level.data.clear();
+
+            index[i].offset = get64(&entries[i * KTX2_LEVEL_INDEX_SIZE]);
+            index[i].length = get64(&entries[i * KTX2_LEVEL_INDEX_SIZE + 8]);
+            if (index[i].length != textureLevelSize(texture.format, level.width, level.height)) {
+                std::cerr << "Corrupt level " << i << " in texture file: " << path << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool readLevelData(std::istream& in, std::string path, int level, const LevelIndex& index, TextureLevel& out)
+    {
+        out.data.resize(index.length);
+        in.seekg(index.offset);
+        if (!in.read((char*) out.data.data(), index.length)) {
+            std::cerr << "Corrupt level " << level << " in texture file: " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+bool readTextureFile(std::string path, TextureFile& texture)
+{
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    if (!ifs.is_open()) {
+        std::cerr << "Failed to find texture file: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<LevelIndex> index;
+    if (!parseHeader(ifs, path, texture, index))
+        return false;
+
+    for (size_t i = 0; i < texture.levels.size(); i++) {
+        if (!readLevelData(ifs, path, (int) i, index[i], texture.levels[i]))
+            return false;
+    }
+
+    return true;
+}
+
+bool readTextureHeader(std::string path, TextureFile& texture)
+{
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    if (!ifs.is_open()) {
+        std::cerr << "Failed to find texture file: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<LevelIndex> index;
+    return parseHeader(ifs, path, texture, index);
+}
+
+bool readTextureLevel(std::string path, int level, TextureLevel& out)
+{
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    if (!ifs.is_open()) {
+        std::cerr << "Failed to find texture file: " << path << std::endl;
+        return false;
+    }
+
+    TextureFile texture;
+    std::vector<LevelIndex> index;
+    if (!parseHeader(ifs, path, texture, index) || level < 0 || level >= (int) index.size())
+        return false;
+
+    out.width = texture.levels[level].width;
+    out.height = texture.levels[level].height;
+    return readLevelData(ifs, path, level, index[level], out);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Pixel formats that can be stored in a texture file. The values are the
+// Vulkan format ids, which is what the KTX2 header stores in vkFormat.
+enum TextureFormat
+{
+    FORMAT_UNDEFINED = 0,
+    FORMAT_RGBA8 = 37,
+    FORMAT_RGBA8_SRGB = 43,
+    FORMAT_BC1 = 133,
+    FORMAT_BC1_SRGB = 134,
+    FORMAT_BC3 = 137,
+    FORMAT_BC3_SRGB = 138,
+    FORMAT_BC5 = 141,
+    FORMAT_BC7 = 145,
+    FORMAT_BC7_SRGB = 146
+};
+
+bool isBlockCompressed(TextureFormat format);
+bool isSrgb(TextureFormat format);
+
+// Size in bytes of a width x height image in the given format
+size_t textureLevelSize(TextureFormat format, int width, int height);
+
+class TextureLevel
+{
+public:
+    int width, height;
+    std::vector<unsigned char> data;
+};
+
+// A texture with its full mip chain, level 0 being the largest
+class TextureFile
+{
+public:
+    TextureFormat format;
+    int width, height;
+    std::vector<TextureLevel> levels;
+
+    size_t byteSize() const;
+};
+
+// Reads and writes a KTX2 style container: the KTX2 identifier, header and
+// level index are laid out as in the specification so standard tools can
+// inspect the files, but no data format descriptor or key/value data is
+// written and supercompression is not supported.
+bool writeTextureFile(std::string path, const TextureFile& texture);
+bool readTextureFile(std::string path, TextureFile& texture);
+
+// Reads only the header, filling in the level sizes but leaving their data
+// empty. Single levels can then be read with readTextureLevel, which is
+// what the texture streamer uses to page mips in on demand.
+bool readTextureHeader(std::string path, TextureFile& texture);
+bool readTextureLevel(std::string path, int level, TextureLevel& out);
@@ -0,0 +1,225 @@
+#include "TexturePacker.h"
+#include "Image.h"
+#include "GLState.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+    bool isPowerOfTwo(int v)
+    {
+        return v > 0 && (v & (v - 1)) == 0;
+    }
+
+    int log2i(int v)
+    {
+        int result = 0;
+        while (v > 1) {
+            v /= 2;
+            result++;
+        }
+        return result;
+    }
+
+    // Copies a level into a larger image at (x, y), working in whole blocks
+    // for compressed formats. x and y must be block aligned.
+    void copyRegion(TextureFormat format, const TextureLevel& src, unsigned char* dst, int dstWidth, int x, int y)
+    {
+        int blockDim = isBlockCompressed(format) ? 4 : 1;
+        size_t blockBytes = textureLevelSize(format, blockDim, blockDim);
+        int srcBlocksX = (src.width + blockDim - 1) / blockDim;
+        int srcBlocksY = (src.height + blockDim - 1) / blockDim;
+        int dstBlocksX = (dstWidth + blockDim - 1) / blockDim;
+
+        for (int row = 0; row < srcBlocksY; row++) {
+            memcpy(dst + ((size_t) (y / blockDim + row) * dstBlocksX + x / blockDim) * blockBytes,
+                   src.data.data() + (size_t) row * srcBlocksX * blockBytes,
+                   srcBlocksX * blockBytes);
+        }
+    }
+
+    // Free square cells of one atlas page, by cell size
+    typedef std::map<int, std::vector<std::pair<int, int> > > FreeCells;
+
+    bool allocateCell(FreeCells& page, int size, int& x, int& y)
+    {
+        FreeCells::iterator it = page.lower_bound(size);
+        while (it != page.end() && it->second.empty())
+            ++it;
+        if (it == page.end())
+            return false;
+
+        int cellSize = it->first;
+        x = it->second.back().first;
+        y = it->second.back().second;
+        it->second.pop_back();
+
+        // Split down to the requested size, keeping the other quadrants free
+        while (cellSize > size) {
+            cellSize /= 2;
+            page[cellSize].push_back(std::make_pair(x + cellSize, y));
+            page[cellSize].push_back(std::make_pair(x, y + cellSize));
+            page[cellSize].push_back(std::make_pair(x + cellSize, y + cellSize));
+        }
+        return true;
+    }
+}
+
+const int TexturePacker::ATLAS_SIZE;
+const int TexturePacker::MAX_ATLAS_TILE;
+
+void TexturePacker::add(std::string name, const TextureFile& texture, bool repeats)
+{
+    _names.push_back(name);
+    _textures.push_back(texture);
+    _repeats.push_back(repeats);
+}
+
+void TexturePacker::build()
+{
+    std::vector<Group> groups;
+
+    for (size_t i = 0; i < _textures.size(); i++) {
+        const TextureFile& texture = _textures[i];
+        // Compressed textures under a block would land in cells that aren't
+        // block aligned, and cut the page down to a single level
+        bool atlas = !_repeats[i] && isPowerOfTwo(texture.width) && isPowerOfTwo(texture.height)
+                  && std::max(texture.width, texture.height) <= MAX_ATLAS_TILE
+                  && (!isBlockCompressed(texture.format) || std::min(texture.width, texture.height) >= 4);
+
+        Group* group = 0;
+        for (size_t g = 0; g < groups.size() && !group; g++) {
+            Group& candidate = groups[g];
+            if (candidate.format != texture.format || candidate.atlas != atlas)
+                continue;
+            if (atlas || (candidate.width == texture.width && candidate.height == texture.height && candidate.levels == (int) texture.levels.size()))
+                group = &candidate;
+        }
+
+        if (!group) {
+            groups.push_back(Group());
+            group = &groups.back();
+            group->format = texture.format;
+            group->atlas = atlas;
+            group->width = atlas ? ATLAS_SIZE : texture.width;
+            group->height = atlas ? ATLAS_SIZE : texture.height;
+            group->levels = atlas ? log2i(ATLAS_SIZE) + 1 : (int) texture.levels.size();
+            group->layers = 0;
+        }
+
+        Tile tile;
+        tile.name = _names[i];
+        tile.texture = &texture;
+        tile.layer = atlas ? 0 : group->layers++;
+        tile.x = tile.y = 0;
+        group->tiles.push_back(tile);
+
+        // Atlas levels stop where the smallest tile would go below a pixel,
+        // or below a block for compressed formats
+        if (atlas) {
+            int levels = log2i(std::min(texture.width, texture.height)) + 1 - (isBlockCompressed(texture.format) ? 2 : 0);
+            group->levels = std::max(1, std::min(group->levels, std::min(levels, (int) texture.levels.size())));
+        }
+    }
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        if (groups[g].atlas)
+            packAtlas(groups[g]);
+        upload(groups[g]);
+    }
+
+    // The packed copies are on the GPU now
+    _textures.clear();
+    _names.clear();
+    _repeats.clear();
+}
+
+void TexturePacker::packAtlas(Group& group)
+{
+    // Largest first keeps the buddy grid tight
+    std::sort(group.tiles.begin(), group.tiles.end(), [](const Tile& a, const Tile& b) {
+        return std::max(a.texture->width, a.texture->height) > std::max(b.texture->width, b.texture->height);
+    });
+
+    std::vector<FreeCells> pages;
+    for (size_t i = 0; i < group.tiles.size(); i++) {
+        Tile& tile = group.tiles[i];
+        int size = std::max(tile.texture->width, tile.texture->height);
+
+        size_t page = 0;
+        while (page < pages.size() && !allocateCell(pages[page], size, tile.x, tile.y))
+            page++;
+
+        if (page == pages.size()) {
+            pages.push_back(FreeCells());
+            pages.back()[ATLAS_SIZE].push_back(std::make_pair(0, 0));
+            allocateCell(pages.back(), size, tile.x, tile.y);
+        }
+        tile.layer = (int) page;
+    }
+
+    group.layers = (int) pages.size();
+}
+
+void TexturePacker::upload(const Group& group)
+{
+    GLuint handle;
+    glGenTextures(1, &handle);
+    bindTexture(GL_TEXTURE_2D_ARRAY, handle);
+
+    for (int level = 0; level < group.levels; level++) {
+        int width = std::max(1, group.width >> level);
+        int height = std::max(1, group.height >> level);
+        size_t layerSize = textureLevelSize(group.format, width, height);
+
+        std::vector<unsigned char> data(layerSize * group.layers);
+        for (size_t i = 0; i < group.tiles.size(); i++) {
+            const Tile& tile = group.tiles[i];
+            copyRegion(group.format, tile.texture->levels[level], data.data() + tile.layer * layerSize, width, tile.x >> level, tile.y >> level);
+        }
+
+        uploadTextureArrayLevel(group.format, level, width, height, group.layers, data.data());
+    }
+
+    GLint wrap = group.atlas ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, group.levels - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+    bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    _arrays.push_back(handle);
+
+    for (size_t i = 0; i < group.tiles.size(); i++) {
+        const Tile& tile = group.tiles[i];
+        TextureRef ref;
+        ref.array = handle;
+        ref.layer = tile.layer;
+        if (group.atlas) {
+            ref.uvTransform = Vector4f((float) tile.texture->width / ATLAS_SIZE, (float) tile.texture->height / ATLAS_SIZE,
+                                       (float) tile.x / ATLAS_SIZE, (float) tile.y / ATLAS_SIZE);
+        }
+        _refs[tile.name] = ref;
+    }
+}
+
+TextureRef TexturePacker::get(std::string name) const
+{
+    std::map<std::string, TextureRef>::const_iterator it = _refs.find(name);
+    if (it == _refs.end()) {
+        std::cerr << "Texture was not packed: " << name << std::endl;
+        return TextureRef();
+    }
+    return it->second;
+}
+
+void TexturePacker::destroy()
+{
+    if (!_arrays.empty())
+        deleteTextures((GLsizei) _arrays.size(), _arrays.data());
+    _arrays.clear();
+    _refs.clear();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "TextureFile.h"
+#include "Material.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Groups baked textures into GL_TEXTURE_2D_ARRAY objects so materials
+// using different textures can share one texture binding.
+//
+// Textures of the same format and size become layers of one array. Small
+// power-of-two textures that don't repeat are packed into atlas pages of
+// ATLAS_SIZE, which are layers of a per-format array. Atlas tiles are
+// placed on a buddy grid aligned to their own size, so every mip level of
+// a tile lines up with the matching level of the page; the page keeps only
+// as many levels as its smallest tile has, which avoids bleeding.
+// Compressed textures smaller than a 4x4 block get an array of their own.
+class TexturePacker
+{
+public:
+    static const int ATLAS_SIZE = 1024;
+    static const int MAX_ATLAS_TILE = 256;
+
+    // Adds a texture with all of its levels loaded. Textures that tile
+    // (repeats = true) never go into an atlas, since their UVs wrap.
+    void add(std::string name, const TextureFile& texture, bool repeats = false);
+
+    // Creates the array textures, after which add() must not be called
+    void build();
+
+    TextureRef get(std::string name) const;
+
+    // Number of distinct array textures after build()
+    size_t arrayCount() const { return _arrays.size(); }
+
+    void destroy();
+
+private:
+    class Tile
+    {
+    public:
+        std::string name;
+        const TextureFile* texture;
+        int layer, x, y;
+    };
+
+    class Group
+    {
+    public:
+        TextureFormat format;
+        int width, height, levels;
+        bool atlas;
+        std::vector<Tile> tiles;
+        int layers;
+    };
+
+    void packAtlas(Group& group);
+    void upload(const Group& group);
+
+    std::vector<TextureFile> _textures;
+    std::vector<std::string> _names;
+    std::vector<bool> _repeats;
+
+    std::map<std::string, TextureRef> _refs;
+    std::vector<GLuint> _arrays;
+};
@@ -0,0 +1,260 @@
+#include "TextureStreamer.h"
+#include "Image.h"
+#include "GLState.h"
+
+#include <GDT/OpenGL.h>
+
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+
+const int TextureStreamer::MIN_RESIDENT_SIZE;
+
+TextureStreamer::TextureStreamer(size_t budgetBytes) :
+    maxUploadBytesPerFrame(4 * 1024 * 1024),
+    _budget(budgetBytes),
+    _residentBytes(0),
+    _pendingBytes(0),
+    _stop(false)
+{
+    _thread = std::thread(&TextureStreamer::worker, this);
+}
+
+TextureStreamer::~TextureStreamer()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _condition.notify_all();
+    _thread.join();
+
+    for (size_t i = 0; i < _textures.size(); i++) {
+        deleteTextures(1, &_textures[i]->handle);
+        delete _textures[i];
+    }
+}
+
+StreamedTexture* TextureStreamer::load(std::string path)
+{
+    TextureFile header;
+    if (!readTextureHeader(path, header)) {
+        std::cout << "Failed to load image at: " << path << std::endl;
+        exit(0);
+    }
+
+    StreamedTexture* texture = new StreamedTexture();
+    texture->width = header.width;
+    texture->height = header.height;
+    texture->_path = path;
+    texture->_format = header.format;
+    texture->_levels = header.levels;
+    texture->_residentLevel = (int) header.levels.size();
+    texture->_loading = false;
+    texture->_residentBytes = 0;
+    texture->_screenSize = 0;
+
+    // Storage for the whole chain, once. Loads only fill levels in.
+    glGenTextures(1, &texture->handle);
+    texture->created = true;
+    bindTexture(GL_TEXTURE_2D, texture->handle);
+    allocateTextureLevels(header.format, header.levels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (int) header.levels.size() - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // Find the largest level that is always resident and upload the tail
+    int tail = (int) header.levels.size() - 1;
+    while (tail > 0 && std::max(header.levels[tail - 1].width, header.levels[tail - 1].height) <= MIN_RESIDENT_SIZE)
+        tail--;
+
+    for (int i = tail; i < (int) header.levels.size(); i++) {
+        TextureLevel level;
+        if (readTextureLevel(path, i, level))
+            updateTextureLevel(header.format, i, level);
+    }
+
+    texture->_wantedLevel = tail;
+    setResidentLevel(texture, tail);
+
+    _textures.push_back(texture);
+    return texture;
+}
+
+void TextureStreamer::request(StreamedTexture* texture, float screenSize)
+{
+    texture->_screenSize = std::max(texture->_screenSize, screenSize);
+}
+
+void TextureStreamer::setBudget(size_t budgetBytes)
+{
+    _budget = budgetBytes;
+}
+
+size_t TextureStreamer::levelBytes(const StreamedTexture* texture, int level) const
+{
+    // Textures the driver can't hold compressed are decoded to RGBA8
+    const TextureLevel& size = texture->_levels[level];
+    if (!isTextureFormatSupported(texture->_format))
+        return (size_t) size.width * size.height * 4;
+    return textureLevelSize(texture->_format, size.width, size.height);
+}
+
+void TextureStreamer::setResidentLevel(StreamedTexture* texture, int residentLevel)
+{
+    // Mip selection is relative to the base level, so the minimum LOD can
+    // stay at 0
+    bindTexture(GL_TEXTURE_2D, texture->handle);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, residentLevel);
+
+    size_t bytes = 0;
+    for (int i = residentLevel; i < (int) texture->_levels.size(); i++)
+        bytes += levelBytes(texture, i);
+
+    _residentBytes = _residentBytes - texture->_residentBytes + bytes;
+    texture->_residentBytes = bytes;
+    texture->_residentLevel = residentLevel;
+}
+
+bool TextureStreamer::makeRoom(size_t bytes, float priority)
+{
+    while (_residentBytes + _pendingBytes + bytes > _budget) {
+        // Prefer dropping detail nobody asked for, then the least visible
+        StreamedTexture* victim = 0;
+        bool victimSurplus = false;
+        for (size_t i = 0; i < _textures.size(); i++) {
+            StreamedTexture* texture = _textures[i];
+            int top = texture->_residentLevel;
+            if (top + 1 >= (int) texture->_levels.size() || std::max(texture->_levels[top].width, texture->_levels[top].height) <= MIN_RESIDENT_SIZE)
+                continue;
+
+            bool surplus = top < texture->_wantedLevel;
+            if (!surplus && texture->_screenSize >= priority)
+                continue;
+            if (!victim || (surplus && !victimSurplus) || (surplus == victimSurplus && texture->_screenSize < victim->_screenSize)) {
+                victim = texture;
+                victimSurplus = surplus;
+            }
+        }
+
+        if (!victim)
+            return false;
+        setResidentLevel(victim, victim->_residentLevel + 1);
+    }
+    return true;
+}
+
+void TextureStreamer::update()
+{
+    for (size_t i = 0; i < _textures.size(); i++) {
+        StreamedTexture* texture = _textures[i];
+        int lastLevel = (int) texture->_levels.size() - 1;
+
+        // One texel per pixel: every halving of the screen size drops a level
+        float size = (float) std::max(texture->width, texture->height);
+        int wanted = lastLevel;
+        if (texture->_screenSize > 0)
+            wanted = (int) std::floor(std::log2(size / texture->_screenSize));
+        texture->_wantedLevel = std::min(std::max(wanted, 0), lastLevel);
+    }
+
+    // Upload what the worker finished, within this frame's upload budget.
+    // Every texture has one load at most, so whether a level is still
+    // wanted can be decided before any of them is uploaded.
+    std::deque<LoadJob> finished;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t uploaded = 0;
+        while (!_finished.empty()) {
+            const LoadJob& job = _finished.front();
+            const StreamedTexture* texture = job.texture;
+            bool wanted = !job.failed && job.level == texture->_residentLevel - 1 && job.level >= texture->_wantedLevel;
+            size_t bytes = wanted ? levelBytes(texture, job.level) : 0;
+            if (uploaded > 0 && uploaded + bytes > maxUploadBytesPerFrame)
+                break;
+
+            uploaded += bytes;
+            finished.push_back(std::move(_finished.front()));
+            _finished.pop_front();
+        }
+    }
+
+    for (size_t i = 0; i < finished.size(); i++) {
+        LoadJob& job = finished[i];
+        StreamedTexture* texture = job.texture;
+        _pendingBytes -= levelBytes(texture, job.level);
+        texture->_loading = false;
+
+        if (job.failed || job.level != texture->_residentLevel - 1 || job.level < texture->_wantedLevel)
+            continue;
+
+        // Only the new level goes up, its data is freed with the job
+        bindTexture(GL_TEXTURE_2D, texture->handle);
+        updateTextureLevel(texture->_format, job.level, job.data);
+        setResidentLevel(texture, job.level);
+    }
+
+    // Fit within the budget again if it was lowered
+    makeRoom(0, 1e30f);
+
+    // Queue the next level for the most visible textures first
+    std::vector<StreamedTexture*> order(_textures);
+    std::sort(order.begin(), order.end(), [](const StreamedTexture* a, const StreamedTexture* b) {
+        return a->_screenSize > b->_screenSize;
+    });
+
+    for (size_t i = 0; i < order.size(); i++) {
+        StreamedTexture* texture = order[i];
+        if (texture->_loading || texture->_wantedLevel >= texture->_residentLevel)
+            continue;
+
+        int level = texture->_residentLevel - 1;
+        size_t bytes = levelBytes(texture, level);
+        if (!makeRoom(bytes, texture->_screenSize))
+            continue;
+
+        LoadJob job;
+        job.texture = texture;
+        job.level = level;
+        job.failed = false;
+        texture->_loading = true;
+        _pendingBytes += bytes;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _requests.push_back(std::move(job));
+        _condition.notify_one();
+    }
+
+    for (size_t i = 0; i < _textures.size(); i++)
+        _textures[i]->_screenSize = 0;
+}
+
+void TextureStreamer::worker()
+{
+    while (true) {
+        LoadJob job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this]() { return _stop || !_requests.empty(); });
+            if (_stop)
+                return;
+            job = std::move(_requests.front());
+            _requests.pop_front();
+        }
+
+        job.failed = !readTextureLevel(job.texture->_path, job.level, job.data);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _finished.push_back(std::move(job));
+    }
+}
+
+float projectedScreenSize(const Matrix4f& projMatrix, const Matrix4f& viewMatrix, Vector3f center, float radius, int viewportHeight)
+{
+    // Clip space w of the center, matrices are column-major
+    Vector3f viewCenter = viewMatrix.transform(center, 1);
+    float w = projMatrix[3] * viewCenter.x + projMatrix[7] * viewCenter.y + projMatrix[11] * viewCenter.z + projMatrix[15];
+    w = std::max(w, 1e-3f);
+
+    return radius * projMatrix[5] * viewportHeight / w;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "TextureFile.h"
+
+#include <GDT/TextureUnit.h>
+#include <GDT/Texture.h>
+#include <GDT/Matrix4f.h>
+#include <GDT/Vector3f.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A baked texture of which only part of the mip chain is loaded. The GL
+// texture has storage for every level from the start, and its
+// GL_TEXTURE_BASE_LEVEL is moved to residentLevel as levels arrive or are
+// evicted, so only loaded levels are ever sampled. The handle never
+// changes.
+class StreamedTexture : public Texture2D
+{
+    friend class TextureStreamer;
+
+public:
+    int width, height;
+
+    // For binding through GLState, which Texture::bind() bypasses
+    GLuint glHandle() const { return handle; }
+
+    // Most detailed mip level currently on the GPU
+    int residentLevel() const { return _residentLevel; }
+    size_t residentBytes() const { return _residentBytes; }
+
+private:
+    std::string _path;
+    TextureFormat _format;
+
+    // Sizes of all levels, their data is dropped once it's uploaded
+    std::vector<TextureLevel> _levels;
+
+    int _residentLevel;
+    int _wantedLevel;
+    bool _loading;
+    size_t _residentBytes;
+
+    // Largest screen size requested this frame, used as eviction priority
+    float _screenSize;
+};
+
+// Streams the detailed mip levels of textures in as objects using them get
+// closer, within a budget. The budget counts the levels that are resident,
+// not the storage: evicting a level only makes room for others to load.
+class TextureStreamer
+{
+public:
+    // Levels at or below this size are always resident and are loaded
+    // synchronously, so a texture always has something to show
+    static const int MIN_RESIDENT_SIZE = 128;
+
+    TextureStreamer(size_t budgetBytes);
+    ~TextureStreamer();
+
+    // Registers a baked .ktx2 texture. Ownership stays with the streamer.
+    StreamedTexture* load(std::string path);
+
+    // Tells the streamer an object using the texture covers this many pixels
+    // on screen this frame; the texture wants the mip whose size matches.
+    void request(StreamedTexture* texture, float screenSize);
+
+    // Picks levels to load or evict and uploads finished loads, call once
+    // per frame on the GL thread after all requests
+    void update();
+
+    void setBudget(size_t budgetBytes);
+    size_t budget() const { return _budget; }
+    size_t residentBytes() const { return _residentBytes; }
+
+    // Caps the bytes uploaded per update so streaming never hitches a frame.
+    // A level larger than the cap is uploaded on its own.
+    size_t maxUploadBytesPerFrame;
+
+private:
+    class LoadJob
+    {
+    public:
+        StreamedTexture* texture;
+        int level;
+        TextureLevel data;
+        bool failed;
+    };
+
+    void worker();
+    void setResidentLevel(StreamedTexture* texture, int residentLevel);
+    bool makeRoom(size_t bytes, float priority);
+    size_t levelBytes(const StreamedTexture* texture, int level) const;
+
+    std::vector<StreamedTexture*> _textures;
+    size_t _budget;
+    size_t _residentBytes;
+    size_t _pendingBytes;
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<LoadJob> _requests;
+    std::deque<LoadJob> _finished;
+    bool _stop;
+};
+
+// Approximate diameter in pixels of a bounding sphere after projection,
+// which is what textures on that object are sampled at
+float projectedScreenSize(const Matrix4f& projMatrix, const Matrix4f& viewMatrix, Vector3f center, float radius, int viewportHeight);
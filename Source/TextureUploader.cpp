@@ -0,0 +1,357 @@
+#include "TextureUploader.h"
+#include "BlockCompression.h"
+#include "PixelConversion.h"
+#include "GLState.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+TextureUploader::TextureUploader(int slotCount, size_t slotSize, int workerCount) :
+    maxUploadBytesPerFrame(8 * 1024 * 1024),
+    _slots(slotCount),
+    _slotSize(slotSize),
+    _nextJob(0),
+    _stop(false)
+{
+    for (size_t i = 0; i < _slots.size(); i++) {
+        Slot& slot = _slots[i];
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, slotSize, 0, GL_STREAM_DRAW);
+        slot.fence = 0;
+        map(slot);
+        slot.state = SLOT_FREE;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    for (int i = 0; i < workerCount; i++)
+        _threads.push_back(std::thread(&TextureUploader::worker, this));
+}
+
+TextureUploader::~TextureUploader()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _condition.notify_all();
+    for (size_t i = 0; i < _threads.size(); i++)
+        _threads[i].join();
+
+    for (size_t i = 0; i < _slots.size(); i++) {
+        Slot& slot = _slots[i];
+        if (slot.pointer) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        if (slot.fence)
+            glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.buffer);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void TextureUploader::map(Slot& slot)
+{
+    // The fence has passed, so invalidating can't stall on a pending read
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+    slot.pointer = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, _slotSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+}
+
+Image TextureUploader::load(std::string path)
+{
+    Image image;
+    image.data = 0;
+
+    Job job;
+    job.path = path;
+    job.format = FORMAT_RGBA8;
+    job.supported = true;
+
+    Pending pending;
+
+    glGenTextures(1, &image.handle);
+    bindTexture(GL_TEXTURE_2D, image.handle);
+
+    // Storage is allocated here, the workers only ever fill it in
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".ktx2") == 0) {
+        TextureFile header;
+        if (!readTextureHeader(path, header)) {
+            std::cout << "Failed to load image at: " << path << std::endl;
+            exit(0);
+        }
+
+        job.format = header.format;
+        job.supported = isTextureFormatSupported(header.format);
+        bool compressed = isBlockCompressed(header.format) && job.supported;
+
+        image.width = header.width;
+        image.height = header.height;
+        image.levels = (int) header.levels.size();
+        image.byteSize = 0;
+        for (int i = 0; i < image.levels; i++) {
+            int width = header.levels[i].width, height = header.levels[i].height;
+            if (compressed) {
+                size_t size = textureLevelSize(header.format, width, height);
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, textureInternalFormat(header.format), width, height, 0, (GLsizei) size, 0);
+                image.byteSize += size;
+            }
+            else {
+                glTexImage2D(GL_TEXTURE_2D, i, isSrgb(header.format) ? GL_SRGB8_ALPHA8 : GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+                image.byteSize += (size_t) width * height * 4;
+            }
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels - 1);
+
+        pending.remainingBytes = image.byteSize;
+        pending.generateMipmaps = false;
+    }
+    else {
+        int comp;
+        if (!stbi_info(path.c_str(), &image.width, &image.height, &comp)) {
+            std::cout << "Failed to load image at: " << path << std::endl;
+            exit(0);
+        }
+
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+        image.levels = 1;
+        for (int size = std::max(image.width, image.height); size > 1; size /= 2)
+            image.levels++;
+        image.byteSize = (size_t) image.width * image.height * 4 * 4 / 3;
+
+        pending.remainingBytes = (size_t) image.width * image.height * 4;
+        pending.generateMipmaps = true;
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    job.id = _nextJob++;
+    job.texture = image.handle;
+    // The handle may have belonged to a deleted texture that failed
+    _failedTextures.erase(image.handle);
+    pending.job = job.id;
+    _pending[image.handle] = pending;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _jobs.push_back(job);
+    }
+    _condition.notify_all();
+
+    return image;
+}
+
+void TextureUploader::update()
+{
+    // Workers only take free slots, so filled and in-flight ones belong to
+    // this thread. The lock is only held to read and change slot states.
+    std::vector<Slot*> inFlight, filled;
+    std::vector<unsigned int> failed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _slots.size(); i++) {
+            if (_slots[i].state == SLOT_IN_FLIGHT)
+                inFlight.push_back(&_slots[i]);
+            else if (_slots[i].state == SLOT_FILLED)
+                filled.push_back(&_slots[i]);
+        }
+        failed.swap(_failed);
+    }
+
+    for (size_t i = 0; i < failed.size(); i++) {
+        for (std::map<GLuint, Pending>::iterator it = _pending.begin(); it != _pending.end(); ++it) {
+            if (it->second.job == failed[i]) {
+                _failedTextures.insert(it->first);
+                _pending.erase(it);
+                break;
+            }
+        }
+    }
+
+    // Remap buffers the GPU has finished reading for the workers
+    std::vector<Slot*> freed, submitted;
+    for (size_t i = 0; i < inFlight.size(); i++) {
+        Slot& slot = *inFlight[i];
+        GLenum status = glClientWaitSync(slot.fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(slot.fence);
+            slot.fence = 0;
+            map(slot);
+            freed.push_back(&slot);
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    size_t uploaded = 0;
+    for (size_t i = 0; i < filled.size() && uploaded < maxUploadBytesPerFrame; i++) {
+        Slot& slot = *filled[i];
+
+        // Data for a cancelled or failed job is dropped, the buffer is
+        // still mapped and goes straight back to the workers
+        std::map<GLuint, Pending>::iterator pending = _pending.find(slot.texture);
+        if (pending == _pending.end() || pending->second.job != slot.job) {
+            freed.push_back(&slot);
+            continue;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        slot.pointer = 0;
+
+        // With a PBO bound the data pointer is an offset into the buffer
+        bindTexture(GL_TEXTURE_2D, slot.texture);
+        if (isBlockCompressed(slot.format))
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, slot.level, 0, slot.y, slot.width, slot.rows, textureInternalFormat(slot.format), (GLsizei) slot.bytes, 0);
+        else
+            glTexSubImage2D(GL_TEXTURE_2D, slot.level, 0, slot.y, slot.width, slot.rows, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        submitted.push_back(&slot);
+        uploaded += slot.bytes;
+
+        pending->second.remainingBytes -= slot.bytes;
+        if (pending->second.remainingBytes == 0) {
+            if (pending->second.generateMipmaps)
+                glGenerateMipmap(GL_TEXTURE_2D);
+            _pending.erase(pending);
+        }
+    }
+
+    // Plain glTexImage2D calls elsewhere must not read from a PBO
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if (freed.empty() && submitted.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < submitted.size(); i++)
+            submitted[i]->state = SLOT_IN_FLIGHT;
+        for (size_t i = 0; i < freed.size(); i++)
+            freed[i]->state = SLOT_FREE;
+    }
+    if (!freed.empty())
+        _condition.notify_all();
+}
+
+bool TextureUploader::isLoaded(const Image& image) const
+{
+    return _pending.count(image.handle) == 0 && !failed(image);
+}
+
+void TextureUploader::cancel(const Image& image)
+{
+    _failedTextures.erase(image.handle);
+
+    std::map<GLuint, Pending>::iterator pending = _pending.find(image.handle);
+    if (pending == _pending.end())
+        return;
+    unsigned int job = pending->second.job;
+    _pending.erase(pending);
+
+    // Slots already filled for it are dropped by update()
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::deque<Job>::iterator it = _jobs.begin(); it != _jobs.end(); ++it) {
+        if (it->id == job) {
+            _jobs.erase(it);
+            break;
+        }
+    }
+}
+
+bool TextureUploader::uploadLevel(const Job& job, int level, int width, int height, const unsigned char* data)
+{
+    TextureFormat format = job.supported ? job.format : FORMAT_RGBA8;
+    int blockDim = isBlockCompressed(format) ? 4 : 1;
+    size_t rowBytes = textureLevelSize(format, width, blockDim);
+    if (rowBytes > _slotSize) {
+        std::cerr << "A row of level " << level << " doesn't fit in an upload slot: " << job.path << std::endl;
+        return false;
+    }
+    int bandRows = (int) (_slotSize / rowBytes) * blockDim;
+
+    for (int y = 0; y < height; y += bandRows) {
+        int rows = std::min(bandRows, height - y);
+        size_t bytes = textureLevelSize(format, width, rows);
+
+        Slot* slot = 0;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [&]() {
+                for (size_t i = 0; i < _slots.size() && !slot; i++) {
+                    if (_slots[i].state == SLOT_FREE)
+                        slot = &_slots[i];
+                }
+                return _stop || slot;
+            });
+            if (_stop)
+                return false;
+            slot->state = SLOT_FILLING;
+        }
+
+        memcpy(slot->pointer, data + (size_t) (y / blockDim) * rowBytes, bytes);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        slot->job = job.id;
+        slot->texture = job.texture;
+        slot->format = format;
+        slot->level = level;
+        slot->y = y;
+        slot->width = width;
+        slot->rows = rows;
+        slot->bytes = bytes;
+        slot->state = SLOT_FILLED;
+    }
+
+    return true;
+}
+
+void TextureUploader::worker()
+{
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [this]() { return _stop || !_jobs.empty(); });
+            if (_stop)
+                return;
+            job = _jobs.front();
+            _jobs.pop_front();
+        }
+
+        bool loaded = true;
+        if (job.path.size() > 5 && job.path.compare(job.path.size() - 5, 5, ".ktx2") == 0) {
+            TextureFile texture;
+            loaded = readTextureFile(job.path, texture);
+            for (size_t i = 0; loaded && i < texture.levels.size(); i++) {
+                const TextureLevel& level = texture.levels[i];
+                if (isBlockCompressed(job.format) && !job.supported) {
+                    std::vector<unsigned char> pixels = decompressImage(job.format, level.data.data(), level.width, level.height);
+                    loaded = uploadLevel(job, (int) i, level.width, level.height, pixels.data());
+                }
+                else
+                    loaded = uploadLevel(job, (int) i, level.width, level.height, level.data.data());
+            }
+        }
+        else {
+            int width, height;
+            unsigned char* pixels = loadRgbaPixels(job.path.c_str(), &width, &height);
+            loaded = pixels && uploadLevel(job, 0, width, height, pixels);
+            stbi_image_free(pixels);
+        }
+
+        if (!loaded) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_stop) {
+                std::cout << "Failed to load image at: " << job.path << std::endl;
+                _failed.push_back(job.id);
+            }
+        }
+    }
+}
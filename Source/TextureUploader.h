@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Image.h"
+#include "TextureFile.h"
+
+#include <GDT/OpenGL.h>
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Loads textures without stalling the GL thread. Worker threads decode the
+// files and copy the pixels into a ring of mapped pixel buffer objects;
+// update() then only has to unmap a filled buffer and issue a
+// glTexSubImage2D from it, which returns without waiting for the copy.
+//
+// Images bigger than a ring slot are uploaded in bands of rows, so the
+// memory in flight stays fixed no matter how large the textures are. A
+// band holds at least one row (of blocks), levels with wider rows than a
+// slot fail to load.
+class TextureUploader
+{
+public:
+    TextureUploader(int slotCount = 4, size_t slotSize = 4 * 1024 * 1024, int workerCount = 2);
+    ~TextureUploader();
+
+    // Creates the texture right away and queues its contents. The texture
+    // can be bound immediately but stays undefined until isLoaded().
+    // Accepts the same files as loadImage, including baked .ktx2 files.
+    Image load(std::string path);
+
+    // Submits filled buffers and recycles the ones the GPU is done with,
+    // call once per frame on the GL thread
+    void update();
+
+    // False for textures that failed to load, which never get any data
+    bool isLoaded(const Image& image) const;
+    bool failed(const Image& image) const { return _failedTextures.count(image.handle) != 0; }
+
+    // Drops what is still to be uploaded to the texture, call before
+    // deleting it. A file a worker is already reading is finished, but
+    // none of it reaches the texture.
+    void cancel(const Image& image);
+    size_t pendingCount() const { return _pending.size(); }
+
+    // Caps the bytes submitted per update to keep frame time flat
+    size_t maxUploadBytesPerFrame;
+
+private:
+    enum SlotState
+    {
+        SLOT_FREE,      // mapped, waiting for a worker
+        SLOT_FILLING,   // a worker is copying into it
+        SLOT_FILLED,    // ready to be unmapped and uploaded
+        SLOT_IN_FLIGHT  // upload issued, waiting on its fence
+    };
+
+    class Slot
+    {
+    public:
+        GLuint buffer;
+        void* pointer;
+        GLsync fence;
+        SlotState state;
+
+        // Region of the texture the slot's data goes to
+        unsigned int job;
+        GLuint texture;
+        TextureFormat format;
+        int level, y, width, rows;
+        size_t bytes;
+    };
+
+    class Job
+    {
+    public:
+        unsigned int id;
+        GLuint texture;
+        std::string path;
+        TextureFormat format;
+        bool supported;
+    };
+
+    class Pending
+    {
+    public:
+        // Texture handles are reused once deleted, slots and failures
+        // are matched by job instead
+        unsigned int job;
+        size_t remainingBytes;
+        bool generateMipmaps;
+    };
+
+    void worker();
+    bool uploadLevel(const Job& job, int level, int width, int height, const unsigned char* data);
+    void map(Slot& slot);
+
+    std::vector<Slot> _slots;
+    size_t _slotSize;
+
+    // Only touched on the GL thread
+    std::map<GLuint, Pending> _pending;
+    std::set<GLuint> _failedTextures;
+    unsigned int _nextJob;
+
+    // Jobs that failed, reported by the workers
+    std::vector<unsigned int> _failed;
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<Job> _jobs;
+    bool _stop;
+};
@@ -0,0 +1,544 @@
+// Micro-benchmarks for the CPU side kernels. Every suite runs once per SIMD
+// level the CPU supports, so the fallbacks can be compared directly.
+//
+// Usage: Benchmark [suite]
+//   pixels    pixel format conversions of a 4096x4096 image
+//   culling   frustum culling of 100k objects
+//   bvh       AABB tree queries on 100k objects against brute force
+//   occlusion software occlusion culling of 100k objects behind 400 boxes
+//   lights    assigning 256 and 4096 point lights to a 16x16x24 cluster grid
+//   verify    checks that the pixel kernels give the same bytes at every
+//             level, exits with 1 if any of them differ
+
+#include "Simd.h"
+#include "PixelConversion.h"
+#include "FrustumCulling.h"
+#include "AabbTree.h"
+#include "OcclusionBuffer.h"
+#include "LightGrid.h"
+#include "WorkerPool.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+namespace
+{
+    // Best of a few runs, in seconds
+    template <typename F>
+    double measure(F function)
+    {
+        double best = 1e30;
+        for (int run = 0; run < 5; run++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            function();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    }
+
+    void report(const char* name, size_t bytes, double seconds)
+    {
+        std::cout << "  " << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(8) << seconds * 1000 << " ms " << std::setw(8) << bytes / seconds / 1e9 << " GB/s" << std::endl;
+    }
+
+    void benchmarkPixels()
+    {
+        const size_t pixels = 4096 * 4096;
+
+        std::vector<unsigned char> rgb(pixels * 3), rgba(pixels * 4), packed(pixels * 4);
+        std::vector<float> floats(pixels * 4);
+        std::vector<uint16_t> halves(pixels * 4);
+
+        uint32_t seed = 1;
+        for (size_t i = 0; i < rgb.size(); i++) {
+            seed = seed * 1664525 + 1013904223;
+            rgb[i] = (unsigned char) (seed >> 24);
+        }
+        expandRgbToRgba(rgb.data(), rgba.data(), pixels);
+
+        // Bytes read plus bytes written
+        report("rgb to rgba", pixels * 7, measure([&]() { expandRgbToRgba(rgb.data(), rgba.data(), pixels); }));
+        report("to float", pixels * 20, measure([&]() { convertToFloat(rgba.data(), floats.data(), pixels, false); }));
+        report("srgb to float", pixels * 20, measure([&]() { convertToFloat(rgba.data(), floats.data(), pixels, true); }));
+        report("premultiply", pixels * 8, measure([&]() { packed = rgba; premultiplyAlpha(packed.data(), pixels); }));
+        report("pack normals", pixels * 8, measure([&]() { packNormalMap(rgba.data(), packed.data(), pixels); }));
+        report("float to half", pixels * 24, measure([&]() { floatToHalf(floats.data(), halves.data(), pixels * 4); }));
+    }
+
+    float halfValue(uint32_t half)
+    {
+        float magnitude = (half & 0x7c00) == 0
+            ? std::ldexp((float) (half & 0x3ff), -24)
+            : std::ldexp(1 + (half & 0x3ff) / 1024.0f, (int) ((half >> 10) & 0x1f) - 15);
+        return half & 0x8000 ? -magnitude : magnitude;
+    }
+
+    float floatFromBits(uint32_t bits)
+    {
+        float value;
+        memcpy(&value, &bits, 4);
+        return value;
+    }
+
+    // Every finite half, the ties halfway to the next one and the floats
+    // just either side of those ties, plus overflow, infinities and NaNs,
+    // all with both signs
+    std::vector<float> halfEdgeCases()
+    {
+        std::vector<float> values;
+        for (uint32_t half = 0; half < 0x7c00; half++) {
+            float value = halfValue(half);
+            float tie = (value + halfValue(half + 1)) / 2;
+            values.push_back(value);
+            values.push_back(tie);
+            values.push_back(std::nextafter(tie, 0.0f));
+            values.push_back(std::nextafter(tie, 1e30f));
+        }
+
+        const uint32_t special[] = {
+            0x00000001, 0x00800000, 0x33000000, 0x33000001, 0x387fc000, 0x387fe000,
+            0x477fe000, 0x477fefff, 0x477ff000, 0x47800000, 0x7f7fffff, 0x7f800000,
+            0x7f800001, 0x7fa00000, 0x7fc00000, 0x7fffffff, 0x7fc01000
+        };
+        for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+            values.push_back(floatFromBits(special[i]));
+
+        size_t count = values.size();
+        for (size_t i = 0; i < count; i++)
+            values.push_back(-values[i]);
+        return values;
+    }
+
+    // Runs the kernel at every level the CPU supports and compares the
+    // output bytes with the scalar run. The output is poisoned before each
+    // run so that elements a kernel skips show up as well.
+    template <typename T, typename F>
+    bool sameAtEveryLevel(const char* name, std::vector<T>& output, F kernel)
+    {
+        SimdLevel best = simdLevel();
+        std::vector<T> reference;
+        bool same = true;
+        for (int level = SIMD_SCALAR; level <= best; level++) {
+            setSimdLevel((SimdLevel) level);
+            memset(output.data(), 0xcd, output.size() * sizeof(T));
+            kernel();
+            if (level == SIMD_SCALAR) {
+                reference = output;
+                continue;
+            }
+            for (size_t i = 0; i < output.size(); i++) {
+                if (memcmp(&output[i], &reference[i], sizeof(T)) != 0) {
+                    std::cerr << "  " << name << ": " << simdLevelName((SimdLevel) level)
+                              << " differs from scalar at element " << i << std::endl;
+                    same = false;
+                    break;
+                }
+            }
+        }
+        setSimdLevel(best);
+        std::cout << "  " << std::left << std::setw(20) << name << (same ? "same" : "DIFFERENT") << std::endl;
+        return same;
+    }
+
+    int verifyPixels()
+    {
+        // Not a multiple of any vector width, so the scalar tails run too
+        const size_t pixels = 64 * 1024 + 7;
+
+        std::vector<unsigned char> rgb(pixels * 3), rgba(pixels * 4), bytes(pixels * 4);
+        std::vector<float> floats(pixels * 4);
+        uint32_t seed = 1;
+        for (size_t i = 0; i < rgb.size(); i++) {
+            seed = seed * 1664525 + 1013904223;
+            rgb[i] = (unsigned char) (seed >> 24);
+        }
+        for (size_t i = 0; i < rgba.size(); i++) {
+            seed = seed * 1664525 + 1013904223;
+            rgba[i] = (unsigned char) (seed >> 24);
+        }
+
+        std::vector<float> halfInputs = halfEdgeCases();
+        halfInputs.push_back(0.5f);
+        std::vector<uint16_t> halves(halfInputs.size());
+
+        bool same = true;
+        same &= sameAtEveryLevel("rgb to rgba", bytes, [&]() { expandRgbToRgba(rgb.data(), bytes.data(), pixels); });
+        same &= sameAtEveryLevel("to float", floats, [&]() { convertToFloat(rgba.data(), floats.data(), pixels, false); });
+        same &= sameAtEveryLevel("srgb to float", floats, [&]() { convertToFloat(rgba.data(), floats.data(), pixels, true); });
+        same &= sameAtEveryLevel("premultiply", bytes, [&]() { bytes = rgba; premultiplyAlpha(bytes.data(), pixels); });
+        same &= sameAtEveryLevel("pack normals", bytes, [&]() { packNormalMap(rgba.data(), bytes.data(), pixels); });
+        same &= sameAtEveryLevel("float to half", halves, [&]() { floatToHalf(halfInputs.data(), halves.data(), halfInputs.size()); });
+
+        // Identical isn't enough if they're all wrong, so check the scalar
+        // conversion against known results
+        const struct { uint32_t bits; uint16_t half; } known[] = {
+            { 0x00000000, 0x0000 }, { 0x80000000, 0x8000 }, { 0x3f800000, 0x3c00 },
+            { 0x3f801000, 0x3c00 }, { 0x3f803000, 0x3c02 }, { 0x3f801001, 0x3c01 },
+            { 0x33800000, 0x0001 }, { 0x33000000, 0x0000 }, { 0x33000001, 0x0001 },
+            { 0x33c00000, 0x0002 }, { 0x38800000, 0x0400 }, { 0x387fe000, 0x0400 },
+            { 0x477fe000, 0x7bff }, { 0x477fefff, 0x7bff }, { 0x477ff000, 0x7c00 },
+            { 0x7f800000, 0x7c00 }, { 0xff800000, 0xfc00 }, { 0x7fc00000, 0x7e00 },
+            { 0x7f802000, 0x7e01 }
+        };
+        SimdLevel best = simdLevel();
+        setSimdLevel(SIMD_SCALAR);
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+            float value = floatFromBits(known[i].bits);
+            uint16_t half;
+            floatToHalf(&value, &half, 1);
+            if (half != known[i].half) {
+                std::cerr << "  float to half: " << std::hex << known[i].bits << " gave " << half
+                          << " instead of " << known[i].half << std::dec << std::endl;
+                same = false;
+            }
+        }
+        setSimdLevel(best);
+
+        return same ? 0 : 1;
+    }
+
+    // Objects scattered through a 200 unit cube around the origin
+    std::vector<Bounds> randomScene(size_t objects)
+    {
+        std::vector<Bounds> scene(objects);
+        uint32_t seed = 1;
+        for (size_t i = 0; i < objects; i++) {
+            Bounds& bounds = scene[i];
+            float extent[3];
+            for (int c = 0; c < 3; c++) {
+                seed = seed * 1664525 + 1013904223;
+                bounds.center[c] = (seed >> 8) / 16777216.0f * 200 - 100;
+                seed = seed * 1664525 + 1013904223;
+                extent[c] = (seed >> 8) / 16777216.0f + 0.1f;
+            }
+            bounds.radius = std::sqrt(extent[0] * extent[0] + extent[1] * extent[1] + extent[2] * extent[2]);
+            for (int c = 0; c < 3; c++) {
+                bounds.min[c] = bounds.center[c] - extent[c];
+                bounds.max[c] = bounds.center[c] + extent[c];
+            }
+        }
+        return scene;
+    }
+
+    // 60 degree perspective looking down -z from the origin
+    Frustum cameraFrustum()
+    {
+        float f = 1 / std::tan(30 * 3.14159265f / 180);
+        float zNear = 0.1f, zFar = 100.0f;
+        float projection[16] = {
+            f / (16.0f / 9), 0, 0, 0,
+            0, f, 0, 0,
+            0, 0, (zFar + zNear) / (zNear - zFar), -1,
+            0, 0, 2 * zFar * zNear / (zNear - zFar), 0
+        };
+        return extractFrustum(projection);
+    }
+
+    void benchmarkCulling()
+    {
+        const size_t objects = 100000;
+
+        std::vector<Bounds> scene = randomScene(objects);
+        BoundsTable table;
+        for (size_t i = 0; i < objects; i++)
+            table.add(scene[i]);
+        Frustum frustum = cameraFrustum();
+
+        std::vector<uint32_t> visible;
+        WorkerPool pool;
+        size_t bytes = objects * 10 * sizeof(float);
+        report("cull", bytes, measure([&]() { cullFrustum(table, frustum, visible); }));
+        report("cull threaded", bytes, measure([&]() { cullFrustum(table, frustum, visible, &pool); }));
+        std::cout << "  " << visible.size() << " of " << objects << " visible, " << pool.threadCount() << " threads" << std::endl;
+    }
+
+    void benchmarkOcclusion()
+    {
+        const size_t objects = 100000;
+
+        // A city block of 20 by 20 buildings in front of the camera, each
+        // one a closed box of 12 triangles
+        std::vector<float> positions;
+        std::vector<unsigned int> indices;
+        const int faces[6][4] = {
+            { 0, 2, 3, 1 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 },
+            { 2, 6, 7, 3 }, { 0, 4, 6, 2 }, { 1, 3, 7, 5 }
+        };
+        for (int bx = 0; bx < 20; bx++) {
+            for (int bz = 0; bz < 20; bz++) {
+                unsigned int base = (unsigned int) (positions.size() / 3);
+                for (int corner = 0; corner < 8; corner++) {
+                    positions.push_back(bx * 10 - 100.0f + (corner & 1 ? 6 : 0));
+                    positions.push_back(corner & 2 ? 20.0f : -100.0f);
+                    positions.push_back(-10.0f - bz * 10 - (corner & 4 ? 0 : 6));
+                }
+                for (int f = 0; f < 6; f++) {
+                    const int* q = faces[f];
+                    unsigned int quad[6] = { 0, 1, 2, 0, 2, 3 };
+                    for (int i = 0; i < 6; i++)
+                        indices.push_back(base + q[quad[i]]);
+                }
+            }
+        }
+        float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+
+        std::vector<Bounds> scene = randomScene(objects);
+        BoundsTable table;
+        for (size_t i = 0; i < objects; i++)
+            table.add(scene[i]);
+
+        Frustum frustum = cameraFrustum();
+        float f = 1 / std::tan(30 * 3.14159265f / 180);
+        float projection[16] = {
+            f / (16.0f / 9), 0, 0, 0,
+            0, f, 0, 0,
+            0, 0, -100.1f / 99.9f, -1,
+            0, 0, -20.0f / 99.9f, 0
+        };
+
+        WorkerPool pool;
+        OcclusionBuffer buffer;
+        std::vector<uint32_t> frustumVisible, visible;
+        cullFrustum(table, frustum, frustumVisible);
+
+        buffer.begin(projection);
+        buffer.addOccluder(positions.data(), positions.size() / 3, indices.data(), indices.size(), identity);
+        size_t pixels = (size_t) buffer.width() * buffer.height();
+        report("rasterize", pixels * 4, measure([&]() { buffer.rasterize(); }));
+        report("rasterize threaded", pixels * 4, measure([&]() { buffer.rasterize(&pool); }));
+        report("test", frustumVisible.size() * 40, measure([&]() {
+            visible = frustumVisible;
+            buffer.cullOccluded(table, visible);
+        }));
+        report("test threaded", frustumVisible.size() * 40, measure([&]() {
+            visible = frustumVisible;
+            buffer.cullOccluded(table, visible, &pool);
+        }));
+        std::cout << "  " << buffer.stats().rasterizedTriangles << " of " << buffer.stats().occluderTriangles << " occluder triangles drawn, "
+                  << visible.size() << " of " << frustumVisible.size() << " objects in the frustum visible" << std::endl;
+    }
+
+    void reportQueries(const char* name, size_t queries, double seconds)
+    {
+        std::cout << "  " << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(8) << seconds * 1000 << " ms " << std::setw(8) << queries / seconds / 1e3 << " k/s" << std::endl;
+    }
+
+    void benchmarkBvh()
+    {
+        const size_t objects = 100000;
+        const size_t queries = 1000;
+
+        std::vector<Bounds> scene = randomScene(objects);
+        std::vector<Aabb> boxes(objects);
+        AabbTree tree;
+        std::vector<int> proxies(objects);
+        for (size_t i = 0; i < objects; i++) {
+            for (int c = 0; c < 3; c++) {
+                boxes[i].min[c] = scene[i].min[c];
+                boxes[i].max[c] = scene[i].max[c];
+            }
+        }
+        reportQueries("build", objects, measure([&]() {
+            tree.clear();
+            for (size_t i = 0; i < objects; i++)
+                proxies[i] = tree.insert(boxes[i], (int) i);
+        }));
+        std::cout << "  height " << tree.height() << std::endl;
+
+        // Query shapes spread through the scene
+        std::vector<Aabb> queryBoxes(queries);
+        std::vector<float> origins(queries * 3), directions(queries * 3);
+        uint32_t seed = 2;
+        for (size_t q = 0; q < queries; q++) {
+            for (int c = 0; c < 3; c++) {
+                seed = seed * 1664525 + 1013904223;
+                float x = (seed >> 8) / 16777216.0f * 200 - 100;
+                queryBoxes[q].min[c] = x - 5;
+                queryBoxes[q].max[c] = x + 5;
+                origins[q * 3 + c] = x;
+                seed = seed * 1664525 + 1013904223;
+                directions[q * 3 + c] = (seed >> 8) / 16777216.0f - 0.5f;
+            }
+        }
+
+        // Totals over all queries, the tree also finds boxes that only
+        // touch the query with their margin
+        std::vector<int> results;
+        size_t found = 0, hits = 0;
+        reportQueries("box tree", queries, measure([&]() {
+            found = 0;
+            for (size_t q = 0; q < queries; q++) {
+                tree.queryBox(queryBoxes[q], results);
+                found += results.size();
+            }
+        }));
+        reportQueries("box brute force", queries, measure([&]() {
+            hits = 0;
+            for (size_t q = 0; q < queries; q++) {
+                for (size_t i = 0; i < objects; i++) {
+                    bool overlap = true;
+                    for (int c = 0; c < 3; c++)
+                        overlap = overlap && boxes[i].max[c] >= queryBoxes[q].min[c] && boxes[i].min[c] <= queryBoxes[q].max[c];
+                    hits += overlap;
+                }
+            }
+        }));
+        std::cout << "  " << found << " found by the tree, " << hits << " by brute force" << std::endl;
+
+        reportQueries("sphere tree", queries, measure([&]() {
+            found = 0;
+            for (size_t q = 0; q < queries; q++) {
+                tree.querySphere(&origins[q * 3], 5, results);
+                found += results.size();
+            }
+        }));
+        reportQueries("sphere brute force", queries, measure([&]() {
+            hits = 0;
+            for (size_t q = 0; q < queries; q++) {
+                const float* center = &origins[q * 3];
+                for (size_t i = 0; i < objects; i++) {
+                    float distance = 0;
+                    for (int c = 0; c < 3; c++) {
+                        float d = center[c] - std::max(boxes[i].min[c], std::min(center[c], boxes[i].max[c]));
+                        distance += d * d;
+                    }
+                    hits += distance <= 25;
+                }
+            }
+        }));
+        std::cout << "  " << found << " found by the tree, " << hits << " by brute force" << std::endl;
+
+        reportQueries("ray tree", queries, measure([&]() {
+            found = 0;
+            for (size_t q = 0; q < queries; q++) {
+                tree.queryRay(&origins[q * 3], &directions[q * 3], 50, results);
+                found += results.size();
+            }
+        }));
+        reportQueries("ray brute force", queries, measure([&]() {
+            hits = 0;
+            for (size_t q = 0; q < queries; q++) {
+                for (size_t i = 0; i < objects; i++) {
+                    float enter = 0, exit = 50;
+                    for (int c = 0; c < 3; c++) {
+                        float inverse = 1 / directions[q * 3 + c];
+                        float t0 = (boxes[i].min[c] - origins[q * 3 + c]) * inverse;
+                        float t1 = (boxes[i].max[c] - origins[q * 3 + c]) * inverse;
+                        enter = std::max(enter, std::min(t0, t1));
+                        exit = std::min(exit, std::max(t0, t1));
+                    }
+                    hits += enter <= exit;
+                }
+            }
+        }));
+        std::cout << "  " << found << " found by the tree, " << hits << " by brute force" << std::endl;
+
+        Frustum frustum = cameraFrustum();
+        BoundsTable table;
+        for (size_t i = 0; i < objects; i++)
+            table.add(scene[i]);
+        std::vector<uint32_t> visible;
+        reportQueries("frustum tree", 1, measure([&]() { tree.queryFrustum(frustum, results); }));
+        reportQueries("frustum table", 1, measure([&]() { cullFrustum(table, frustum, visible); }));
+
+        // A tenth of the objects drifting, most stay inside their margin
+        reportQueries("move 10%", objects / 10, measure([&]() {
+            for (size_t i = 0; i < objects; i += 10) {
+                for (int c = 0; c < 3; c++) {
+                    boxes[i].min[c] += 0.05f;
+                    boxes[i].max[c] += 0.05f;
+                }
+                tree.move(proxies[i], boxes[i]);
+            }
+        }));
+        std::cout << "  height " << tree.height() << " after moving" << std::endl;
+    }
+
+    void benchmarkLights()
+    {
+        // Inverse of the 60 degree perspective in cameraFrustum
+        float f = 1 / std::tan(30 * 3.14159265f / 180);
+        float zNear = 0.1f, zFar = 100.0f;
+        float a = (zFar + zNear) / (zNear - zFar), b = 2 * zFar * zNear / (zNear - zFar);
+        float inverseProjection[16] = {
+            16.0f / 9 / f, 0, 0, 0,
+            0, 1 / f, 0, 0,
+            0, 0, 0, 1 / b,
+            0, 0, -1, a / b
+        };
+
+        WorkerPool pool;
+        LightGrid grid;
+        grid.setProjection(inverseProjection, zNear, zFar);
+
+        const size_t counts[] = { 256, 4096 };
+        for (int c = 0; c < 2; c++) {
+            // Lights of radius 1 to 5 in the half of the random scene's
+            // cube in front of the camera
+            size_t lights = counts[c];
+            std::vector<float> spheres(lights * 4);
+            uint32_t seed = 1;
+            for (size_t i = 0; i < lights * 4; i++) {
+                seed = seed * 1664525 + 1013904223;
+                float value = (seed >> 8) / 16777216.0f;
+                spheres[i] = i % 4 == 3 ? value * 4 + 1 : i % 4 == 2 ? -value * 100 : value * 200 - 100;
+            }
+
+            std::string name = std::to_string(lights) + " lights";
+            std::string threaded = name + " threaded";
+            reportQueries(name.c_str(), lights, measure([&]() { grid.assign(spheres.data(), lights); }));
+            reportQueries(threaded.c_str(), lights, measure([&]() { grid.assign(spheres.data(), lights, &pool); }));
+            std::cout << "  " << grid.stats().assignments << " cluster entries, at most " << grid.stats().maxPerCluster
+                      << " per cluster, " << grid.stats().dropped << " dropped" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string suite = argc > 1 ? argv[1] : "pixels";
+
+    // Mostly scalar code, the frustum comparison uses the best level
+    if (suite == "bvh") {
+        benchmarkBvh();
+        return 0;
+    }
+
+    // Compares the levels with each other rather than timing them
+    if (suite == "verify")
+        return verifyPixels();
+
+    SimdLevel best = simdLevel();
+    for (int level = SIMD_SCALAR; level <= best; level++) {
+        setSimdLevel((SimdLevel) level);
+        std::cout << simdLevelName((SimdLevel) level) << std::endl;
+
+        if (suite == "pixels")
+            benchmarkPixels();
+        else if (suite == "culling")
+            benchmarkCulling();
+        else if (suite == "occlusion")
+            benchmarkOcclusion();
+        else if (suite == "lights")
+            benchmarkLights();
+        else {
+            std::cerr << "Unknown suite: " << suite << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Offline texture baker: decodes a source image, filters its mip chain,
+// block compresses every level and writes the result as a .ktx2 file that
+// loadImage uploads directly with glCompressedTexImage2D.
+//
+// Usage: TextureBaker <input image> <output.ktx2> [options]
+//   --format rgba|bc1|bc3|bc5|bc7   output format, bc7 by default
+//   --srgb                          colour data is sRGB encoded
+//   --filter box|lanczos|kaiser     mip filter, kaiser by default
+//   --premultiply                   multiply colour by alpha before filtering
+//   --normal                        tangent space normal map, stores X and Y
+//                                   for bc5 and renormalizes every level
+
+#include "TextureFile.h"
+#include "BlockCompression.h"
+#include "MipGenerator.h"
+#include "PixelConversion.h"
+#include "WorkerPool.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <chrono>
+
+static TextureFormat parseFormat(std::string name, bool srgb)
+{
+    if (name == "rgba") return srgb ? FORMAT_RGBA8_SRGB : FORMAT_RGBA8;
+    if (name == "bc1") return srgb ? FORMAT_BC1_SRGB : FORMAT_BC1;
+    if (name == "bc3") return srgb ? FORMAT_BC3_SRGB : FORMAT_BC3;
+    if (name == "bc5") return FORMAT_BC5;
+    if (name == "bc7") return srgb ? FORMAT_BC7_SRGB : FORMAT_BC7;
+    return FORMAT_UNDEFINED;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        std::cerr << "Usage: TextureBaker <input image> <output.ktx2> [--format rgba|bc1|bc3|bc5|bc7] [--srgb] [--filter box|lanczos|kaiser] [--premultiply] [--normal]" << std::endl;
+        return 1;
+    }
+
+    std::string formatName = "bc7";
+    std::string filterName = "kaiser";
+    bool srgb = false;
+    bool premultiply = false;
+    bool normal = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+            formatName = argv[++i];
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filterName = argv[++i];
+        else if (strcmp(argv[i], "--srgb") == 0)
+            srgb = true;
+        else if (strcmp(argv[i], "--premultiply") == 0)
+            premultiply = true;
+        else if (strcmp(argv[i], "--normal") == 0)
+            normal = true;
+        else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    TextureFormat format = parseFormat(formatName, srgb);
+    if (format == FORMAT_UNDEFINED) {
+        std::cerr << "Unknown format: " << formatName << std::endl;
+        return 1;
+    }
+
+    MipFilter filter = filterName == "box" ? MIP_BOX : filterName == "lanczos" ? MIP_LANCZOS : MIP_KAISER;
+
+    if (normal && isSrgb(format)) {
+        std::cerr << "Normal maps can't be sRGB" << std::endl;
+        return 1;
+    }
+
+    int width, height;
+    unsigned char* pixels = loadRgbaPixels(argv[1], &width, &height);
+    if (!pixels) {
+        std::cerr << "Failed to load image at: " << argv[1] << std::endl;
+        return 1;
+    }
+
+    // clock() adds up CPU time over all threads, so use wall time here
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (premultiply)
+        premultiplyAlpha(pixels, (size_t) width * height);
+    WorkerPool pool;
+    std::vector<TextureLevel> chain = generateMipChain(pixels, width, height, isSrgb(format), filter, &pool);
+    stbi_image_free(pixels);
+
+    // Filtering shortens the normals, so pack them after the chain is built
+    if (normal) {
+        for (size_t i = 0; i < chain.size(); i++)
+            packNormalMap(chain[i].data.data(), chain[i].data.data(), (size_t) chain[i].width * chain[i].height);
+    }
+    std::chrono::steady_clock::time_point mipsDone = std::chrono::steady_clock::now();
+
+    TextureFile texture;
+    texture.format = format;
+    texture.width = width;
+    texture.height = height;
+    texture.levels.resize(chain.size());
+
+    size_t uncompressedSize = 0;
+    for (size_t i = 0; i < chain.size(); i++) {
+        uncompressedSize += chain[i].data.size();
+        texture.levels[i].width = chain[i].width;
+        texture.levels[i].height = chain[i].height;
+        texture.levels[i].data = isBlockCompressed(format)
+            ? compressImage(format, chain[i].data.data(), chain[i].width, chain[i].height)
+            : chain[i].data;
+    }
+    std::chrono::steady_clock::time_point encodeDone = std::chrono::steady_clock::now();
+
+    if (!writeTextureFile(argv[2], texture))
+        return 1;
+
+    // Texture memory with the full mip chain, as uploaded by loadImage
+    std::cout << argv[1] << ": " << width << "x" << height << ", " << chain.size() << " levels" << std::endl;
+    std::cout << "  RGBA8:      " << uncompressedSize / 1024 << " KiB" << std::endl;
+    std::cout << "  " << formatName << ":        " << texture.byteSize() / 1024 << " KiB ("
+              << (float) uncompressedSize / texture.byteSize() << "x smaller)" << std::endl;
+    std::cout << "  Mips in " << std::chrono::duration_cast<std::chrono::milliseconds>(mipsDone - start).count() << " ms, "
+              << "encoded in " << std::chrono::duration_cast<std::chrono::milliseconds>(encodeDone - mipsDone).count() << " ms" << std::endl;
+
+    return 0;
+}
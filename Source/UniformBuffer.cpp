@@ -0,0 +1,112 @@
+#include "UniformBuffer.h"
+
+#include <algorithm>
+#include <iostream>
+
+static_assert(sizeof(FrameData) == 176, "FrameData must match the std140 block");
+static_assert(sizeof(MaterialData) == 64, "MaterialData must match the std140 block");
+static_assert(sizeof(ShadowData) == 272, "ShadowData must match the std140 block");
+static_assert(sizeof(LightGridData) == 32, "LightGridData must match the std140 block");
+
+const int MaterialTable::MAX_MATERIALS;
+
+UniformBuffer::UniformBuffer() :
+    handle(0),
+    size(0),
+    block(FRAME_BLOCK)
+{
+
+}
+
+void UniformBuffer::create(UniformBlock block, size_t size)
+{
+    this->size = size;
+    this->block = block;
+    glGenBuffers(1, &handle);
+    glBindBuffer(GL_UNIFORM_BUFFER, handle);
+    glBufferData(GL_UNIFORM_BUFFER, size, 0, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, block, handle);
+}
+
+void UniformBuffer::destroy()
+{
+    glDeleteBuffers(1, &handle);
+    handle = 0;
+}
+
+void UniformBuffer::update(const void* data, size_t size)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, handle);
+    glBufferData(GL_UNIFORM_BUFFER, this->size, 0, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+}
+
+void UniformBuffer::write(StreamBuffer& stream, const void* data, size_t size)
+{
+    StreamAllocation allocation = stream.write(data, size, stream.uniformAlignment());
+    if (allocation.size > 0)
+        glBindBufferRange(GL_UNIFORM_BUFFER, block, stream.handle(), allocation.offset, size);
+    else {
+        update(data, size);
+        glBindBufferBase(GL_UNIFORM_BUFFER, block, handle);
+    }
+}
+
+void UniformBuffer::update(size_t offset, const void* data, size_t size)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, handle);
+    glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+}
+
+void MaterialTable::create()
+{
+    _buffer.create(MATERIAL_BLOCK, MAX_MATERIALS * sizeof(MaterialData));
+    _dirtyBegin = _dirtyEnd = 0;
+}
+
+void MaterialTable::destroy()
+{
+    _buffer.destroy();
+    _data.clear();
+}
+
+int MaterialTable::add(Material& material)
+{
+    if (_data.size() == MAX_MATERIALS) {
+        std::cerr << "Too many materials, the limit is " << MAX_MATERIALS << std::endl;
+        exit(1);
+    }
+
+    material.index = (int) _data.size();
+    _data.push_back(MaterialData());
+    update(material);
+    return material.index;
+}
+
+void MaterialTable::update(const Material& material)
+{
+    MaterialData& data = _data[material.index];
+    data.ka = Vector4f(material.ka, 1);
+    data.kd = Vector4f(material.kd, 1);
+    data.uvTransform = material.colorMap.uvTransform;
+    data.ks = material.ks;
+    data.textureLayer = (float) material.colorMap.layer;
+
+    if (_dirtyBegin == _dirtyEnd) {
+        _dirtyBegin = material.index;
+        _dirtyEnd = material.index + 1;
+    }
+    else {
+        _dirtyBegin = std::min(_dirtyBegin, material.index);
+        _dirtyEnd = std::max(_dirtyEnd, material.index + 1);
+    }
+}
+
+void MaterialTable::upload()
+{
+    if (_dirtyBegin == _dirtyEnd)
+        return;
+
+    _buffer.update(_dirtyBegin * sizeof(MaterialData), &_data[_dirtyBegin], (_dirtyEnd - _dirtyBegin) * sizeof(MaterialData));
+    _dirtyBegin = _dirtyEnd = 0;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "Material.h"
+#include "VertexLayout.h"
+#include "StreamBuffer.h"
+
+#include <GDT/OpenGL.h>
+#include <GDT/Matrix4f.h>
+#include <GDT/Vector4f.h>
+
+#include <vector>
+
+// std140 layout of the FrameData block, see blinnphong.vert. Matrices and
+// vec4s need no padding; vec3s are stored as vec4 to keep it that way.
+class FrameData
+{
+public:
+    Matrix4f projMatrix;
+    Matrix4f viewMatrix;
+    Vector4f cameraPosition;
+    Vector4f lightPosition;
+    Vector4f lightColor;
+};
+
+// One entry of the MaterialData block's array, 64 bytes in std140
+class MaterialData
+{
+public:
+    Vector4f ka;
+    Vector4f kd;
+    Vector4f uvTransform;
+    float ks;
+    float textureLayer;
+    float padding[2];
+};
+
+// Cascades in the ShadowData block, see ShadowCascades.h
+const int MAX_CASCADES = 4;
+
+// std140 layout of the ShadowData block, see blinnphong.frag. The matrices
+// take world space to shadow map coordinates in [0, 1]; the splits are the
+// view depths where each cascade ends.
+class ShadowData
+{
+public:
+    Matrix4f cascadeMatrices[MAX_CASCADES];
+    Vector4f cascadeSplits;
+};
+
+// std140 layout of the LightGridData block, see blinnphong.frag and
+// ClusteredLights.h. gridSize holds the tiles across, tiles down, slices
+// and light count; gridScale the tiles per pixel across and down and the
+// slice scale and bias applied to log(view depth).
+class LightGridData
+{
+public:
+    Vector4f gridSize;
+    Vector4f gridScale;
+};
+
+// A uniform buffer bound to a block's binding point
+class UniformBuffer
+{
+public:
+    UniformBuffer();
+
+    void create(UniformBlock block, size_t size);
+    void destroy();
+
+    // Replaces the contents, orphaning the old storage so a frame the GPU
+    // is still reading doesn't stall the update
+    void update(const void* data, size_t size);
+    void update(size_t offset, const void* data, size_t size);
+
+    // For data written every frame: puts it in the frame's region of the
+    // stream and binds that range to the block. Only when the region is
+    // full does it update() this buffer and bind it instead.
+    void write(StreamBuffer& stream, const void* data, size_t size);
+
+    GLuint handle;
+    size_t size;
+    UniformBlock block;
+};
+
+// All materials in one buffer, so a draw only selects its material by index
+// and materials are uploaded when they change instead of per draw
+class MaterialTable
+{
+public:
+    // 16 KiB is the smallest uniform block size GL guarantees
+    static const int MAX_MATERIALS = 256;
+
+    void create();
+    void destroy();
+
+    // Stores the material and gives it its index in the table
+    int add(Material& material);
+    void update(const Material& material);
+
+    // Uploads the materials that changed since the last call
+    void upload();
+
+private:
+    UniformBuffer _buffer;
+    std::vector<MaterialData> _data;
+    int _dirtyBegin, _dirtyEnd;
+};
@@ -0,0 +1,11 @@
+#include "VertexLayout.h"
+
+const char* uniformBlockName(UniformBlock block)
+{
+    switch (block) {
+    case FRAME_BLOCK: return "FrameData";
+    case MATERIAL_BLOCK: return "MaterialData";
+    case SHADOW_BLOCK: return "ShadowData";
+    default: return "LightGridData";
+    }
+}
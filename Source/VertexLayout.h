@@ -0,0 +1,28 @@
+#pragma once
+
+#include <GDT/OpenGL.h>
+
+// Slots and binding points every program and vertex array agrees on.
+// Program binds attributes and blocks to these when it links; the render
+// modules set up their vertex arrays and buffers to match.
+
+// Attribute slots of the per-instance data, see InstanceSet.h and
+// MultiDrawBatch.h. The matrix takes four slots, one per column.
+const GLuint INSTANCE_MATRIX_ATTRIBUTE = 3;
+const GLuint INSTANCE_MATERIAL_ATTRIBUTE = 7;
+const GLuint INSTANCE_INDEX_ATTRIBUTE = 8;
+
+// Binding points of the uniform blocks shared by every program, so the
+// buffers only need to be bound to their points once
+enum UniformBlock
+{
+    FRAME_BLOCK,
+    MATERIAL_BLOCK,
+    SHADOW_BLOCK,
+    LIGHT_GRID_BLOCK
+};
+
+const int UNIFORM_BLOCK_COUNT = LIGHT_GRID_BLOCK + 1;
+
+// The block's name in the shaders
+const char* uniformBlockName(UniformBlock block);
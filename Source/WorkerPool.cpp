@@ -0,0 +1,91 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(int workerCount) :
+    _job(0),
+    _count(0),
+    _grain(1),
+    _next(0),
+    _active(0),
+    _generation(0),
+    _stop(false)
+{
+    if (workerCount < 0)
+        workerCount = std::max(0, (int) std::thread::hardware_concurrency() - 1);
+
+    for (int i = 0; i < workerCount; i++)
+        _threads.push_back(std::thread(&WorkerPool::worker, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _start.notify_all();
+    for (size_t i = 0; i < _threads.size(); i++)
+        _threads[i].join();
+}
+
+void WorkerPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn)
+{
+    grain = std::max<size_t>(grain, 1);
+    if (count == 0)
+        return;
+
+    // Not worth waking anyone for a single chunk
+    if (_threads.empty() || count <= grain) {
+        fn(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = &fn;
+        _count = count;
+        _grain = grain;
+        _next = 0;
+        _active = (int) _threads.size();
+        _generation++;
+    }
+    _start.notify_all();
+
+    runChunks();
+
+    // Workers that woke up late still have to check in before fn goes away
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this]() { return _active == 0; });
+    _job = 0;
+}
+
+void WorkerPool::runChunks()
+{
+    for (;;) {
+        size_t begin = _next.fetch_add(_grain);
+        if (begin >= _count)
+            return;
+        (*_job)(begin, std::min(begin + _grain, _count));
+    }
+}
+
+void WorkerPool::worker()
+{
+    unsigned int seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _start.wait(lock, [this, seen]() { return _stop || _generation != seen; });
+            if (_stop)
+                return;
+            seen = _generation;
+        }
+
+        runChunks();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_active == 0)
+            _done.notify_one();
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Threads that stay alive between jobs, for work that has to be split up
+// every frame or many times in a row like the passes of a mip chain.
+// Starting threads per call costs more than the jobs themselves at this size.
+class WorkerPool
+{
+public:
+    // By default one worker less than the hardware threads, the caller of
+    // parallelFor makes up the last one
+    explicit WorkerPool(int workerCount = -1);
+    ~WorkerPool();
+
+    // Calls fn(begin, end) over [0, count) in chunks of at most grain items
+    // and returns once all of them are done. Chunks run on the workers and
+    // the calling thread, in no particular order. Only one thread may call
+    // this at a time.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+    // Threads taking part in parallelFor, including the caller
+    int threadCount() const { return (int) _threads.size() + 1; }
+
+private:
+    void worker();
+    void runChunks();
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+
+    // The job being run, valid while _active is non-zero
+    const std::function<void(size_t, size_t)>* _job;
+    size_t _count;
+    size_t _grain;
+    std::atomic<size_t> _next;
+    int _active;
+    unsigned int _generation;
+    bool _stop;
+};